@@ -0,0 +1,58 @@
+#!/usr/bin/env python
+
+import argparse
+
+import numpy as np
+import path
+import scipy.io
+
+import morefusion
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        formatter_class=argparse.ArgumentDefaultsHelpFormatter,
+    )
+    parser.add_argument("--scene-id", default="0048", help="scene id")
+    parser.add_argument("--sampling", type=int, default=1, help="sampling")
+    parser.add_argument(
+        "--out", default="frames_0048.txt", help="frames list of mapping_benchmark"
+    )
+    args = parser.parse_args()
+
+    dataset = morefusion.datasets.YCBVideoDataset
+    scene_dir = path.Path(dataset._root_dir) / dataset._data_dir / args.scene_id
+    meta_files = sorted(scene_dir.glob("*-meta.mat"))[:: args.sampling]
+
+    with open(args.out, "w") as f:
+        f.write(
+            "# depth_file label_file depth_unit fx fy cx cy "
+            "T_camera2world[:3, :4]\n"
+        )
+        for meta_file in meta_files:
+            image_prefix = meta_file[: -len("meta.mat")]
+            meta = scipy.io.loadmat(
+                meta_file, squeeze_me=True, struct_as_record=True
+            )
+            K = meta["intrinsic_matrix"]
+            T_world2camera = np.r_[
+                meta["rotation_translation_matrix"], [[0, 0, 0, 1]]
+            ]
+            T_camera2world = np.linalg.inv(T_world2camera)
+
+            values = [
+                image_prefix + "depth.png",
+                image_prefix + "label.png",
+                1.0 / meta["factor_depth"],
+                K[0, 0],
+                K[1, 1],
+                K[0, 2],
+                K[1, 2],
+            ]
+            values += T_camera2world[:3, :4].flatten().tolist()
+            f.write(" ".join(str(value) for value in values) + "\n")
+    print(f"Wrote {len(meta_files)} frames to: {args.out}")
+
+
+if __name__ == "__main__":
+    main()
@@ -2,33 +2,69 @@ import numpy as np
 import octomap
 import trimesh
 
+try:
+    # C++ engine built with ros/src/morefusion_ros
+    import morefusion_mapping
+except ImportError:
+    morefusion_mapping = None
+
 
 class MultiInstanceOctreeMapping:
-    def __init__(self):
+
+    """Octrees of multiple instances.
+
+    Parameters
+    ----------
+    backend: str, optional
+        'cpp' for the C++ engine (module morefusion_mapping), or 'python' for
+        octomap-python. (default: 'cpp' if morefusion_mapping is importable)
+    """
+
+    def __init__(self, backend=None):
+        if backend is None:
+            backend = "python" if morefusion_mapping is None else "cpp"
+        assert backend in ("cpp", "python")
+        if backend == "cpp" and morefusion_mapping is None:
+            raise ImportError("morefusion_mapping is required for backend cpp")
+
+        self._engine = None
+        if backend == "cpp":
+            self._engine = morefusion_mapping.MultiInstanceOctreeMapping()
         self._octrees = {}  # key: instance_id, value: octree
         self._pcds = {}  # key: instance_id, value: (occupied, empty)
 
     @property
     def instance_ids(self):
+        if self._engine is not None:
+            return self._engine.instance_ids
         return list(self._octrees.keys())
 
     def initialize(self, instance_id, *, pitch):
         if instance_id in self.instance_ids:
             raise ValueError("instance {instance_id} already exists")
+        if self._engine is not None:
+            self._engine.initialize(instance_id, pitch=pitch)
+            return
         self._octrees[instance_id] = octomap.OcTree(pitch)
 
     def integrate(self, instance_id, mask, pcd, origin=(0, 0, 0)):
         origin = np.asarray(origin, dtype=float)
-        octree = self._octrees[instance_id]
-        nonnan = ~np.isnan(pcd).any(axis=2)
-        octree.insertPointCloud(pcd[mask & nonnan], origin=origin)
+        if self._engine is not None:
+            self._engine.integrate(instance_id, mask, pcd, origin)
+        else:
+            octree = self._octrees[instance_id]
+            nonnan = ~np.isnan(pcd).any(axis=2)
+            octree.insertPointCloud(pcd[mask & nonnan], origin=origin)
         if instance_id in self._pcds:
             self._pcds.pop(instance_id)  # clear cache
 
     def update(self, instance_id, occupied):
-        octree = self._octrees[instance_id]
-        octree.updateNodes(occupied, True, lazy_eval=True)
-        octree.updateInnerOccupancy()
+        if self._engine is not None:
+            self._engine.update(instance_id, occupied)
+        else:
+            octree = self._octrees[instance_id]
+            octree.updateNodes(occupied, True, lazy_eval=True)
+            octree.updateInnerOccupancy()
         if instance_id in self._pcds:
             self._pcds.pop(instance_id)  # clear cache
 
@@ -60,6 +96,14 @@ class MultiInstanceOctreeMapping:
         assert (np.asarray(dimensions) > 0).all()
         assert pitch > 0
 
+        if self._engine is not None:
+            return self._engine.get_target_grids(
+                target_id,
+                dimensions=[int(d) for d in dimensions],
+                pitch=pitch,
+                origin=np.asarray(origin, dtype=float),
+            )
+
         grid_target = np.zeros(dimensions, dtype=np.float32)
         grid_nontarget = np.zeros(dimensions, dtype=np.float32)
         grid_empty = np.zeros(dimensions, np.float32)
@@ -112,9 +156,12 @@ class MultiInstanceOctreeMapping:
         empty: (M, 3) numpy.ndarray, np.float64
             Empty points.
         """
-        octree = self._octrees[target_id]
         if target_id not in self._pcds:
-            occupied, empty = octree.extractPointCloud()
+            if self._engine is not None:
+                occupied, empty = self._engine.get_target_pcds(target_id)
+            else:
+                octree = self._octrees[target_id]
+                occupied, empty = octree.extractPointCloud()
             if aabb_min is not None:
                 occupied = occupied[(occupied >= aabb_min).all(axis=1)]
                 empty = empty[(empty >= aabb_min).all(axis=1)]
@@ -12,3 +12,7 @@ from .log import loginfo_green
 from .log import loginfo_yellow
 from .log import loginfo_magenta
 from .log import loginfo_white
+
+from .voxel_grid import from_ros_voxel_grid
+from .voxel_grid import pack_voxel_grid
+from .voxel_grid import unpack_voxel_grid
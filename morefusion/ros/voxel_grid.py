@@ -0,0 +1,81 @@
+import numpy as np
+
+
+def pack_voxel_grid(matrix):
+    """Pack a dense voxel grid as in morefusion_ros/CompactVoxelGrid.
+
+    Parameters
+    ----------
+    matrix: (X, Y, Z) numpy.ndarray
+        Voxel values in [0, 1], where 0 is unoccupied.
+
+    Returns
+    -------
+    occupancy: (ceil(X * Y * Z / 8),) numpy.ndarray, np.uint8
+        Bitmask of the nonzero voxels in the order of matrix.ravel(),
+        little-endian in each byte.
+    values: (N,) numpy.ndarray, np.uint8
+        Values of the nonzero voxels quantized as round(value * 255).
+    """
+    matrix = np.asarray(matrix).ravel()
+    nonzero = matrix > 0
+    occupancy = np.packbits(nonzero, bitorder="little")
+    values = np.round(np.clip(matrix[nonzero], 0, 1) * 255).astype(np.uint8)
+    return occupancy, values
+
+
+def unpack_voxel_grid(occupancy, values, dims):
+    """Unpack a voxel grid packed as in morefusion_ros/CompactVoxelGrid.
+
+    Parameters
+    ----------
+    occupancy: (ceil(X * Y * Z / 8),) array-like or bytes, uint8
+        Bitmask of the occupied voxels.
+    values: (N,) array-like or bytes, uint8
+        Quantized values of the occupied voxels.
+    dims: (3,) array-like, int
+        Voxel dimensions (X, Y, Z).
+
+    Returns
+    -------
+    matrix: (X, Y, Z) numpy.ndarray, np.float32
+        Voxel values, where 0 is unoccupied.
+    """
+    dims = tuple(int(d) for d in dims)
+    # uint8[] fields are deserialized as bytes in rospy
+    occupancy = np.frombuffer(bytes(occupancy), dtype=np.uint8)
+    values = np.frombuffer(bytes(values), dtype=np.uint8)
+    nonzero = np.unpackbits(
+        occupancy, count=int(np.prod(dims)), bitorder="little"
+    ).astype(bool)
+    matrix = np.zeros(nonzero.shape, dtype=np.float32)
+    matrix[nonzero] = values / 255.0
+    return matrix.reshape(dims)
+
+
+def from_ros_voxel_grid(grid):
+    """Get a dense voxel grid from VoxelGrid or CompactVoxelGrid message.
+
+    Returns
+    -------
+    matrix: (X, Y, Z) numpy.ndarray, np.float32
+        Voxel values, where 0 is unoccupied.
+    pitch: float
+        Voxel pitch.
+    origin: (3,) numpy.ndarray, np.float32
+        Voxel origin.
+    """
+    dims = (grid.dims.x, grid.dims.y, grid.dims.z)
+    if hasattr(grid, "occupancy"):
+        matrix = unpack_voxel_grid(grid.occupancy, grid.values, dims)
+    else:
+        indices = np.array(grid.indices, dtype=np.int64)
+        k = indices % grid.dims.z
+        j = indices // grid.dims.z % grid.dims.y
+        i = indices // grid.dims.z // grid.dims.y
+        matrix = np.zeros(dims, dtype=np.float32)
+        matrix[i, j, k] = grid.values
+    origin = np.array(
+        [grid.origin.x, grid.origin.y, grid.origin.z], dtype=np.float32
+    )
+    return matrix, grid.pitch, origin
@@ -0,0 +1,136 @@
+// Copyright (c) 2019 Kentaro Wada
+//
+// Frames/sec of MultiInstanceMapping::insertScan against the number of OpenMP
+// threads (as OMP_NUM_THREADS), integrating the same synthetic frames into a
+// new map for each number of threads, e.g.:
+//
+//   insert_scan_threads --threads 1,2,4,8 --frames 20 --instances 20
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <boost/make_shared.hpp>
+#include <opencv2/opencv.hpp>
+
+#include "morefusion_ros/MultiInstanceMapping.h"
+#include "morefusion_ros/utils/camera.h"
+#include "morefusion_ros/utils/openmp.h"
+
+#include "./synthetic_scene.h"
+
+namespace {
+
+using morefusion_ros::MultiInstanceMapping;
+
+bool parseThreads(const std::string& value, std::vector<int>* threads) {
+  threads->clear();
+  std::istringstream iss(value);
+  std::string token;
+  while (std::getline(iss, token, ',')) {
+    int num_threads = std::atoi(token.c_str());
+    if (num_threads <= 0) {
+      return false;
+    }
+    threads->push_back(num_threads);
+  }
+  return !threads->empty();
+}
+
+void printUsage(const char* program) {
+  std::cerr << "Usage: " << program << " [--threads N1,N2,...] [--frames N] [--instances N]"
+            << " [--width PIXELS] [--resolution METERS]" << std::endl;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  // 1, 2, 4, ... up to the default of OpenMP (OMP_NUM_THREADS or the cores)
+  std::vector<int> threads;
+  int max_threads = morefusion_ros::utils::omp_max_threads();
+  for (int num_threads = 1; num_threads < max_threads; num_threads *= 2) {
+    threads.push_back(num_threads);
+  }
+  threads.push_back(max_threads);
+  int num_frames = 20;
+  int num_instances = 20;
+  int width = 640;
+  double resolution = 0.01;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (i + 1 >= argc) {
+      printUsage(argv[0]);
+      return 1;
+    }
+    if (arg == "--threads") {
+      if (!parseThreads(argv[++i], &threads)) {
+        std::cerr << "--threads needs positive numbers" << std::endl;
+        return 1;
+      }
+    } else if (arg == "--frames") {
+      num_frames = std::max(std::atoi(argv[++i]), 1);
+    } else if (arg == "--instances") {
+      num_instances = std::max(std::atoi(argv[++i]), 1);
+    } else if (arg == "--width") {
+      width = std::max(std::atoi(argv[++i]), 4);
+    } else if (arg == "--resolution") {
+      resolution = std::atof(argv[++i]);
+    } else {
+      printUsage(argv[0]);
+      return 1;
+    }
+  }
+
+  int height = width * 3 / 4;
+  boost::shared_ptr<morefusion_ros::utils::CameraRays> camera_rays =
+    boost::make_shared<morefusion_ros::utils::CameraRays>();
+  camera_rays->update(width, width, width / 2.0, height / 2.0, width, height);
+
+  std::vector<unsigned> class_ids;
+  for (unsigned class_id = 1; class_id <= 21; class_id++) {
+    class_ids.push_back(class_id);
+  }
+  morefusion_ros::synthetic::SyntheticScene scene(num_instances, class_ids, /*seed=*/0);
+  std::map<int, unsigned> instance_id_to_class_id = scene.instanceIdToClassId();
+
+  // the frames are rendered once, and their labels are the ground truth, so
+  // only insertScan is timed
+  std::vector<boost::shared_ptr<MultiInstanceMapping::SensorFrame> > frames;
+  for (int index = 0; index < num_frames; index++) {
+    boost::shared_ptr<MultiInstanceMapping::SensorFrame> frame(
+      new MultiInstanceMapping::SensorFrame);
+    scene.render(
+      morefusion_ros::synthetic::SyntheticScene::cameraPose(index, num_frames), camera_rays,
+      frame.get());
+    frames.push_back(frame);
+  }
+
+  printf("frames: %d, instances: %d, width: %d, resolution: %.3f\n",
+         num_frames, num_instances, width, resolution);
+  printf("%8s %10s %10s\n", "threads", "fps", "speedup");
+  double fps_single = 0;
+  for (int num_threads : threads) {
+    morefusion_ros::utils::omp_set_max_threads(num_threads);
+    MultiInstanceMapping::Params params;
+    params.resolution = resolution;
+    MultiInstanceMapping mapping(params);
+    double elapsed = 0;
+    for (const boost::shared_ptr<MultiInstanceMapping::SensorFrame>& frame : frames) {
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      mapping.insertScan(*frame, frame->label_ins, instance_id_to_class_id);
+      elapsed += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+    double fps = num_frames / elapsed;
+    if (fps_single == 0) {
+      fps_single = fps;
+    }
+    printf("%8d %10.2f %10.2f\n", num_threads, fps, fps / fps_single);
+  }
+  return 0;
+}
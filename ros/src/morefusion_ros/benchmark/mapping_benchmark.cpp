@@ -0,0 +1,227 @@
+// Copyright (c) 2019 Kentaro Wada
+//
+// Replay labeled depth frames through MultiInstanceMapping as fast as possible
+// and report the frame rate and the latencies of each stage, e.g.:
+//
+//   examples/ycb_video/mapping_benchmark/export_frames.py --out frames.txt
+//   rosrun morefusion_ros mapping_benchmark frames.txt --render-mode rasterize
+//
+// Each line of the frames list is a frame (# for comments):
+//
+//   depth_file label_file depth_unit fx fy cx cy T_camera2world[:3, :4]
+//
+// with a 16-bit depth image (depth_unit meters per value), a label image of
+// class ids (0: background) and the row-major 3x4 camera pose in world frame.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <boost/make_shared.hpp>
+#include <opencv2/opencv.hpp>
+
+#include "morefusion_ros/MultiInstanceMapping.h"
+#include "morefusion_ros/utils/camera.h"
+#include "morefusion_ros/utils/opencv.h"
+#include "morefusion_ros/utils/stats.h"
+
+namespace {
+
+struct FrameFiles {
+  std::string depth_file;
+  std::string label_file;
+  float depth_unit;
+  float fx;
+  float fy;
+  float cx;
+  float cy;
+  Eigen::Matrix<float, 4, 4, Eigen::DontAlign> sensorToWorld;
+};
+
+bool readFrameList(const std::string& list_file, std::vector<FrameFiles>* frames) {
+  std::ifstream ifs(list_file.c_str());
+  if (!ifs) {
+    std::cerr << "Can't open the frames list: " << list_file << std::endl;
+    return false;
+  }
+  std::string line;
+  int line_number = 0;
+  while (std::getline(ifs, line)) {
+    line_number++;
+    if (line.empty() || line[0] == '#') {
+      continue;
+    }
+    std::istringstream iss(line);
+    FrameFiles frame;
+    frame.sensorToWorld.setIdentity();
+    iss >> frame.depth_file >> frame.label_file >> frame.depth_unit
+        >> frame.fx >> frame.fy >> frame.cx >> frame.cy;
+    for (int j = 0; j < 3; j++) {
+      for (int i = 0; i < 4; i++) {
+        iss >> frame.sensorToWorld(j, i);
+      }
+    }
+    if (iss.fail()) {
+      std::cerr << "Invalid frame at " << list_file << ":" << line_number << std::endl;
+      return false;
+    }
+    frames->push_back(frame);
+  }
+  return true;
+}
+
+// labels of class ids (0: background) to instance labels (-1: background),
+// with an instance per class as in YCB-Video
+bool loadFrame(
+    const FrameFiles& files,
+    morefusion_ros::MultiInstanceMapping::SensorFrame* frame,
+    std::map<int, unsigned>* instance_id_to_class_id) {
+  frame->depth = cv::imread(files.depth_file, cv::IMREAD_ANYDEPTH);
+  cv::Mat label = cv::imread(files.label_file, cv::IMREAD_ANYDEPTH);
+  if (frame->depth.empty() || frame->depth.type() != CV_16UC1) {
+    std::cerr << "Can't read a 16-bit depth image: " << files.depth_file << std::endl;
+    return false;
+  }
+  if (label.empty() || label.size() != frame->depth.size()) {
+    std::cerr << "Can't read a label image of the depth size: " << files.label_file << std::endl;
+    return false;
+  }
+  label.convertTo(frame->label_ins, CV_32SC1);
+  frame->label_ins.setTo(-1, frame->label_ins == 0);
+  frame->depth_unit = files.depth_unit;
+
+  std::vector<int> labels;
+  std::vector<int> counts;
+  morefusion_ros::utils::unique_counts(frame->label_ins, &labels, &counts);
+  instance_id_to_class_id->clear();
+  for (int label_value : labels) {
+    if (label_value >= 0) {
+      instance_id_to_class_id->insert(std::make_pair(label_value, label_value));
+    }
+  }
+  return true;
+}
+
+void printUsage(const char* program) {
+  std::cerr << "Usage: " << program << " FRAMES_LIST [--max-frames N] [--repeat N]"
+            << " [--render-mode raycast|rasterize] [--resolution METERS]" << std::endl;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    printUsage(argv[0]);
+    return 1;
+  }
+  std::string list_file = argv[1];
+  int max_frames = -1;
+  int repeat = 1;
+  morefusion_ros::MultiInstanceMapping::Params params;
+  params.resolution = 0.01;
+  params.max_range = -1;
+  for (int i = 2; i < argc; i++) {
+    std::string arg = argv[i];
+    if (i + 1 >= argc) {
+      printUsage(argv[0]);
+      return 1;
+    }
+    if (arg == "--max-frames") {
+      max_frames = std::atoi(argv[++i]);
+    } else if (arg == "--repeat") {
+      repeat = std::atoi(argv[++i]);
+    } else if (arg == "--render-mode") {
+      params.render_mode = argv[++i];
+    } else if (arg == "--resolution") {
+      params.resolution = std::atof(argv[++i]);
+    } else {
+      printUsage(argv[0]);
+      return 1;
+    }
+  }
+
+  std::vector<FrameFiles> frames_files;
+  if (!readFrameList(list_file, &frames_files)) {
+    return 1;
+  }
+  if ((max_frames >= 0) && (frames_files.size() > static_cast<size_t>(max_frames))) {
+    frames_files.resize(max_frames);
+  }
+  if (frames_files.empty()) {
+    std::cerr << "No frames in: " << list_file << std::endl;
+    return 1;
+  }
+
+  morefusion_ros::utils::PipelineStats stats;
+  morefusion_ros::MultiInstanceMapping mapping(params);
+  mapping.setStats(&stats);
+
+  boost::shared_ptr<morefusion_ros::utils::CameraRays> camera_rays =
+    boost::make_shared<morefusion_ros::utils::CameraRays>();
+  morefusion_ros::MultiInstanceMapping::SensorFrame frame;
+  std::map<int, unsigned> instance_id_to_class_id;
+  cv::Mat label_ins;
+  cv::Mat label_ins_rend;
+
+  // Only the mapping is timed, not reading the images
+  double elapsed_mapping = 0;
+  size_t num_frames = 0;
+  for (int r = 0; r < repeat; r++) {
+    if (r > 0) {
+      mapping.reset();
+    }
+    for (const FrameFiles& files : frames_files) {
+      if (!loadFrame(files, &frame, &instance_id_to_class_id)) {
+        return 1;
+      }
+      frame.width = frame.depth.cols;
+      frame.height = frame.depth.rows;
+      frame.fx = files.fx;
+      frame.fy = files.fy;
+      frame.cx = files.cx;
+      frame.cy = files.cy;
+      camera_rays->update(files.fx, files.fy, files.cx, files.cy, frame.width, frame.height);
+      frame.camera_rays = camera_rays;
+
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      {
+        morefusion_ros::utils::ScopedTimer timer(&stats, "frame");
+        frame.setPose(files.sensorToWorld);
+        frame.label_ins.copyTo(label_ins);
+        if (!mapping.integrate(frame, label_ins, &instance_id_to_class_id, label_ins_rend)) {
+          return 1;
+        }
+      }
+      std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+      elapsed_mapping += elapsed.count();
+      num_frames++;
+    }
+  }
+
+  std::map<std::string, morefusion_ros::utils::LatencyHistogram> latencies;
+  std::map<std::string, double> values;
+  stats.takeWindow(&latencies, &values);
+
+  printf("frames: %zu, render_mode: %s, resolution: %.3f\n",
+         num_frames, mapping.params().render_mode.c_str(), params.resolution);
+  printf("fps: %.2f (%.3f s of mapping)\n", num_frames / elapsed_mapping, elapsed_mapping);
+  printf("%-20s %10s %10s %10s %10s\n", "stage [ms]", "p50", "p95", "p99", "max");
+  const char* stages[] = {"render", "track_instance_id", "insert_scan", "update_grids", "frame"};
+  for (const char* stage : stages) {
+    const morefusion_ros::utils::LatencyHistogram& latency = latencies[stage];
+    printf("%-20s %10.2f %10.2f %10.2f %10.2f\n", stage,
+           latency.percentile(0.50) * 1e3, latency.percentile(0.95) * 1e3,
+           latency.percentile(0.99) * 1e3, latency.max() * 1e3);
+  }
+  for (std::map<std::string, double>::const_iterator it = values.begin(); it != values.end();
+       it++) {
+    printf("%s (last frame): %.0f\n", it->first.c_str(), it->second);
+  }
+  return 0;
+}
@@ -0,0 +1,200 @@
+// Copyright (c) 2019 Kentaro Wada
+//
+// Microbenchmarks of the hot paths of the mapping (see OctomapServer) on
+// synthetic scenes, parameterized by the image size, the number of instances
+// and the voxel pitch in millimeters, e.g.:
+//
+//   mapping_microbenchmark --benchmark_out=mapping.json --benchmark_out_format=json
+//   mapping_microbenchmark --benchmark_filter=BM_Render
+
+#include <benchmark/benchmark.h>
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <boost/make_shared.hpp>
+#include <opencv2/opencv.hpp>
+
+#include "morefusion_ros/MultiInstanceMapping.h"
+#include "morefusion_ros/utils/opencv.h"
+
+#include "./synthetic_scene.h"
+
+namespace {
+
+using morefusion_ros::MultiInstanceMapping;
+
+// Scene and map of a benchmark, integrated with frames from a static camera
+// as many times as given, so that the map is not empty.
+class MappingFixture {
+ public:
+  MappingFixture(
+      const benchmark::State& state,
+      int num_integrations,
+      const std::string& render_mode)
+    : scene_(state.range(1), std::vector<unsigned>(1, nearestClassId(state)), /*seed=*/0) {
+    int width = state.range(0);
+    int height = state.range(3);
+    camera_rays_ = boost::make_shared<morefusion_ros::utils::CameraRays>();
+    camera_rays_->update(width, width, width / 2.0, height / 2.0, width, height);
+
+    MultiInstanceMapping::Params params;
+    params.resolution = state.range(2) * 1e-3;
+    params.render_mode = render_mode;
+    mapping_.reset(new MultiInstanceMapping(params));
+
+    sensorToWorld_ = morefusion_ros::synthetic::look_at(
+      Eigen::Vector3f(0, -0.6, 0.7), Eigen::Vector3f(0, 0, 0));
+    scene_.render(sensorToWorld_, camera_rays_, &frame_);
+    instance_id_to_class_id_ = scene_.instanceIdToClassId();
+    for (int i = 0; i < num_integrations; i++) {
+      integrate();
+    }
+  }
+
+  // render, track and insert the frame, as the integrate stage of OctomapServer
+  void integrate() {
+    frame_.label_ins.copyTo(label_ins_);
+    std::map<int, unsigned> instance_id_to_class_id = instance_id_to_class_id_;
+    mapping_->integrate(frame_, label_ins_, &instance_id_to_class_id, label_ins_rend_);
+  }
+
+  static unsigned nearestClassId(const benchmark::State& state) {
+    return morefusion_ros::synthetic::nearest_class_id(state.range(2) * 1e-3);
+  }
+
+  void setCounters(benchmark::State* state) const {
+    state->counters["pixels"] = frame_.width * frame_.height;
+    state->counters["instances"] = scene_.objects().size();
+    state->counters["pitch"] = morefusion_ros::utils::class_id_to_voxel_pitch(
+      nearestClassId(*state));
+  }
+
+  morefusion_ros::synthetic::SyntheticScene scene_;
+  boost::shared_ptr<morefusion_ros::utils::CameraRays> camera_rays_;
+  boost::shared_ptr<MultiInstanceMapping> mapping_;
+  Eigen::Matrix4f sensorToWorld_;
+  MultiInstanceMapping::SensorFrame frame_;
+  std::map<int, unsigned> instance_id_to_class_id_;
+  cv::Mat label_ins_;
+  cv::Mat label_ins_rend_;
+};
+
+// width (4:3) x instances x pitch [mm]
+void MappingArgs(benchmark::internal::Benchmark* b) {
+  b->ArgNames({"width", "instances", "pitch_mm", "height"});
+  for (int width : {320, 640}) {
+    for (int instances : {5, 20, 50}) {
+      for (int pitch_mm : {4, 8}) {
+        b->Args({width, instances, pitch_mm, width * 3 / 4});
+      }
+    }
+  }
+  b->Unit(benchmark::kMillisecond);
+}
+
+// the insertion of a frame into a map of one frame, which is rebuilt out of the timing, so that
+// the map does not grow with the iterations
+void BM_InsertScan(benchmark::State& state) {
+  MappingFixture fixture(state, /*num_integrations=*/0, "raycast");
+  for (auto _ : state) {
+    state.PauseTiming();
+    fixture.mapping_->reset();
+    fixture.integrate();
+    state.ResumeTiming();
+    fixture.mapping_->insertScan(
+      fixture.frame_, fixture.frame_.label_ins, fixture.instance_id_to_class_id_);
+  }
+  fixture.setCounters(&state);
+}
+BENCHMARK(BM_InsertScan)->Apply(MappingArgs);
+
+void BM_Render(benchmark::State& state, const std::string& render_mode) {
+  MappingFixture fixture(state, /*num_integrations=*/3, render_mode);
+  for (auto _ : state) {
+    fixture.mapping_->render(fixture.frame_, fixture.label_ins_rend_);
+    benchmark::DoNotOptimize(fixture.label_ins_rend_.data);
+  }
+  fixture.setCounters(&state);
+}
+BENCHMARK_CAPTURE(BM_Render, raycast, std::string("raycast"))->Apply(MappingArgs);
+BENCHMARK_CAPTURE(BM_Render, rasterize, std::string("rasterize"))->Apply(MappingArgs);
+
+void BM_TrackInstanceId(benchmark::State& state) {
+  MappingFixture fixture(state, /*num_integrations=*/3, "raycast");
+  cv::Mat label_ins_rend;
+  fixture.mapping_->render(fixture.frame_, label_ins_rend);
+  // both labels are modified by the tracking, so copied in each iteration
+  cv::Mat reference;
+  cv::Mat target;
+  for (auto _ : state) {
+    label_ins_rend.copyTo(reference);
+    fixture.frame_.label_ins.copyTo(target);
+    std::map<int, unsigned> instance_id_to_class_id = fixture.instance_id_to_class_id_;
+    fixture.mapping_->trackInstanceIds(reference, &target, &instance_id_to_class_id);
+  }
+  fixture.setCounters(&state);
+}
+// and the 1280x720 labels of a 720p camera
+BENCHMARK(BM_TrackInstanceId)->Apply(MappingArgs)->Args({1280, 20, 8, 720});
+
+void BM_Unique(benchmark::State& state) {
+  MappingFixture fixture(state, /*num_integrations=*/0, "raycast");
+  for (auto _ : state) {
+    std::set<int> labels = morefusion_ros::utils::unique<int>(fixture.frame_.label_ins);
+    benchmark::DoNotOptimize(labels);
+  }
+  fixture.setCounters(&state);
+}
+BENCHMARK(BM_Unique)->Apply(MappingArgs);
+
+void BM_GetGridsInWorldFrame(benchmark::State& state) {
+  MappingFixture fixture(state, /*num_integrations=*/3, "raycast");
+  std::vector<MultiInstanceMapping::Grid> grids;
+  for (auto _ : state) {
+    fixture.mapping_->getGridsInWorldFrame(&grids);
+  }
+  fixture.setCounters(&state);
+}
+BENCHMARK(BM_GetGridsInWorldFrame)->Apply(MappingArgs);
+
+// the grid extraction of publishGrids, with all the cached grids stale
+void BM_ExtractGrids(benchmark::State& state) {
+  MappingFixture fixture(state, /*num_integrations=*/3, "raycast");
+  for (auto _ : state) {
+    fixture.mapping_->setNoEntry(/*ground_as_noentry=*/false, /*free_as_noentry=*/false);
+    fixture.mapping_->updateGrids(fixture.sensorToWorld_);
+  }
+  fixture.setCounters(&state);
+}
+BENCHMARK(BM_ExtractGrids)->Apply(MappingArgs);
+
+// the speckle filter of publishAll over the occupied leaves of the background
+void BM_IsSpeckleNode(benchmark::State& state) {
+  MappingFixture fixture(state, /*num_integrations=*/3, "raycast");
+  const MultiInstanceMapping::OcTreeT& octree_bg = *fixture.mapping_->octrees().find(-1)->second;
+  std::vector<octomap::OcTreeKey> keys;
+  for (MultiInstanceMapping::OcTreeT::leaf_iterator it = octree_bg.begin_leafs(),
+       end = octree_bg.end_leafs(); it != end; ++it) {
+    if (octree_bg.isNodeOccupied(*it) && (it.getDepth() == octree_bg.getTreeDepth())) {
+      keys.push_back(it.getKey());
+    }
+  }
+  for (auto _ : state) {
+    // isSpeckleNode is true if the node has an occupied neighbor, as in octomap_server
+    size_t num_with_neighbors = 0;
+    for (const octomap::OcTreeKey& key : keys) {
+      num_with_neighbors += MultiInstanceMapping::isSpeckleNode(octree_bg, key);
+    }
+    benchmark::DoNotOptimize(num_with_neighbors);
+  }
+  state.SetItemsProcessed(state.iterations() * keys.size());
+  fixture.setCounters(&state);
+}
+BENCHMARK(BM_IsSpeckleNode)->Apply(MappingArgs);
+
+}  // namespace
+
+BENCHMARK_MAIN();
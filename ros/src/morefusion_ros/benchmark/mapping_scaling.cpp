@@ -0,0 +1,310 @@
+// Copyright (c) 2019 Kentaro Wada
+//
+// Scaling of the per-frame cost of the mapping with the number of instances,
+// on synthetic bins of YCB-Video-shaped objects seen from a moving camera.
+// The exponent of each stage (slope of log(cost) over log(instances)) is
+// reported for the stages that take at least 1 ms, e.g.:
+//
+//   mapping_scaling --instances 5,10,20,40,60,80,100 --json scaling.json
+//
+// As the wall-clock costs vary from run to run, the exit status is decided on
+// the work counters of the stages instead (see MultiInstanceMapping::setStats),
+// summed over the frames: it is 1 if a counter grows faster than its expected
+// exponent plus --tolerance, so that the test of CMakeLists.txt is deterministic.
+//
+// The fg_overlap stage is the background/foreground overlap check of
+// OctomapServer::publishAll (InstanceVoxelIndex::isOccupied) over the occupied
+// leaves of the background.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <boost/make_shared.hpp>
+#include <opencv2/opencv.hpp>
+
+#include "morefusion_ros/MultiInstanceMapping.h"
+#include "morefusion_ros/utils/camera.h"
+#include "morefusion_ros/utils/octomap.h"
+#include "morefusion_ros/utils/stats.h"
+
+#include "./synthetic_scene.h"
+
+namespace {
+
+using morefusion_ros::MultiInstanceMapping;
+
+const char* kStages[] = {
+  "render", "track_instance_id", "insert_scan", "update_grids",
+  "get_grids_in_world_frame", "fg_overlap", "frame"};
+
+// stages faster than this at the most instances are too noisy for an exponent
+const double kMinStageCost = 1e-3;
+
+struct Counter {
+  const char* name;
+  double exponent;  // expected
+};
+
+// track_pairs is the contingency table of the visible instances of the map and
+// the detections, which is quadratic by design, and rays_cast is bounded by the
+// pixels.
+const Counter kCounters[] = {
+  {"render_rays", 1}, {"track_pairs", 2}, {"rays_cast", 1}, {"keys_updated", 1},
+  {"grid_voxels_searched", 1}, {"fg_overlap_lookups", 1}};
+
+// the number of overlaps, and of lookups into the instance index
+size_t fgOverlap(const MultiInstanceMapping& mapping, size_t* num_lookups) {
+  const MultiInstanceMapping::OcTreeT& octree_bg = *mapping.octrees().find(-1)->second;
+  std::vector<morefusion_ros::utils::InstanceVoxelIndex::Entry> entries_fg;
+  *num_lookups = 0;
+  size_t num_overlaps = 0;
+  for (MultiInstanceMapping::OcTreeT::leaf_iterator it = octree_bg.begin_leafs(),
+       end = octree_bg.end_leafs(); it != end; ++it) {
+    if (!octree_bg.isNodeOccupied(*it)) {
+      continue;
+    }
+    (*num_lookups)++;
+    num_overlaps +=
+      mapping.instanceIndex().isOccupied(it.getX(), it.getY(), it.getZ(), &entries_fg);
+  }
+  return num_overlaps;
+}
+
+// median per-frame cost [s] of each stage, and the counters summed over the
+// frames, integrating num_frames frames of a scene with num_instances
+// instances into a new map
+void runScene(
+    int num_instances,
+    int num_frames,
+    const boost::shared_ptr<morefusion_ros::utils::CameraRays>& camera_rays,
+    std::map<std::string, double>* costs,
+    std::map<std::string, double>* counts) {
+  std::vector<unsigned> class_ids;
+  for (unsigned class_id = 1; class_id <= 21; class_id++) {
+    class_ids.push_back(class_id);
+  }
+  morefusion_ros::synthetic::SyntheticScene scene(num_instances, class_ids, /*seed=*/0);
+
+  MultiInstanceMapping::Params params;
+  params.resolution = 0.01;
+  MultiInstanceMapping mapping(params);
+  morefusion_ros::utils::PipelineStats stats;
+  mapping.setStats(&stats);
+
+  MultiInstanceMapping::SensorFrame frame;
+  cv::Mat label_ins;
+  cv::Mat label_ins_rend;
+  std::vector<MultiInstanceMapping::Grid> grids;
+  for (int index = 0; index < num_frames; index++) {
+    // rendering the scene is not a part of the mapping, so not timed
+    Eigen::Matrix4f sensorToWorld =
+      morefusion_ros::synthetic::SyntheticScene::cameraPose(index, num_frames);
+    scene.render(sensorToWorld, camera_rays, &frame);
+    frame.label_ins.copyTo(label_ins);
+    std::map<int, unsigned> instance_id_to_class_id = scene.instanceIdToClassId();
+
+    size_t fg_overlap_lookups;
+    {
+      morefusion_ros::utils::ScopedTimer timer(&stats, "frame");
+      mapping.integrate(frame, label_ins, &instance_id_to_class_id, label_ins_rend);
+      {
+        morefusion_ros::utils::ScopedTimer timer_get(&stats, "get_grids_in_world_frame");
+        mapping.getGridsInWorldFrame(&grids);
+      }
+      {
+        morefusion_ros::utils::ScopedTimer timer_overlap(&stats, "fg_overlap");
+        fgOverlap(mapping, &fg_overlap_lookups);
+      }
+    }
+    stats.set("fg_overlap_lookups", fg_overlap_lookups);
+    for (const Counter& counter : kCounters) {
+      (*counts)[counter.name] += stats.value(counter.name);
+    }
+  }
+
+  std::map<std::string, morefusion_ros::utils::LatencyHistogram> latencies;
+  std::map<std::string, double> values;
+  stats.takeWindow(&latencies, &values);
+  for (const char* stage : kStages) {
+    (*costs)[stage] = latencies[stage].percentile(0.50);
+  }
+}
+
+// least-squares slope of log(y) over log(x), with y floored at y_min
+double fitExponent(const std::vector<int>& xs, const std::vector<double>& ys, double y_min) {
+  double mean_x = 0;
+  double mean_y = 0;
+  for (size_t i = 0; i < xs.size(); i++) {
+    mean_x += std::log(xs[i]) / xs.size();
+    mean_y += std::log(std::max(ys[i], y_min)) / xs.size();
+  }
+  double covariance = 0;
+  double variance = 0;
+  for (size_t i = 0; i < xs.size(); i++) {
+    double dx = std::log(xs[i]) - mean_x;
+    covariance += dx * (std::log(std::max(ys[i], y_min)) - mean_y);
+    variance += dx * dx;
+  }
+  return variance > 0 ? covariance / variance : 0;
+}
+
+bool parseInstances(const std::string& value, std::vector<int>* instances) {
+  instances->clear();
+  std::istringstream iss(value);
+  std::string token;
+  while (std::getline(iss, token, ',')) {
+    int num_instances = std::atoi(token.c_str());
+    if (num_instances <= 0) {
+      return false;
+    }
+    instances->push_back(num_instances);
+  }
+  return instances->size() >= 2;
+}
+
+void printUsage(const char* program) {
+  std::cerr << "Usage: " << program << " [--instances N1,N2,...] [--frames N] [--width PIXELS]"
+            << " [--tolerance EXPONENT] [--json FILE]" << std::endl;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  std::vector<int> instances = {5, 10, 20, 40, 60, 80, 100};
+  int num_frames = 10;
+  int width = 640;
+  double tolerance = 0.5;
+  std::string json_file;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (i + 1 >= argc) {
+      printUsage(argv[0]);
+      return 1;
+    }
+    if (arg == "--instances") {
+      if (!parseInstances(argv[++i], &instances)) {
+        std::cerr << "--instances needs at least 2 positive numbers" << std::endl;
+        return 1;
+      }
+    } else if (arg == "--frames") {
+      num_frames = std::max(std::atoi(argv[++i]), 1);
+    } else if (arg == "--width") {
+      width = std::max(std::atoi(argv[++i]), 4);
+    } else if (arg == "--tolerance") {
+      tolerance = std::atof(argv[++i]);
+    } else if (arg == "--json") {
+      json_file = argv[++i];
+    } else {
+      printUsage(argv[0]);
+      return 1;
+    }
+  }
+
+  int height = width * 3 / 4;
+  boost::shared_ptr<morefusion_ros::utils::CameraRays> camera_rays =
+    boost::make_shared<morefusion_ros::utils::CameraRays>();
+  camera_rays->update(width, width, width / 2.0, height / 2.0, width, height);
+
+  std::map<std::string, std::vector<double> > costs;
+  std::map<std::string, std::vector<double> > counts;
+  for (int num_instances : instances) {
+    std::map<std::string, double> costs_scene;
+    std::map<std::string, double> counts_scene;
+    runScene(num_instances, num_frames, camera_rays, &costs_scene, &counts_scene);
+    for (const char* stage : kStages) {
+      costs[stage].push_back(costs_scene[stage]);
+    }
+    for (const Counter& counter : kCounters) {
+      counts[counter.name].push_back(counts_scene[counter.name]);
+    }
+  }
+
+  // wall-clock costs, only reported
+  printf("%-26s", "stage [ms] \\ instances");
+  for (int num_instances : instances) {
+    printf(" %8d", num_instances);
+  }
+  printf(" %9s\n", "exponent");
+  std::map<std::string, double> exponents;
+  for (const char* stage : kStages) {
+    printf("%-26s", stage);
+    for (double cost : costs[stage]) {
+      printf(" %8.2f", cost * 1e3);
+    }
+    if (costs[stage].back() >= kMinStageCost) {
+      exponents[stage] = fitExponent(instances, costs[stage], kMinStageCost);
+      printf(" %9.2f\n", exponents[stage]);
+    } else {
+      printf(" %9s\n", "-");
+    }
+  }
+
+  // work counters, which decide the exit status
+  printf("\n%-26s", "counter \\ instances");
+  for (int num_instances : instances) {
+    printf(" %8d", num_instances);
+  }
+  printf(" %9s %9s\n", "exponent", "expected");
+  bool is_superlinear = false;
+  std::map<std::string, double> exponents_counters;
+  for (const Counter& counter : kCounters) {
+    double exponent = fitExponent(instances, counts[counter.name], 1);
+    exponents_counters[counter.name] = exponent;
+    printf("%-26s", counter.name);
+    for (double count : counts[counter.name]) {
+      printf(" %8.3g", count);
+    }
+    bool is_failed = exponent > counter.exponent + tolerance;
+    printf(" %9.2f %9.2f%s\n", exponent, counter.exponent, is_failed ? " FAIL" : "");
+    is_superlinear |= is_failed;
+  }
+
+  if (!json_file.empty()) {
+    std::ofstream ofs(json_file.c_str());
+    ofs << "{\n  \"frames\": " << num_frames << ",\n  \"width\": " << width
+        << ",\n  \"tolerance\": " << tolerance << ",\n  \"instances\": [";
+    for (size_t i = 0; i < instances.size(); i++) {
+      ofs << (i ? ", " : "") << instances[i];
+    }
+    ofs << "],\n  \"stages\": {";
+    for (size_t s = 0; s < sizeof(kStages) / sizeof(kStages[0]); s++) {
+      const char* stage = kStages[s];
+      ofs << (s ? "," : "") << "\n    \"" << stage << "\": {";
+      if (exponents.count(stage)) {
+        ofs << "\"exponent\": " << exponents[stage] << ", ";
+      }
+      ofs << "\"seconds\": [";
+      for (size_t i = 0; i < costs[stage].size(); i++) {
+        ofs << (i ? ", " : "") << costs[stage][i];
+      }
+      ofs << "]}";
+    }
+    ofs << "\n  },\n  \"counters\": {";
+    for (size_t c = 0; c < sizeof(kCounters) / sizeof(kCounters[0]); c++) {
+      const Counter& counter = kCounters[c];
+      ofs << (c ? "," : "") << "\n    \"" << counter.name << "\": {\"exponent\": "
+          << exponents_counters[counter.name] << ", \"expected\": " << counter.exponent
+          << ", \"counts\": [";
+      for (size_t i = 0; i < counts[counter.name].size(); i++) {
+        ofs << (i ? ", " : "") << counts[counter.name][i];
+      }
+      ofs << "]}";
+    }
+    ofs << "\n  }\n}\n";
+  }
+
+  if (is_superlinear) {
+    std::cerr << "Counters grow faster than instances^(expected + " << tolerance << ")"
+              << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,117 @@
+#!/usr/bin/env python
+
+"""Latencies of octomap_server from its diagnostics, to compare the node and the nodelet.
+
+Run the same bag twice, once per mode, with the diagnostics enabled:
+
+  roslaunch morefusion_ros octomap_server_nodelet.launch NODELET:=true DIAGNOSTICS:=true
+  ./octomap_server_latency.py --label nodelet --duration 60
+
+  roslaunch morefusion_ros octomap_server_nodelet.launch NODELET:=false DIAGNOSTICS:=true
+  ./octomap_server_latency.py --label node --duration 60
+
+receive is from the capture stamp to the synchronized inputs, so it includes the
+transport (serialization for the node, shared pointers for the nodelet), and
+end_to_end is from the capture stamp to the published grids.
+"""
+
+import argparse
+import collections
+import json
+
+import numpy as np
+
+import rospy
+from diagnostic_msgs.msg import DiagnosticArray
+
+
+STAGES = ["receive", "convert", "integrate", "end_to_end"]
+
+
+class LatencyCollector:
+    def __init__(self, topic):
+        # the percentiles of each window, weighted by its number of frames
+        self.windows = collections.defaultdict(list)
+        self.rates = []
+        self._sub = rospy.Subscriber(topic, DiagnosticArray, self._callback)
+
+    def _callback(self, msg):
+        for status in msg.status:
+            values = {kv.key: kv.value for kv in status.values}
+            for stage in STAGES:
+                count = int(values.get(f"{stage}/count", 0))
+                if count == 0:
+                    continue
+                self.windows[stage].append(
+                    (
+                        count,
+                        float(values[f"{stage}/p50_ms"]),
+                        float(values[f"{stage}/p95_ms"]),
+                        float(values[f"{stage}/p99_ms"]),
+                    )
+                )
+            if "integrate/rate_hz" in values:
+                self.rates.append(float(values["integrate/rate_hz"]))
+
+    def summary(self):
+        result = {}
+        for stage in STAGES:
+            windows = np.array(self.windows[stage])
+            if windows.size == 0:
+                continue
+            weights = windows[:, 0]
+            result[stage] = {
+                "frames": int(weights.sum()),
+                "p50_ms": float(np.average(windows[:, 1], weights=weights)),
+                "p95_ms": float(np.average(windows[:, 2], weights=weights)),
+                "p99_ms": float(np.max(windows[:, 3])),
+            }
+        if self.rates:
+            result["fps"] = float(np.mean(self.rates))
+        return result
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description=__doc__,
+        formatter_class=argparse.RawDescriptionHelpFormatter,
+    )
+    parser.add_argument(
+        "--topic",
+        default="/camera/octomap_server/output/diagnostics",
+        help="diagnostics topic",
+    )
+    parser.add_argument(
+        "--duration", type=float, default=60, help="seconds to collect"
+    )
+    parser.add_argument("--label", default="", help="e.g., node or nodelet")
+    parser.add_argument(
+        "--json", help="append the summary as a line of json to this file"
+    )
+    args = parser.parse_args()
+
+    rospy.init_node("octomap_server_latency", anonymous=True)
+    collector = LatencyCollector(args.topic)
+    rospy.sleep(args.duration)
+    summary = collector.summary()
+    if not summary:
+        rospy.logerr(f"No diagnostics on {args.topic}, is ~diagnostics/enabled true?")
+        return
+
+    print(f"{args.label} ({summary.get('fps', 0):.1f} fps)")
+    print(f"{'stage [ms]':<12} {'frames':>8} {'p50':>8} {'p95':>8} {'p99':>8}")
+    for stage in STAGES:
+        if stage not in summary:
+            continue
+        s = summary[stage]
+        print(
+            f"{stage:<12} {s['frames']:>8d} {s['p50_ms']:>8.2f} "
+            f"{s['p95_ms']:>8.2f} {s['p99_ms']:>8.2f}"
+        )
+    if args.json:
+        with open(args.json, "a") as f:
+            f.write(json.dumps(dict(label=args.label, **summary)) + "\n")
+
+
+if __name__ == "__main__":
+    main()
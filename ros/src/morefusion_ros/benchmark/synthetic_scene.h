@@ -0,0 +1,358 @@
+// Copyright (c) 2019 Kentaro Wada
+
+#ifndef ROS_ROS_OBJSLAMPP_YCB_VIDEO_BENCHMARK_SYNTHETIC_SCENE_H_
+#define ROS_ROS_OBJSLAMPP_YCB_VIDEO_BENCHMARK_SYNTHETIC_SCENE_H_
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <map>
+#include <random>
+#include <vector>
+
+#include <Eigen/Core>
+#include <Eigen/Geometry>
+#include <opencv2/opencv.hpp>
+
+#include "morefusion_ros/MultiInstanceMapping.h"
+#include "morefusion_ros/utils/camera.h"
+#include "morefusion_ros/utils/data.h"
+
+namespace morefusion_ros {
+namespace synthetic {
+
+// Class of YCB-Video whose voxel pitch is the closest to the pitch.
+inline unsigned nearest_class_id(double pitch) {
+  unsigned class_id_nearest = 1;
+  for (unsigned class_id = 1; class_id <= 21; class_id++) {
+    if (std::abs(morefusion_ros::utils::class_id_to_voxel_pitch(class_id) - pitch) <
+        std::abs(morefusion_ros::utils::class_id_to_voxel_pitch(class_id_nearest) - pitch)) {
+      class_id_nearest = class_id;
+    }
+  }
+  return class_id_nearest;
+}
+
+// Rough shape of a YCB-Video class: a box or an upright cylinder with the
+// relative extents of the object.
+inline void ycb_video_shape(unsigned class_id, bool* is_cylinder, Eigen::Vector3f* extents) {
+  switch (class_id) {
+  case  1: *is_cylinder = true;  *extents << 1.0, 1.0, 1.3; break;  // master_chef_can
+  case  2: *is_cylinder = false; *extents << 1.0, 0.4, 1.3; break;  // cracker_box
+  case  3: *is_cylinder = false; *extents << 0.5, 0.9, 1.8; break;  // sugar_box
+  case  4: *is_cylinder = true;  *extents << 1.0, 1.0, 1.5; break;  // tomato_soup_can
+  case  5: *is_cylinder = false; *extents << 1.0, 0.6, 1.9; break;  // mustard_bottle
+  case  6: *is_cylinder = true;  *extents << 1.0, 1.0, 0.4; break;  // tuna_fish_can
+  case  7: *is_cylinder = false; *extents << 1.1, 0.9, 0.4; break;  // pudding_box
+  case  8: *is_cylinder = false; *extents << 0.9, 0.7, 0.3; break;  // gelatin_box
+  case  9: *is_cylinder = false; *extents << 1.0, 0.6, 0.9; break;  // potted_meat_can
+  case 10: *is_cylinder = false; *extents << 1.9, 0.4, 0.4; break;  // banana
+  case 11: *is_cylinder = true;  *extents << 1.0, 1.0, 1.3; break;  // pitcher_base
+  case 12: *is_cylinder = false; *extents << 1.0, 0.7, 2.5; break;  // bleach_cleanser
+  case 13: *is_cylinder = true;  *extents << 1.0, 1.0, 0.4; break;  // bowl
+  case 14: *is_cylinder = true;  *extents << 1.0, 1.0, 0.8; break;  // mug
+  case 15: *is_cylinder = false; *extents << 1.8, 0.5, 1.7; break;  // power_drill
+  case 16: *is_cylinder = false; *extents << 0.9, 0.9, 2.0; break;  // wood_block
+  case 17: *is_cylinder = false; *extents << 2.0, 0.8, 0.2; break;  // scissors
+  case 18: *is_cylinder = false; *extents << 2.4, 0.3, 0.3; break;  // large_marker
+  case 19: *is_cylinder = false; *extents << 1.3, 1.0, 0.3; break;  // large_clamp
+  case 20: *is_cylinder = false; *extents << 1.6, 1.8, 0.4; break;  // extra_large_clamp
+  default: *is_cylinder = false; *extents << 1.0, 0.8, 1.0; break;  // foam_brick
+  }
+}
+
+// Camera-to-world transform of a camera (x: right, y: down, z: forward) at
+// eye looking at target, with the world z axis up.
+inline Eigen::Matrix4f look_at(const Eigen::Vector3f& eye, const Eigen::Vector3f& target) {
+  Eigen::Vector3f z = (target - eye).normalized();
+  Eigen::Vector3f x = z.cross(Eigen::Vector3f::UnitZ()).normalized();
+  Eigen::Vector3f y = z.cross(x);
+  Eigen::Matrix4f T = Eigen::Matrix4f::Identity();
+  T.block<3, 1>(0, 0) = x;
+  T.block<3, 1>(0, 1) = y;
+  T.block<3, 1>(0, 2) = z;
+  T.block<3, 1>(0, 3) = eye;
+  return T;
+}
+
+// Object voxelized with the pitch of its class (class_id_to_voxel_pitch), so
+// that its bounding box diagonal is 32 voxels as in the object grids.
+// The object frame is at the bottom center of the voxels, rotated by yaw.
+struct SyntheticObject {
+  int instance_id;
+  unsigned class_id;
+  float pitch;
+  int dims[3];
+  std::vector<uint8_t> occupancy;  // dims[0] x dims[1] x dims[2], C-ordered
+  Eigen::Vector3f half_extents;
+  float yaw;
+  Eigen::Vector3f position;  // of the object frame in world frame
+
+  bool isOccupied(int i, int j, int k) const {
+    return occupancy[(i * dims[1] + j) * dims[2] + k] != 0;
+  }
+};
+
+// Deterministic scene of YCB-Video-shaped objects in a bin (a 0.8 x 0.8 m
+// region of a table at z = 0 in world frame), stacked where they do not fit
+// side by side, and rendered into labeled depth frames for MultiInstanceMapping.
+class SyntheticScene {
+ public:
+  SyntheticScene(
+      int num_instances,
+      const std::vector<unsigned>& class_ids,
+      uint32_t seed = 0) : random_(seed) {
+    for (int i = 0; i < num_instances; i++) {
+      SyntheticObject object;
+      object.instance_id = i;
+      object.class_id = class_ids[i % class_ids.size()];
+      voxelize(&object);
+      place(&object);
+      objects_.push_back(object);
+    }
+  }
+
+  const std::vector<SyntheticObject>& objects() const { return objects_; }
+
+  std::map<int, unsigned> instanceIdToClassId() const {
+    std::map<int, unsigned> instance_id_to_class_id;
+    for (const SyntheticObject& object : objects_) {
+      instance_id_to_class_id[object.instance_id] = object.class_id;
+    }
+    return instance_id_to_class_id;
+  }
+
+  /**
+  * @brief camera pose of the index-th frame of num_frames, moving along an arc
+  * of 90 degrees around the bin while looking at its center.
+  */
+  static Eigen::Matrix4f cameraPose(int index, int num_frames) {
+    double angle = M_PI / 2 * (static_cast<double>(index) / std::max(num_frames - 1, 1) - 0.5);
+    Eigen::Vector3f eye(0.7 * std::sin(angle), -0.7 * std::cos(angle), 0.7);
+    return look_at(eye, Eigen::Vector3f(0, 0, 0.05));
+  }
+
+  /**
+  * @brief render the depth (16UC1 in millimeters, 0 if no hit) and instance
+  * labels (-1: table) of the frame at its pose, setting the frame up for
+  * MultiInstanceMapping.
+  */
+  void render(
+      const Eigen::Matrix4f& cameraToWorld,
+      const boost::shared_ptr<morefusion_ros::utils::CameraRays>& camera_rays,
+      morefusion_ros::MultiInstanceMapping::SensorFrame* frame) const {
+    int width = camera_rays->width();
+    int height = camera_rays->height();
+    frame->width = width;
+    frame->height = height;
+    frame->depth.create(height, width, CV_16UC1);
+    frame->label_ins.create(height, width, CV_32SC1);
+    frame->depth_unit = 0.001;
+    frame->camera_rays = camera_rays;
+    frame->setPose(cameraToWorld);
+
+    Eigen::Vector3f origin = cameraToWorld.block<3, 1>(0, 3);
+    Eigen::Vector3f axis_z = cameraToWorld.block<3, 1>(0, 2);
+    #pragma omp parallel for
+    for (int j = 0; j < height; j++) {
+      uint16_t* depth = frame->depth.ptr<uint16_t>(j);
+      int32_t* label = frame->label_ins.ptr<int32_t>(j);
+      for (int i = 0; i < width; i++) {
+        Eigen::Vector3f direction = frame->getRay(j * width + i);
+        float t_min = std::numeric_limits<float>::infinity();
+        int instance_id = -1;
+        // table
+        if (direction(2) < 0) {
+          float t = -origin(2) / direction(2);
+          Eigen::Vector3f point = origin + t * direction;
+          if ((std::abs(point(0)) < 0.5) && (std::abs(point(1)) < 0.5)) {
+            t_min = t;
+          }
+        }
+        for (const SyntheticObject& object : objects_) {
+          float t = intersect(origin, direction, object, t_min);
+          if (t < t_min) {
+            t_min = t;
+            instance_id = object.instance_id;
+          }
+        }
+        if (std::isinf(t_min)) {
+          depth[i] = 0;
+          label[i] = -1;
+          continue;
+        }
+        // distance along the ray to depth along the optical axis
+        float z = t_min * direction.dot(axis_z);
+        depth[i] = std::min(std::round(z * 1000), 65535.0f);
+        label[i] = instance_id;
+      }
+    }
+  }
+
+ protected:
+  double uniform(double min, double max) {
+    return min + (max - min) * (random_() / 4294967296.0);
+  }
+
+  void voxelize(SyntheticObject* object) {
+    object->pitch = morefusion_ros::utils::class_id_to_voxel_pitch(object->class_id);
+    bool is_cylinder;
+    Eigen::Vector3f extents;
+    ycb_video_shape(object->class_id, &is_cylinder, &extents);
+    extents *= 32 * object->pitch / extents.norm();
+    for (int axis = 0; axis < 3; axis++) {
+      object->dims[axis] = std::max(static_cast<int>(std::round(extents(axis) / object->pitch)), 1);
+      object->half_extents(axis) = object->dims[axis] * object->pitch / 2;
+    }
+    const int* dims = object->dims;
+    object->occupancy.assign(dims[0] * dims[1] * dims[2], 1);
+    if (!is_cylinder) {
+      return;
+    }
+    for (int i = 0; i < dims[0]; i++) {
+      for (int j = 0; j < dims[1]; j++) {
+        double x = (i + 0.5) / dims[0] - 0.5;
+        double y = (j + 0.5) / dims[1] - 0.5;
+        if (x * x + y * y > 0.25) {
+          for (int k = 0; k < dims[2]; k++) {
+            object->occupancy[(i * dims[1] + j) * dims[2] + k] = 0;
+          }
+        }
+      }
+    }
+  }
+
+  // Place the object at the lowest of random positions in the bin, on top of
+  // the objects whose footprints overlap with it there.
+  void place(SyntheticObject* object) {
+    object->yaw = uniform(-M_PI, M_PI);
+    double radius = object->half_extents.head<2>().norm();
+    double z_best = std::numeric_limits<double>::infinity();
+    for (int trial = 0; trial < 20; trial++) {
+      // one call per statement, as the order of evaluating arguments is unspecified
+      double x = uniform(-0.4 + radius, 0.4 - radius);
+      double y = uniform(-0.4 + radius, 0.4 - radius);
+      double z = 0;
+      for (const SyntheticObject& other : objects_) {
+        double distance = (other.position.head<2>() - Eigen::Vector2f(x, y)).norm();
+        if (distance < radius + other.half_extents.head<2>().norm()) {
+          z = std::max(z, other.position(2) + 2.0 * other.half_extents(2));
+        }
+      }
+      if (z < z_best) {
+        z_best = z;
+        object->position << x, y, z;
+      }
+      if (z == 0) {
+        break;
+      }
+    }
+  }
+
+  // distance to the first occupied voxel along the unit ray, by traversing the
+  // voxels (Amanatides and Woo), or infinity if missed before t_max
+  static float intersect(
+      const Eigen::Vector3f& origin_world,
+      const Eigen::Vector3f& direction_world,
+      const SyntheticObject& object,
+      float t_max) {
+    const float infinity = std::numeric_limits<float>::infinity();
+    // culling with the bounding sphere
+    Eigen::Vector3f center = object.position + Eigen::Vector3f(0, 0, object.half_extents(2));
+    Eigen::Vector3f to_center = center - origin_world;
+    float t_center = to_center.dot(direction_world);
+    float radius = object.half_extents.norm();
+    if (((to_center - t_center * direction_world).squaredNorm() > radius * radius) ||
+        (t_center + radius < 0) || (t_center - radius > t_max)) {
+      return infinity;
+    }
+
+    // ray in the voxel coordinates of the object, where the voxel i spans [i, i + 1)
+    float c = std::cos(object.yaw);
+    float s = std::sin(object.yaw);
+    Eigen::Vector3f offset = origin_world - object.position;
+    Eigen::Vector3f origin(
+      c * offset(0) + s * offset(1) + object.half_extents(0),
+      -s * offset(0) + c * offset(1) + object.half_extents(1),
+      offset(2));
+    Eigen::Vector3f direction(
+      c * direction_world(0) + s * direction_world(1),
+      -s * direction_world(0) + c * direction_world(1),
+      direction_world(2));
+    origin /= object.pitch;
+    direction /= object.pitch;  // so that t stays the distance in world frame
+
+    // slab test against the voxels
+    float t_near = 0;
+    float t_far = t_max;
+    for (int axis = 0; axis < 3; axis++) {
+      if (direction(axis) == 0) {
+        if ((origin(axis) < 0) || (origin(axis) > object.dims[axis])) {
+          return infinity;
+        }
+        continue;
+      }
+      float t1 = -origin(axis) / direction(axis);
+      float t2 = (object.dims[axis] - origin(axis)) / direction(axis);
+      t_near = std::max(t_near, std::min(t1, t2));
+      t_far = std::min(t_far, std::max(t1, t2));
+    }
+    if (t_near > t_far) {
+      return infinity;
+    }
+
+    // traversal
+    Eigen::Vector3f entry = origin + t_near * direction;
+    int index[3];
+    int step[3];
+    float t_next[3];
+    float t_delta[3];
+    for (int axis = 0; axis < 3; axis++) {
+      index[axis] = std::min(std::max(static_cast<int>(std::floor(entry(axis))), 0),
+                             object.dims[axis] - 1);
+      if (direction(axis) > 0) {
+        step[axis] = 1;
+        t_next[axis] = t_near + (index[axis] + 1 - entry(axis)) / direction(axis);
+        t_delta[axis] = 1 / direction(axis);
+      } else if (direction(axis) < 0) {
+        step[axis] = -1;
+        t_next[axis] = t_near + (index[axis] - entry(axis)) / direction(axis);
+        t_delta[axis] = -1 / direction(axis);
+      } else {
+        step[axis] = 0;
+        t_next[axis] = infinity;
+        t_delta[axis] = infinity;
+      }
+    }
+    float t = t_near;
+    while (t <= t_far) {
+      if (object.isOccupied(index[0], index[1], index[2])) {
+        return t;
+      }
+      int axis = 0;
+      if (t_next[1] < t_next[axis]) {
+        axis = 1;
+      }
+      if (t_next[2] < t_next[axis]) {
+        axis = 2;
+      }
+      t = t_next[axis];
+      index[axis] += step[axis];
+      if ((index[axis] < 0) || (index[axis] >= object.dims[axis])) {
+        break;
+      }
+      t_next[axis] += t_delta[axis];
+    }
+    return infinity;
+  }
+
+  std::mt19937 random_;
+  std::vector<SyntheticObject> objects_;
+};
+
+}  // namespace synthetic
+}  // namespace morefusion_ros
+
+#endif  // ROS_ROS_OBJSLAMPP_YCB_VIDEO_BENCHMARK_SYNTHETIC_SCENE_H_
@@ -0,0 +1,126 @@
+// Copyright (c) 2019 Kentaro Wada
+
+#ifndef ROS_ROS_OBJSLAMPP_YCB_VIDEO_INCLUDE_ROS_OBJSLAMPP_YCB_VIDEO_FRAMELOG_H_
+#define ROS_ROS_OBJSLAMPP_YCB_VIDEO_INCLUDE_ROS_OBJSLAMPP_YCB_VIDEO_FRAMELOG_H_
+
+#include <stdint.h>
+
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+#include <Eigen/Core>
+#include <opencv2/opencv.hpp>
+
+#include "morefusion_ros/MultiInstanceMapping.h"
+
+// Binary log of the frames integrated by OctomapServer (~record/path), to
+// replay them bit-for-bit without ROS (mapping_replay). The file is the
+// mapping parameters followed by a record per frame: intrinsics, sensor pose,
+// depth, points in world frame, instance labels and classes. Resets of the map
+// (~reset, and the start of the server) are records without a frame, so that
+// the replay drops the frames before them as OctomapServer::integrateFrame
+// does. Records are 8-byte aligned in the native byte order, so that the
+// images are read in place from the memory-mapped file.
+
+namespace morefusion_ros {
+
+// an instance of ObjectClassArray, as stored in the log
+struct FrameLogClass {
+  int32_t instance_id;
+  uint32_t class_id;
+  float confidence;
+};
+
+// a frame read from the log
+struct RecordedFrame {
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+  int64_t stamp;  // nanoseconds
+  // a reset of the map at stamp, after which the frames captured before it
+  // are dropped. The other fields are not set.
+  bool is_reset;
+  Eigen::Matrix<float, 4, 4, Eigen::DontAlign> sensorToWorld;
+  // without the pose and camera_rays. The depth (unless the points are used)
+  // and labels are read-only views of the mapped file.
+  MultiInstanceMapping::SensorFrame sensor;
+  cv::Mat depth;  // recorded even if the points are used, empty if not recorded
+  std::vector<FrameLogClass> classes;
+  bool ground_as_noentry;
+  bool free_as_noentry;
+};
+
+class FrameLogWriter : private boost::noncopyable {
+ public:
+  FrameLogWriter() {}
+
+  /**
+  * @brief create the log, overwriting the file, with the mapping parameters.
+  */
+  bool open(const std::string& path, const MultiInstanceMapping::Params& params);
+  bool isOpen() const { return ofs_.is_open(); }
+
+  /**
+  * @brief append a frame and flush it, so that the log survives a crash.
+  *
+  * @param sensor frame with its pose, and the points in world frame or the
+  * depth, and 32SC1 labels
+  * @param depth 16UC1 or 32FC1 depth recorded as is, or empty
+  * @return false if the frame can't be recorded
+  */
+  bool write(
+      int64_t stamp,
+      const MultiInstanceMapping::SensorFrame& sensor,
+      const cv::Mat& depth,
+      const std::vector<FrameLogClass>& classes,
+      bool ground_as_noentry,
+      bool free_as_noentry);
+
+  /**
+  * @brief append a reset of the map at stamp and flush it.
+  */
+  bool writeReset(int64_t stamp);
+
+ protected:
+  void writeImage(const cv::Mat& image);
+  void writePadding(size_t size);
+
+  std::ofstream ofs_;
+  std::vector<float> points_;  // reused across frames
+};
+
+class FrameLogReader : private boost::noncopyable {
+ public:
+  FrameLogReader() : data_(NULL), size_(0), is_truncated_(false) {}
+  ~FrameLogReader() { close(); }
+
+  /**
+  * @brief map the log into memory and index its records. A record cut off at
+  * the end (e.g. by a crash while recording) is ignored, see isTruncated(),
+  * and a log with a record of an unknown depth type is not opened.
+  */
+  bool open(const std::string& path);
+  void close();
+
+  const MultiInstanceMapping::Params& params() const { return params_; }
+  // of frames and resets
+  size_t numRecords() const { return offsets_.size(); }
+  bool isTruncated() const { return is_truncated_; }
+
+  /**
+  * @brief read the index-th record, valid until the log is closed.
+  */
+  void read(size_t index, RecordedFrame* frame) const;
+
+ protected:
+  const uint8_t* data_;
+  size_t size_;
+  bool is_truncated_;
+  MultiInstanceMapping::Params params_;
+  std::vector<size_t> offsets_;
+};
+
+}  // namespace morefusion_ros
+
+#endif  // ROS_ROS_OBJSLAMPP_YCB_VIDEO_INCLUDE_ROS_OBJSLAMPP_YCB_VIDEO_FRAMELOG_H_
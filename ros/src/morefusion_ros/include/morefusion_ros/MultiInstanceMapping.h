@@ -0,0 +1,310 @@
+// Copyright (c) 2019 Kentaro Wada
+
+#ifndef ROS_ROS_OBJSLAMPP_YCB_VIDEO_INCLUDE_ROS_OBJSLAMPP_YCB_VIDEO_MULTIINSTANCEMAPPING_H_
+#define ROS_ROS_OBJSLAMPP_YCB_VIDEO_INCLUDE_ROS_OBJSLAMPP_YCB_VIDEO_MULTIINSTANCEMAPPING_H_
+
+#include <pcl/point_types.h>
+#include <pcl/point_cloud.h>
+#include <octomap/octomap.h>
+#include <octomap/OcTreeKey.h>
+
+#include <stdint.h>
+
+#include <cmath>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <Eigen/Core>
+#include <opencv2/opencv.hpp>
+
+#include "morefusion_ros/utils/camera.h"
+#include "morefusion_ros/utils/geometry.h"
+#include "morefusion_ros/utils/octomap.h"
+#include "morefusion_ros/utils/stats.h"
+
+namespace morefusion_ros {
+
+/**
+* @brief octree map of multiple object instances (-1: background), updated by
+* rendering the map into the camera, tracking the detected instances against
+* the rendering and integrating the labeled depth.
+*
+* It has no ROS dependency, so that the mapping runs without a ROS master,
+* e.g., in mapping_benchmark; OctomapServer wraps it with the topics and TF.
+*/
+class MultiInstanceMapping : private boost::noncopyable {
+ public:
+  typedef pcl::PointXYZ PCLPoint;
+  typedef pcl::PointCloud<pcl::PointXYZ> PCLPointCloud;
+  typedef octomap::OcTree OcTreeT;
+
+  struct Params {
+    Params()
+      : resolution(0.05),
+        max_range(-1),
+        probability_hit(0.7),
+        probability_miss(0.4),
+        probability_min(0.12),
+        probability_max(0.97),
+        compress_map(false),
+        render_mode("raycast"),
+        ground_as_noentry(false),
+        free_as_noentry(false),
+        grid_cache_max_translation(0),
+        grid_cache_max_rotation(0) {}
+
+    double resolution;  // of the background octree
+    double max_range;  // of the integrated rays, unlimited if negative
+    double probability_hit;
+    double probability_miss;
+    double probability_min;
+    double probability_max;
+    bool compress_map;
+    std::string render_mode;  // raycast or rasterize
+    bool ground_as_noentry;
+    bool free_as_noentry;
+    // sensor motion [m, rad] within which the cached grids are kept. The grids
+    // are in the sensor frame, so with 0 they are extracted again on any motion.
+    double grid_cache_max_translation;
+    double grid_cache_max_rotation;
+  };
+
+  // a frame of a pinhole camera with its pose in world frame
+  struct SensorFrame {
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+    SensorFrame() : width(0), height(0), fx(0), fy(0), cx(0), cy(0), depth_unit(0.001) {}
+
+    int width;
+    int height;
+    float fx;
+    float fy;
+    float cx;
+    float cy;
+    Eigen::Matrix4f sensorToWorld;
+    octomap::point3d sensorOrigin;
+    PCLPointCloud pc;  // in world frame, or empty to back-project depth
+    cv::Mat depth;  // 16UC1 (in depth_unit) or 32FC1 (in meters), empty if pc is used
+    float depth_unit;  // meters per 16UC1 depth value
+    cv::Mat label_ins;  // 32SC1, read-only
+    boost::shared_ptr<const morefusion_ros::utils::CameraRays> camera_rays;
+
+    void setPose(const Eigen::Matrix4f& pose) {
+      sensorToWorld = pose;
+      sensorOrigin = octomap::point3d(pose(0, 3), pose(1, 3), pose(2, 3));
+    }
+
+    /**
+    * @brief get the unit ray of a pixel (row * width + col) in world frame.
+    * Rays are rotated on demand, as most pixels are skipped by the callers.
+    */
+    Eigen::Vector3f getRay(size_t index) const {
+      return sensorToWorld.topLeftCorner<3, 3>() * camera_rays->directions().col(index);
+    }
+
+    /**
+    * @brief get the point of a pixel in world frame, from the points or by
+    * back-projecting the depth.
+    *
+    * @return false if the pixel has no valid depth
+    */
+    bool getPoint(int row, int col, octomap::point3d* point) const {
+      size_t index = row * width + col;
+      if (depth.empty()) {
+        const PCLPoint& p = pc.points[index];
+        if (std::isnan(p.x) || std::isnan(p.y) || std::isnan(p.z)) {
+          return false;
+        }
+        *point = octomap::point3d(p.x, p.y, p.z);
+        return true;
+      }
+      float z;
+      if (depth.type() == CV_16UC1) {
+        uint16_t value = depth.ptr<uint16_t>(row)[col];
+        if (value == 0) {
+          return false;
+        }
+        z = value * depth_unit;
+      } else {
+        z = depth.ptr<float>(row)[col];
+        if (!(z > 0) || std::isinf(z)) {
+          return false;
+        }
+      }
+      Eigen::Vector3f ray = getRay(index) * (z * camera_rays->ranges()(index));
+      *point = sensorOrigin + octomap::point3d(ray(0), ray(1), ray(2));
+      return true;
+    }
+  };
+
+  // occupancy of 32x32x32 voxels around an instance, with the voxel pitch of its class
+  struct Grid {
+    Grid() : origin(Eigen::Vector3f::Zero()), pitch(0), instance_id(-1), class_id(0) {
+      dims[0] = dims[1] = dims[2] = 0;
+    }
+
+    Eigen::Vector3f origin;
+    float pitch;
+    int dims[3];
+    int instance_id;
+    unsigned class_id;
+    std::vector<uint32_t> indices;
+    std::vector<float> values;
+  };
+
+  // grids of an instance in the sensor frame, and the sensor pose they were extracted with
+  struct GridCache {
+    Eigen::Matrix<float, 4, 4, Eigen::DontAlign> sensorToWorld;
+    Grid grid;
+    Grid grid_noentry;
+  };
+
+  explicit MultiInstanceMapping(const Params& params = Params());
+  ~MultiInstanceMapping();
+
+  /**
+  * @brief clear the map and restart the instance ids from 0.
+  */
+  void reset();
+
+  /**
+  * @brief change what the noentry grids are made of, dropping the cached grids.
+  */
+  void setNoEntry(bool ground_as_noentry, bool free_as_noentry);
+
+  /**
+  * @brief set where integrate and its stages record the stage latencies and
+  * per-frame counters (NULL: nowhere). The counters (render_rays, track_pairs,
+  * rays_cast, keys_updated, grid_voxels_searched) count the work of a frame,
+  * independent of the timing and the number of threads.
+  */
+  void setStats(morefusion_ros::utils::PipelineStats* stats) { stats_ = stats; }
+
+  /**
+  * @brief integrate a frame as OctomapServer does: render the map, track the
+  * instance ids of label_ins with it, insertScan and updateGrids, timing each
+  * step in the stats (render, track_instance_id, insert_scan, update_grids).
+  *
+  * @param label_ins 32SC1 detected instance labels, tracked in place
+  * @param instance_id_to_class_id classes of the detections, replaced by
+  * those of the tracked instances
+  * @param label_ins_rend rendered labels, merged with the tracked ones
+  * @param render false if label_ins_rend is already rendered, e.g., by a
+  * render service
+  * @return false if an instance in label_ins has no class
+  */
+  bool integrate(
+    const SensorFrame& frame,
+    cv::Mat& label_ins,
+    std::map<int, unsigned>* instance_id_to_class_id,
+    cv::Mat& label_ins_rend,
+    bool render = true);
+
+  /**
+  * @brief render instance labels of the map (-2: unknown) with params.render_mode.
+  */
+  void render(const SensorFrame& frame, cv::Mat& label_ins_rend);
+  void renderRaycast(const SensorFrame& frame, cv::Mat& label_ins_rend);
+
+  /**
+  * @brief render instance labels by projecting occupied leaves of each instance
+  * into the camera with a z-buffer, instead of casting a ray per pixel.
+  * Produces the same label semantics as renderRaycast().
+  */
+  void renderRasterize(const SensorFrame& frame, cv::Mat& label_ins_rend);
+
+  /**
+  * @brief replace the detected instance ids in label_ins with those of the map
+  * (see utils::track_instance_id), and add the classes of the map instances
+  * to instance_id_to_class_id.
+  */
+  void trackInstanceIds(
+    cv::Mat& label_ins_rend,
+    cv::Mat* label_ins,
+    std::map<int, unsigned>* instance_id_to_class_id);
+
+  /**
+  * @brief update the octrees with a tracked label image: free on the rays,
+  * occupied at the endpoints in the octree of the instance.
+  *
+  * @return false if an instance in label_ins has no class
+  */
+  bool insertScan(
+    const SensorFrame& frame,
+    const cv::Mat& label_ins,
+    const std::map<int, unsigned>& instance_id_to_class_id);
+
+  /**
+  * @brief extract again the grids whose cache is stale (see isGridCacheStale).
+  */
+  void updateGrids(const Eigen::Matrix4f& sensorToWorld);
+  void getGridsInWorldFrame(std::vector<Grid>* grids) const;
+
+  /**
+  * @brief Find speckle nodes (single occupied voxels with no neighbors). Only works on lowest resolution!
+  */
+  static bool isSpeckleNode(const OcTreeT& octree_bg, const octomap::OcTreeKey& key);
+
+  const Params& params() const { return params_; }
+  const std::map<int, OcTreeT*>& octrees() const { return octrees_; }
+  const morefusion_ros::utils::InstanceVoxelIndex& instanceIndex() const {
+    return instance_index_;
+  }
+  const std::map<int, unsigned>& classIds() const { return class_ids_; }
+  const std::set<int>& instanceIdsUpdated() const { return instance_ids_updated_; }
+  const std::map<int, GridCache>& gridsCache() const { return grids_cache_; }
+
+ protected:
+  /**
+  * @brief check if the cached grids need to be extracted again, which is when
+  * the octree of the instance was updated by the last insertScan, the noentry
+  * voxels around it changed, or the sensor moved more than the grid_cache
+  * thresholds (the grids are in the sensor frame).
+  */
+  bool isGridCacheStale(
+      int instance_id,
+      const GridCache& cache,
+      const Eigen::Matrix4f& sensorToWorld) const;
+  /**
+  * @brief check if updating a voxel from occupancy_before (0.5 if unknown) to
+  * occupancy_after changes what the noentry grids of the other instances read
+  * from it (see extractGrids).
+  */
+  bool isNoEntryChanged(double occupancy_before, double occupancy_after, bool is_background) const;
+  void extractGrids(
+      int instance_id,
+      const Eigen::Matrix4f& sensorToWorld,
+      Grid* grid,
+      Grid* grid_noentry);
+
+  Params params_;
+  morefusion_ros::utils::PipelineStats* stats_;
+
+  std::map<int, OcTreeT*> octrees_;
+  // occupancy of the instance octrees (excluding background) at any coordinate
+  morefusion_ros::utils::InstanceVoxelIndex instance_index_;
+  std::map<int, unsigned> class_ids_;
+  std::map<int, octomap::point3d> centers_;
+  unsigned instance_counter_;
+
+  // octrees updated by the last insertScan, and the world region where it
+  // changed the noentry grids (none if min > max). Free space carved in the
+  // background only counts if it changed the noentry voxels.
+  std::set<int> instance_ids_updated_;
+  octomap::point3d noentry_changed_min_;
+  octomap::point3d noentry_changed_max_;
+  std::map<int, GridCache> grids_cache_;
+
+  // per-frame buffers, reused across frames
+  cv::Mat render_depth_;
+  std::vector<std::vector<float> > render_depths_instance_;  // only grow
+  morefusion_ros::utils::TrackInstanceIdWorkspace track_workspace_;
+};
+
+}  // namespace morefusion_ros
+
+#endif  // ROS_ROS_OBJSLAMPP_YCB_VIDEO_INCLUDE_ROS_OBJSLAMPP_YCB_VIDEO_MULTIINSTANCEMAPPING_H_
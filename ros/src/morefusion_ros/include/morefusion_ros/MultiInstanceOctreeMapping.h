@@ -0,0 +1,95 @@
+// Copyright (c) 2019 Kentaro Wada
+
+#ifndef ROS_ROS_OBJSLAMPP_YCB_VIDEO_INCLUDE_ROS_OBJSLAMPP_YCB_VIDEO_MULTIINSTANCEOCTREEMAPPING_H_
+#define ROS_ROS_OBJSLAMPP_YCB_VIDEO_INCLUDE_ROS_OBJSLAMPP_YCB_VIDEO_MULTIINSTANCEOCTREEMAPPING_H_
+
+#include <octomap/octomap.h>
+
+#include <map>
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+
+namespace morefusion_ros {
+
+/**
+* @brief octrees of instances with their own voxel pitch, integrated with
+* point clouds of the instance masks.
+*
+* It is the engine of morefusion.contrib.MultiInstanceOctreeMapping (through
+* the morefusion_mapping Python module), with the same results as its
+* octomap-python implementation.
+*/
+class MultiInstanceOctreeMapping : private boost::noncopyable {
+ public:
+  typedef octomap::OcTree OcTreeT;
+
+  MultiInstanceOctreeMapping() {}
+  ~MultiInstanceOctreeMapping();
+
+  // in the order of initialize()
+  const std::vector<int>& instanceIds() const { return instance_ids_; }
+  bool hasInstance(int instance_id) const { return octrees_.find(instance_id) != octrees_.end(); }
+
+  /**
+  * @brief add an empty octree of the instance.
+  *
+  * @return false if the instance already exists
+  */
+  bool initialize(int instance_id, double pitch);
+
+  /**
+  * @brief insert the points with rays from the origin: free on the rays,
+  * occupied at the points.
+  *
+  * @return false if the instance does not exist
+  */
+  bool integrate(
+      int instance_id,
+      const octomap::Pointcloud& points,
+      const octomap::point3d& origin);
+
+  /**
+  * @brief mark the points occupied, without rays.
+  *
+  * @return false if the instance does not exist
+  */
+  bool update(int instance_id, const std::vector<octomap::point3d>& occupied);
+
+  /**
+  * @brief get the occupancy of the voxels at origin + (i, j, k) * pitch in
+  * C-ordered dims[0] x dims[1] x dims[2] grids: occupied by the target,
+  * occupied by the others, and empty (1 - occupancy). The later instance wins
+  * where the octrees overlap.
+  *
+  * @return false if the target does not exist
+  */
+  bool getTargetGrids(
+      int target_id,
+      const int dims[3],
+      double pitch,
+      const double origin[3],
+      float* grid_target,
+      float* grid_nontarget,
+      float* grid_empty) const;
+
+  /**
+  * @brief get the centers of the occupied and free leaves of the target,
+  * expanding the pruned leaves into voxels of the octree resolution, as
+  * flattened (x, y, z) of each point.
+  *
+  * @return false if the target does not exist
+  */
+  bool getTargetPoints(
+      int target_id,
+      std::vector<double>* occupied,
+      std::vector<double>* empty) const;
+
+ protected:
+  std::vector<int> instance_ids_;
+  std::map<int, OcTreeT*> octrees_;
+};
+
+}  // namespace morefusion_ros
+
+#endif  // ROS_ROS_OBJSLAMPP_YCB_VIDEO_INCLUDE_ROS_OBJSLAMPP_YCB_VIDEO_MULTIINSTANCEOCTREEMAPPING_H_
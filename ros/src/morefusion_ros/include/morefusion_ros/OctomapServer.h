@@ -16,6 +16,7 @@
 #include <pcl_conversions/pcl_conversions.h>
 
 #include <cv_bridge/cv_bridge.h>
+#include <diagnostic_msgs/DiagnosticArray.h>
 #include <dynamic_reconfigure/server.h>
 #include <jsk_recognition_msgs/BoundingBoxArray.h>
 #include <nav_msgs/OccupancyGrid.h>
@@ -30,11 +31,13 @@
 #include <octomap_msgs/BoundingBoxQuery.h>
 #include <octomap_msgs/conversions.h>
 #include <ros/ros.h>
+#include <morefusion_ros/CompactVoxelGridArray.h>
 #include <morefusion_ros/VoxelGridArray.h>
 #include <morefusion_ros/ObjectClassArray.h>
 #include <morefusion_ros/RenderVoxelGridArray.h>
 #include <sensor_msgs/PointCloud2.h>
 #include <sensor_msgs/CameraInfo.h>
+#include <sensor_msgs/image_encodings.h>
 #include <std_msgs/ColorRGBA.h>
 #include <std_srvs/Empty.h>
 #include <tf/message_filter.h>
@@ -42,13 +45,22 @@
 #include <visualization_msgs/MarkerArray.h>
 
 #include <algorithm>
+#include <cmath>
+#include <limits>
 #include <map>
 #include <set>
 #include <string>
+#include <utility>
+#include <vector>
 
+#include <boost/atomic.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/thread.hpp>
 #include <opencv2/opencv.hpp>
 
+#include "morefusion_ros/FrameLog.h"
+#include "morefusion_ros/MultiInstanceMapping.h"
 #include "morefusion_ros/OctomapServerConfig.h"
 #include "morefusion_ros/utils.h"
 
@@ -56,9 +68,9 @@ namespace morefusion_ros {
 
 class OctomapServer {
  public:
-  typedef pcl::PointXYZ PCLPoint;
-  typedef pcl::PointCloud<pcl::PointXYZ> PCLPointCloud;
-  typedef octomap::OcTree OcTreeT;
+  typedef MultiInstanceMapping::PCLPoint PCLPoint;
+  typedef MultiInstanceMapping::PCLPointCloud PCLPointCloud;
+  typedef MultiInstanceMapping::OcTreeT OcTreeT;
 
   typedef octomap_msgs::GetOctomap OctomapSrv;
   typedef octomap_msgs::BoundingBoxQuery BBXSrv;
@@ -69,10 +81,21 @@ class OctomapServer {
     sensor_msgs::PointCloud2,
     sensor_msgs::Image,
     morefusion_ros::ObjectClassArray> ExactSyncPolicy;
+  typedef message_filters::sync_policies::ExactTime<
+    sensor_msgs::CameraInfo,
+    sensor_msgs::Image,
+    sensor_msgs::Image,
+    morefusion_ros::ObjectClassArray> ExactSyncDepthPolicy;
 
   explicit OctomapServer();
-  virtual ~OctomapServer() {}
+  // with the node handles of a nodelet
+  OctomapServer(const ros::NodeHandle& nh, const ros::NodeHandle& pnh);
+  virtual ~OctomapServer();
 
+  /**
+  * @brief enqueue the synchronized inputs for the pipeline, following the
+  * drop policy of ~queue/policy.
+  */
   virtual void insertCloudCallback(
     const sensor_msgs::CameraInfoConstPtr& camera_info,
     const sensor_msgs::ImageConstPtr& depth_msg,
@@ -80,49 +103,109 @@ class OctomapServer {
     const sensor_msgs::ImageConstPtr& ins_msg,
     const morefusion_ros::ObjectClassArrayConstPtr& class_msg);
 
+  /**
+  * @brief same as insertCloudCallback, without points (~use_points: false).
+  */
+  virtual void insertDepthCallback(
+    const sensor_msgs::CameraInfoConstPtr& camera_info,
+    const sensor_msgs::ImageConstPtr& depth_msg,
+    const sensor_msgs::ImageConstPtr& ins_msg,
+    const morefusion_ros::ObjectClassArrayConstPtr& class_msg);
+
  protected:
-  void publishBinaryOctoMap(const ros::Time& rostime = ros::Time::now()) const;
-  void publishFullOctoMap(const ros::Time& rostime = ros::Time::now()) const;
-  virtual void publishAll(const ros::Time& rostime = ros::Time::now());
+  // synchronized inputs of a frame
+  struct Frame {
+    sensor_msgs::CameraInfoConstPtr camera_info;
+    sensor_msgs::ImageConstPtr depth;
+    sensor_msgs::PointCloud2ConstPtr cloud;  // NULL if ~use_points is false
+    sensor_msgs::ImageConstPtr ins;
+    morefusion_ros::ObjectClassArrayConstPtr cls;
+  };
 
-  void getGridsInWorldFrame(const ros::Time& rostime, morefusion_ros::VoxelGridArray& grids);
-  void publishGrids(
-      const ros::Time& rostime,
-      const Eigen::Matrix4f& sensorToWorld,
-      const std::set<int>& instance_ids_active);
+  // a frame converted by the convert stage, which does not touch the map.
+  // The depth and labels share the buffers of msgs.
+  struct PreparedFrame : public MultiInstanceMapping::SensorFrame {
+    Frame msgs;
+    std_msgs::Header header;  // of the points, or the depth if ~use_points is false
+    tf::StampedTransform sensorToWorldTf;
+  };
+  typedef boost::shared_ptr<PreparedFrame> PreparedFramePtr;
+
+  // immutable copy of the map, taken after integrating a frame only while the
+  // map is subscribed or octomap_binary asked for it. Octrees and the instance
+  // index that were not updated since the previous snapshot are shared with it.
+  struct MapSnapshot {
+    ros::Time stamp;
+    std::map<int, boost::shared_ptr<const OcTreeT> > octrees;
+    boost::shared_ptr<const morefusion_ros::utils::InstanceVoxelIndex> instance_index;
+  };
+  typedef boost::shared_ptr<const MapSnapshot> MapSnapshotConstPtr;
+
+  // pipeline stages, each running in its own thread:
+  // convert (TF, PCL and OpenCV conversion) -> integrate (render, track,
+  // insertScan, grids) -> publish (markers and octomap of a map snapshot)
+  void convertLoop();
+  void integrateLoop();
+  void publishLoop();
+
+  bool prepareFrame(const Frame& frame, PreparedFrame* prepared);
+
+  /**
+  * @brief take a frame from prepared_pool_, or a new one if all are in flight.
+  */
+  PreparedFramePtr takePreparedFrame();
+
+  /**
+  * @brief return a frame to prepared_pool_, releasing the messages it holds.
+  */
+  void releasePreparedFrame(const PreparedFramePtr& prepared);
+
+  /**
+  * @brief append the prepared frame to the log of ~record/path, if any, stopping the
+  * recording if it fails. Called by the convert stage.
+  */
+  void recordFrame(const PreparedFrame& prepared);
+
+  virtual void integrateFrame(PreparedFrame* prepared);
+  bool isMapSubscribed() const;
 
   /**
-  * @brief update occupancy map with a scan labeled as ground and nonground.
-  * The scans should be in the global map frame.
-  *
-  * @param sensorOrigin origin of the measurements for raycasting
-  * @param ground scan endpoints on the ground plane (only clear space)
-  * @param nonground all other endpoints (clear up to occupied endpoint)
+  * @brief replace snapshot_ with the current map, copying only the octrees
+  * updated since the previous snapshot.
   */
-  virtual void insertScan(
-    const tf::Point& sensorOrigin,
-    const PCLPointCloud& pc,
-    const cv::Mat& label_ins,
-    const std::map<int, unsigned>& instance_id_to_class_id);
-  virtual void render(
-    const sensor_msgs::CameraInfoConstPtr& camera_info_msg,
-    const tf::Point& sensorOrigin,
-    const PCLPointCloud& pc,
-    cv::Mat& label_ins_rend,
-    const Eigen::Matrix4f sensorToWorld);
+  void updateSnapshot(const ros::Time& rostime);
 
   /**
-  * @brief Find speckle nodes (single occupied voxels with no neighbors). Only works on lowest resolution!
-  * @param key
-  * @return
+  * @brief apply the reset and dynamic_reconfigure requests received since the
+  * last frame. Called by the integrate stage, which owns the map.
   */
-  bool isSpeckleNode(const octomap::OcTreeKey& key) const;
+  void applyRequests();
+
+  /**
+  * @brief publish the stage latencies (p50/p95/p99) and throughputs since the
+  * last call and the per-frame counters, if ~diagnostics/enabled.
+  */
+  void publishDiagnostics(const ros::WallTimerEvent& event);
+
+  void publishBinaryOctoMap(const MapSnapshot& map) const;
+  void publishFullOctoMap(const MapSnapshot& map) const;
+  virtual void publishAll(const MapSnapshot& map);
+
+  static void gridToMsg(
+      const MultiInstanceMapping::Grid& grid,
+      morefusion_ros::VoxelGrid* grid_msg);
+  void getGridsInWorldFrame(const ros::Time& rostime, morefusion_ros::VoxelGridArray& grids);
+  /**
+  * @brief publish the cached grids, updated by MultiInstanceMapping::integrate.
+  */
+  void publishGrids(const ros::Time& rostime);
 
   void configCallback(
     const morefusion_ros::OctomapServerConfig& config,
     const uint32_t level);
 
   bool resetCallback(std_srvs::Empty::Request &req, std_srvs::Empty::Response &res);
+  bool getOctomapCallback(OctomapSrv::Request &req, OctomapSrv::Response &res);
 
   ros::NodeHandle nh_;
   ros::NodeHandle pnh_;
@@ -131,54 +214,100 @@ class OctomapServer {
   ros::Publisher pub_full_map_;
   ros::Publisher pub_grids_;
   ros::Publisher pub_grids_noentry_;
+  ros::Publisher pub_grids_compact_;
+  ros::Publisher pub_grids_noentry_compact_;
   ros::Publisher pub_markers_bg_;
   ros::Publisher pub_markers_fg_;
   ros::Publisher pub_markers_free_;
   ros::Publisher pub_label_rendered_;
   ros::Publisher pub_label_tracked_;
   ros::Publisher pub_class_;
+  ros::Publisher pub_diagnostics_;
 
-  message_filters::Subscriber<sensor_msgs::CameraInfo>* sub_camera_;
-  message_filters::Subscriber<sensor_msgs::Image>* sub_depth_;
-  message_filters::Subscriber<sensor_msgs::PointCloud2>* sub_pcd_;
-  message_filters::Subscriber<sensor_msgs::Image>* sub_label_ins_;
-  message_filters::Subscriber<morefusion_ros::ObjectClassArray>* sub_class_;
-  message_filters::Synchronizer<ExactSyncPolicy>* sync_;
+  // only the inputs of ~use_points are created
+  boost::shared_ptr<message_filters::Subscriber<sensor_msgs::CameraInfo> > sub_camera_;
+  boost::shared_ptr<message_filters::Subscriber<sensor_msgs::Image> > sub_depth_;
+  boost::shared_ptr<message_filters::Subscriber<sensor_msgs::PointCloud2> > sub_pcd_;
+  boost::shared_ptr<message_filters::Subscriber<sensor_msgs::Image> > sub_label_ins_;
+  boost::shared_ptr<message_filters::Subscriber<morefusion_ros::ObjectClassArray> > sub_class_;
+  boost::shared_ptr<message_filters::Synchronizer<ExactSyncPolicy> > sync_;
+  boost::shared_ptr<message_filters::Synchronizer<ExactSyncDepthPolicy> > sync_depth_;
 
-  dynamic_reconfigure::Server<morefusion_ros::OctomapServerConfig> server_reconfig_;
+  // in pnh_, as the default of ~ is the namespace of the manager in a nodelet
+  boost::shared_ptr<dynamic_reconfigure::Server<morefusion_ros::OctomapServerConfig> >
+    server_reconfig_;
 
   ros::ServiceClient client_render_;
 
   ros::ServiceServer server_reset_;
+  ros::ServiceServer server_get_octomap_;
   ros::Time reset_stamp_;
 
-  tf::TransformListener* tf_listener_;
+  // requests from the service and dynamic_reconfigure callbacks, applied by
+  // the integrate stage so that the callbacks never wait for a frame
+  boost::mutex requests_mutex_;
+  bool reset_requested_;
+  bool config_requested_;
+  morefusion_ros::OctomapServerConfig config_;
+
+  boost::shared_ptr<tf::TransformListener> tf_listener_;
+
+  // the map, owned by the integrate stage
+  boost::shared_ptr<MultiInstanceMapping> mapping_;
 
-  std::map<int, OcTreeT*> octrees_;
-  std::map<int, unsigned> class_ids_;
-  std::map<int, octomap::point3d> centers_;
-  unsigned instance_counter_;
+  // per-frame buffers of the integrate stage, reused across frames
+  cv::Mat label_ins_tracked_;
+  cv::Mat label_ins_rend_;
 
-  // mapping parameters
-  double resolution_;
-  double max_range_;
-  double probability_hit_;
-  double probability_miss_;
-  double probability_min_;
-  double probability_max_;
+  // octrees updated since snapshot_
+  std::set<int> instance_ids_stale_;
+
+  // per-pixel rays of the current camera, replaced by the convert stage when
+  // the intrinsics change and shared with the frames
+  boost::shared_ptr<const morefusion_ros::utils::CameraRays> camera_rays_;
+
+  // mapping parameters, see also MultiInstanceMapping::Params
   unsigned tree_depth_;
   unsigned tree_depth_max_;
-  bool do_compress_map_;
   bool use_render_service_;
+  bool use_points_;
 
   // for publishing
   std::string frame_id_world_;
   std::string frame_id_sensor_;
-  bool m_groundAsNoEntry;
-  bool m_freeAsNoEntry;
   bool do_filter_speckles_;
 
-  boost::mutex mutex_;
+  // latest map snapshot, read and replaced with boost::atomic_load/atomic_store
+  MapSnapshotConstPtr snapshot_;
+  // set by getOctomapCallback without locking, so that the next frame updates snapshot_
+  boost::atomic<bool> snapshot_requested_;
+
+  // pipeline queues and threads
+  std::string queue_policy_;  // latest, every_nth or block
+  int queue_every_nth_;
+  morefusion_ros::utils::BoundedQueue<Frame> frame_queue_;
+  morefusion_ros::utils::BoundedQueue<PreparedFramePtr> prepared_queue_;
+  morefusion_ros::utils::BoundedQueue<MapSnapshotConstPtr> snapshot_queue_;
+  // frames returned by the integrate stage for the convert stage to reuse,
+  // with the capacity of their point clouds
+  boost::mutex prepared_pool_mutex_;
+  std::vector<PreparedFramePtr> prepared_pool_;
+  boost::thread convert_thread_;
+  boost::thread integrate_thread_;
+  boost::thread publish_thread_;
+  uint64_t frames_received_;
+  uint64_t frames_dropped_;
+  uint64_t frames_dropped_reported_;
+
+  // log of the prepared frames and the resets for mapping_replay, NULL if
+  // ~record/path is empty. Written by the convert stage and resetCallback.
+  boost::mutex recorder_mutex_;
+  boost::shared_ptr<FrameLogWriter> recorder_;
+
+  // stage latencies and per-frame counters, NULL if ~diagnostics/enabled is false
+  boost::shared_ptr<morefusion_ros::utils::PipelineStats> stats_;
+  ros::WallTimer timer_diagnostics_;
+  ros::WallTime diagnostics_stamp_;  // start of the window of stats_
 };
 
 }  // namespace morefusion_ros
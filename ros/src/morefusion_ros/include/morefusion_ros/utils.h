@@ -3,11 +3,17 @@
 #ifndef ROS_ROS_OBJSLAMPP_YCB_VIDEO_INCLUDE_ROS_OBJSLAMPP_YCB_VIDEO_UTILS_H_
 #define ROS_ROS_OBJSLAMPP_YCB_VIDEO_INCLUDE_ROS_OBJSLAMPP_YCB_VIDEO_UTILS_H_
 
+#include "morefusion_ros/utils/camera.h"
 #include "morefusion_ros/utils/color.h"
 #include "morefusion_ros/utils/data.h"
 #include "morefusion_ros/utils/geometry.h"
 #include "morefusion_ros/utils/log.h"
+#include "morefusion_ros/utils/octomap.h"
 #include "morefusion_ros/utils/opencv.h"
+#include "morefusion_ros/utils/openmp.h"
+#include "morefusion_ros/utils/queue.h"
+#include "morefusion_ros/utils/stats.h"
 #include "morefusion_ros/utils/stl.h"
+#include "morefusion_ros/utils/voxel_grid.h"
 
 #endif  // ROS_ROS_OBJSLAMPP_YCB_VIDEO_INCLUDE_ROS_OBJSLAMPP_YCB_VIDEO_UTILS_H_
@@ -0,0 +1,69 @@
+// Copyright (c) 2019 Kentaro Wada
+
+#ifndef ROS_ROS_OBJSLAMPP_YCB_VIDEO_INCLUDE_ROS_OBJSLAMPP_YCB_VIDEO_UTILS_CAMERA_H_
+#define ROS_ROS_OBJSLAMPP_YCB_VIDEO_INCLUDE_ROS_OBJSLAMPP_YCB_VIDEO_UTILS_CAMERA_H_
+
+#include <cmath>
+
+#include <Eigen/Core>
+
+namespace morefusion_ros {
+namespace utils {
+
+// Unit ray directions of every pixel of a pinhole camera in the camera frame,
+// cached until the intrinsics or the image size change.
+class CameraRays {
+ public:
+  CameraRays() : fx_(0), fy_(0), cx_(0), cy_(0), width_(0), height_(0) {}
+
+  bool matches(float fx, float fy, float cx, float cy, int width, int height) const {
+    return fx == fx_ && fy == fy_ && cx == cx_ && cy == cy_ &&
+           width == width_ && height == height_;
+  }
+
+  void update(float fx, float fy, float cx, float cy, int width, int height) {
+    if (matches(fx, fy, cx, cy, width, height)) {
+      return;
+    }
+    fx_ = fx;
+    fy_ = fy;
+    cx_ = cx;
+    cy_ = cy;
+    width_ = width;
+    height_ = height;
+
+    directions_.resize(3, width * height);
+    ranges_.resize(width * height);
+    for (int j = 0; j < height; j++) {
+      for (int i = 0; i < width; i++) {
+        int index = j * width + i;
+        float x = (i - cx) / fx;
+        float y = (j - cy) / fy;
+        float range = std::sqrt(x * x + y * y + 1);
+        directions_.col(index) << x / range, y / range, 1 / range;
+        ranges_(index) = range;
+      }
+    }
+  }
+
+  const Eigen::Matrix3Xf& directions() const { return directions_; }
+  // distance from the camera center to the z = 1 plane along each ray
+  const Eigen::VectorXf& ranges() const { return ranges_; }
+  int width() const { return width_; }
+  int height() const { return height_; }
+
+ private:
+  float fx_;
+  float fy_;
+  float cx_;
+  float cy_;
+  int width_;
+  int height_;
+  Eigen::Matrix3Xf directions_;
+  Eigen::VectorXf ranges_;
+};
+
+}  // namespace utils
+}  // namespace morefusion_ros
+
+#endif  // ROS_ROS_OBJSLAMPP_YCB_VIDEO_INCLUDE_ROS_OBJSLAMPP_YCB_VIDEO_UTILS_CAMERA_H_
@@ -8,7 +8,7 @@
 namespace morefusion_ros {
 namespace utils {
 
-std_msgs::ColorRGBA colorCategory40(int i) {
+inline std_msgs::ColorRGBA colorCategory40(int i) {
   std_msgs::ColorRGBA c;
   c.a = 1.0;
   switch (i % 40) {
@@ -6,7 +6,7 @@
 namespace morefusion_ros {
 namespace utils {
 
-double class_id_to_voxel_pitch(unsigned class_id) {
+inline double class_id_to_voxel_pitch(unsigned class_id) {
   double pitch;
   switch (class_id) {
   case  1: pitch = 0.006296589104319322; break;
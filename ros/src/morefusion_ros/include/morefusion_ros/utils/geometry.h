@@ -4,22 +4,25 @@
 #define ROS_ROS_OBJSLAMPP_YCB_VIDEO_INCLUDE_ROS_OBJSLAMPP_YCB_VIDEO_UTILS_GEOMETRY_H_
 
 #include <algorithm>
+#include <limits>
 #include <vector>
 #include <map>
 #include <set>
 #include <tuple>
 #include <utility>
 
+#include <Eigen/Core>
 #include <opencv2/opencv.hpp>
 
 #include "morefusion_ros/utils/opencv.h"
+#include "morefusion_ros/utils/openmp.h"
 // #include "morefusion_ros/utils/log.h"
 
 
 namespace morefusion_ros {
 namespace utils {
 
-std::tuple<int, int, int, int> mask_to_bbox(const cv::Mat& mask) {
+inline std::tuple<int, int, int, int> mask_to_bbox(const cv::Mat& mask) {
   int height = mask.rows;
   int width = mask.cols;
   int y1 = height - 1;
@@ -39,27 +42,115 @@ std::tuple<int, int, int, int> mask_to_bbox(const cv::Mat& mask) {
   return std::make_tuple(y1, x1, y2, x2);
 }
 
-bool is_detected_mask_too_small(const cv::Mat& mask2) {
-  std::vector<std::vector<cv::Point> > contours;
-  std::vector<cv::Vec4i> hierarchy;
-  cv::findContours(
-    mask2, contours, hierarchy, CV_RETR_TREE, CV_CHAIN_APPROX_SIMPLE, cv::Point(0, 0));
-  cv::Mat mask2_denoised;
-  mask2.copyTo(mask2_denoised);
-  for (size_t i = 0; i < contours.size(); i++) {
-    if (cv::contourArea(contours[i]) < (20 * 20)) {
-      cv::drawContours(mask2_denoised, contours, i, /*color=*/0, /*thickness=*/cv::FILLED);
+// Points of the lattice origin + i * a + j * b + k * c (0 <= i < nx, ...),
+// ordered as the indices of VoxelGrid (i * ny * nz + j * nz + k).
+inline void sample_lattice(
+    const Eigen::Vector3f& origin,
+    const Eigen::Vector3f& a,
+    const Eigen::Vector3f& b,
+    const Eigen::Vector3f& c,
+    int nx, int ny, int nz,
+    Eigen::Matrix3Xf* points) {
+  points->resize(3, nx * ny * nz);
+  Eigen::Matrix3Xf column_k = c * Eigen::RowVectorXf::LinSpaced(nz, 0, nz - 1);
+  for (int i = 0; i < nx; i++) {
+    for (int j = 0; j < ny; j++) {
+      Eigen::Vector3f origin_ij = origin + i * a + j * b;
+      points->middleCols((i * ny + j) * nz, nz) = column_k.colwise() + origin_ij;
     }
   }
-  std::tuple<int, int, int, int> bbox2 = morefusion_ros::utils::mask_to_bbox(
-    mask2_denoised);
-  int y1 = std::get<0>(bbox2);
-  int x1 = std::get<1>(bbox2);
-  int y2 = std::get<2>(bbox2);
-  int x2 = std::get<3>(bbox2);
+}
+
+// Project an axis-aligned box in world into the image and get the enclosing
+// pixel rectangle. Returns false if the box is outside the view frustum.
+inline bool project_bbox_to_image(
+    const Eigen::Vector3f& bbox_min,
+    const Eigen::Vector3f& bbox_max,
+    const Eigen::Matrix4f& world_to_camera,
+    float fx, float fy, float cx, float cy,
+    int width, int height,
+    cv::Rect* roi) {
+  float u_min = std::numeric_limits<float>::max();
+  float v_min = std::numeric_limits<float>::max();
+  float u_max = -std::numeric_limits<float>::max();
+  float v_max = -std::numeric_limits<float>::max();
+  int n_behind = 0;
+  for (int corner = 0; corner < 8; corner++) {
+    Eigen::Vector4f p_world(
+      (corner & 1) ? bbox_max(0) : bbox_min(0),
+      (corner & 2) ? bbox_max(1) : bbox_min(1),
+      (corner & 4) ? bbox_max(2) : bbox_min(2),
+      1);
+    Eigen::Vector4f p_camera = world_to_camera * p_world;
+    if (p_camera(2) <= 0) {
+      n_behind++;
+      continue;
+    }
+    float u = fx * p_camera(0) / p_camera(2) + cx;
+    float v = fy * p_camera(1) / p_camera(2) + cy;
+    u_min = std::min(u_min, u);
+    v_min = std::min(v_min, v);
+    u_max = std::max(u_max, u);
+    v_max = std::max(v_max, v);
+  }
+  if (n_behind == 8) {
+    return false;
+  }
+  if (n_behind > 0) {
+    // the box crosses the image plane, so its projection is unbounded
+    *roi = cv::Rect(0, 0, width, height);
+    return true;
+  }
+  int x1 = std::max(static_cast<int>(std::floor(u_min)), 0);
+  int y1 = std::max(static_cast<int>(std::floor(v_min)), 0);
+  int x2 = std::min(static_cast<int>(std::ceil(u_max)), width - 1);
+  int y2 = std::min(static_cast<int>(std::ceil(v_max)), height - 1);
+  if (x1 > x2 || y1 > y2) {
+    return false;
+  }
+  *roi = cv::Rect(x1, y1, x2 - x1 + 1, y2 - y1 + 1);
+  return true;
+}
+
+// Buffers of track_instance_id, kept across frames so that tracking does not
+// allocate image-sized masks once the image size is fixed.
+struct TrackInstanceIdWorkspace {
+  TrackInstanceIdWorkspace() : num_pairs(0) {}
+
+  // cells of the contingency table of the last call, a deterministic count of
+  // the per-pair work for benchmarks
+  size_t num_pairs;
+  cv::Mat mask_nonedge;
+  cv::Mat mask_edge;
+  LabelComponents components;
+  cv::Mat boundary;
+  cv::Mat boundary_distance;
+};
+
+// Whether the detection ins_id, without its components smaller than 20x20,
+// is too small to be tracked.
+inline bool is_detected_mask_too_small(const LabelComponents& components, int ins_id) {
+  int height = components.components.rows;
+  int width = components.components.cols;
+  // bbox padded by 1 pixel as mask_to_bbox
+  int y1 = height - 1;
+  int x1 = width - 1;
+  int y2 = 0;
+  int x2 = 0;
+  int mask_size = 0;
+  for (size_t k = 0; k < components.labels.size(); k++) {
+    if ((components.labels[k] != ins_id) || (components.areas[k] < (20 * 20))) {
+      continue;
+    }
+    const cv::Rect& bbox = components.bboxes[k];
+    y1 = std::max(std::min(bbox.y - 1, y1), 0);
+    x1 = std::max(std::min(bbox.x - 1, x1), 0);
+    y2 = std::min(std::max(bbox.y + bbox.height, y2), height - 1);
+    x2 = std::min(std::max(bbox.x + bbox.width, x2), width - 1);
+    mask_size += components.areas[k];
+  }
   int bbox_height = y2 - y1;
   int bbox_width = x2 - x1;
-  int mask_size = cv::countNonZero(mask2_denoised);
   int bbox_size = bbox_height * bbox_width;
   float mask_ratio_in_bbox = static_cast<float>(mask_size) / static_cast<float>(bbox_size);
 
@@ -76,79 +167,217 @@ bool is_detected_mask_too_small(const cv::Mat& mask2) {
   return false;
 }
 
-void track_instance_id(
+// Set -2 to the components smaller than 20x20 and those of ins_ids_erased, and
+// within 5 pixels of the boundaries of the other components (as drawing their
+// contours with thickness 10), from one distance transform of all boundaries.
+inline void suppress_label_boundaries(
+    cv::Mat* label_ins,
+    const LabelComponents& components,
+    const std::set<int>& ins_ids_erased,
+    TrackInstanceIdWorkspace* workspace) {
+  const int height = label_ins->rows;
+  const int width = label_ins->cols;
+  const cv::Mat& comp = components.components;
+
+  std::vector<uint8_t> erased(components.labels.size());
+  for (size_t k = 0; k < components.labels.size(); k++) {
+    erased[k] = (components.areas[k] < (20 * 20)) ||
+                (ins_ids_erased.find(components.labels[k]) != ins_ids_erased.end());
+  }
+
+  // 0 on the boundary pixels of the kept components
+  cv::Mat& boundary = workspace->boundary;
+  boundary.create(height, width, CV_8UC1);
+  #pragma omp parallel for
+  for (int j = 0; j < height; j++) {
+    const int* row = label_ins->ptr<int>(j);
+    const int* row_up = label_ins->ptr<int>(std::max(j - 1, 0));
+    const int* row_down = label_ins->ptr<int>(std::min(j + 1, height - 1));
+    const int* row_comp = comp.ptr<int>(j);
+    uint8_t* row_boundary = boundary.ptr<uint8_t>(j);
+    for (int i = 0; i < width; i++) {
+      int k = row_comp[i];
+      bool is_boundary = false;
+      if ((k >= 0) && !erased[k]) {
+        int label = row[i];
+        is_boundary = (i == 0) || (j == 0) || (i == width - 1) || (j == height - 1) ||
+                      (row[i - 1] != label) || (row[i + 1] != label) ||
+                      (row_up[i] != label) || (row_down[i] != label);
+      }
+      row_boundary[i] = is_boundary ? 0 : 255;
+    }
+  }
+  cv::Mat& distance = workspace->boundary_distance;
+  cv::distanceTransform(boundary, distance, cv::DIST_L2, cv::DIST_MASK_5);
+
+  #pragma omp parallel for
+  for (int j = 0; j < height; j++) {
+    int* row = label_ins->ptr<int>(j);
+    const int* row_comp = comp.ptr<int>(j);
+    const float* row_distance = distance.ptr<float>(j);
+    for (int i = 0; i < width; i++) {
+      int k = row_comp[i];
+      if (((k >= 0) && erased[k]) || (row_distance[i] < 5)) {
+        row[i] = -2;
+      }
+    }
+  }
+}
+
+inline void track_instance_id(
     cv::Mat& reference,
     cv::Mat* target,
     std::map<int, unsigned>* instance_id_to_class_id,
-    unsigned* instance_counter) {
-  std::set<int> instance_ids1 = morefusion_ros::utils::unique<int>(reference);
-  std::set<int> instance_ids2 = morefusion_ros::utils::unique<int>(*target);
+    unsigned* instance_counter,
+    TrackInstanceIdWorkspace* workspace = NULL) {
+  TrackInstanceIdWorkspace workspace_local;
+  if (workspace == NULL) {
+    workspace = &workspace_local;
+  }
+  LabelComponents& components = workspace->components;
+
+  std::vector<int> instance_ids1;
+  std::vector<int> instance_ids2;
+  std::vector<int> instance_areas;
+  morefusion_ros::utils::unique_counts(reference, &instance_ids1, &instance_areas);
+  morefusion_ros::utils::unique_counts(*target, &instance_ids2, &instance_areas);
 
-  cv::Mat mask_nonedge = cv::Mat::zeros(reference.rows, reference.cols, CV_8UC1);
+  cv::Mat& mask_nonedge = workspace->mask_nonedge;
+  mask_nonedge.create(reference.rows, reference.cols, CV_8UC1);
+  mask_nonedge.setTo(0);
   cv::rectangle(
     mask_nonedge,
     cv::Point(reference.cols * 0.1, reference.rows * 0.1),
     cv::Point(reference.cols * 0.9, reference.rows * 0.9),
     /*color=*/255,
     /*thickness=*/cv::FILLED);
-  cv::Mat mask_edge;
+  cv::Mat& mask_edge = workspace->mask_edge;
   cv::bitwise_not(mask_nonedge, mask_edge);
 
+  // Contingency table of the labels in reference (ins_id1 >= 0) and target
+  // (ins_id2 >= 0): intersection counts, areas and areas on the image edge,
+  // accumulated in one pass over both images.
+  std::vector<int> ins_ids1_valid;
+  std::vector<int> ins_ids2_valid;
+  for (int ins_id1 : instance_ids1) {
+    if (ins_id1 >= 0) {
+      ins_ids1_valid.push_back(ins_id1);
+    }
+  }
+  for (int ins_id2 : instance_ids2) {
+    if (ins_id2 >= 0) {
+      ins_ids2_valid.push_back(ins_id2);
+    }
+  }
+  LabelIndex index1(ins_ids1_valid);
+  LabelIndex index2(ins_ids2_valid);
+  const size_t n1 = index1.size();
+  const size_t n2 = index2.size();
+  workspace->num_pairs = n1 * n2;
+
+  struct LabelCounts {
+    LabelCounts() : ran(false) {}
+
+    bool ran;  // false if the team had fewer threads than omp_max_threads()
+    std::vector<int> intersection;  // n1 x n2
+    std::vector<int> area1;
+    std::vector<int> area1_edge;
+    std::vector<int> area2;
+    std::vector<int> area2_edge;
+  };
+  int num_threads = morefusion_ros::utils::omp_max_threads();
+  std::vector<LabelCounts> counts_local(num_threads);
+  #pragma omp parallel
+  {
+    LabelCounts& counts = counts_local[morefusion_ros::utils::omp_thread_num()];
+    counts.ran = true;
+    counts.intersection.assign(n1 * n2, 0);
+    counts.area1.assign(n1, 0);
+    counts.area1_edge.assign(n1, 0);
+    counts.area2.assign(n2, 0);
+    counts.area2_edge.assign(n2, 0);
+    #pragma omp for
+    for (int j = 0; j < reference.rows; j++) {
+      const int* row1 = reference.ptr<int>(j);
+      const int* row2 = target->ptr<int>(j);
+      const uint8_t* row_edge = mask_edge.ptr<uint8_t>(j);
+      for (int i = 0; i < reference.cols; i++) {
+        int k1 = index1(row1[i]);
+        int k2 = index2(row2[i]);
+        int is_edge = row_edge[i] != 0;
+        if (k1 >= 0) {
+          counts.area1[k1]++;
+          counts.area1_edge[k1] += is_edge;
+        }
+        if (k2 >= 0) {
+          counts.area2[k2]++;
+          counts.area2_edge[k2] += is_edge;
+          if (k1 >= 0) {
+            counts.intersection[k1 * n2 + k2]++;
+          }
+        }
+      }
+    }
+  }
+  LabelCounts& counts = counts_local[0];
+  for (int thread_id = 1; thread_id < num_threads; thread_id++) {
+    const LabelCounts& counts_thread = counts_local[thread_id];
+    if (!counts_thread.ran) {
+      continue;
+    }
+    for (size_t k = 0; k < n1 * n2; k++) {
+      counts.intersection[k] += counts_thread.intersection[k];
+    }
+    for (size_t k1 = 0; k1 < n1; k1++) {
+      counts.area1[k1] += counts_thread.area1[k1];
+      counts.area1_edge[k1] += counts_thread.area1_edge[k1];
+    }
+    for (size_t k2 = 0; k2 < n2; k2++) {
+      counts.area2[k2] += counts_thread.area2[k2];
+      counts.area2_edge[k2] += counts_thread.area2_edge[k2];
+    }
+  }
+
+  // Components of the detections before the relabeling
+  morefusion_ros::utils::label_components(*target, &components);
+
   // Compute IOU
   std::map<int, std::tuple<int, float, float> > ins_id2to1;  // ins_id1, iou, coverage
   std::set<int> ins_ids1_suspicious;
   std::set<int> ins_ids2_suspicious;
-  for (int ins_id2 : instance_ids2) {
+  for (size_t k2 = 0; k2 < n2; k2++) {
     // ins_id2: instance_id in the mask-rcnn output
-    if (ins_id2 < 0) {
-      continue;
-    }
+    int ins_id2 = index2.label(k2);
 
-    cv::Mat mask2 = (*target) == ins_id2;
     ins_id2to1.insert(std::make_pair(ins_id2, std::make_tuple(-1, 0, 0)));
 
-    if (morefusion_ros::utils::is_detected_mask_too_small(mask2)) {
+    if (morefusion_ros::utils::is_detected_mask_too_small(components, ins_id2)) {
       ins_ids2_suspicious.insert(ins_id2);
     }
 
-    {
-      // Check if mask2 is not on the edge of the image
-      cv::Mat mask_intersect_edge, mask_intersect_nonedge;
-      cv::bitwise_and(mask_edge, mask2, mask_intersect_edge);
-      cv::bitwise_and(mask_nonedge, mask2, mask_intersect_nonedge);
-      if (cv::countNonZero(mask_intersect_edge) > cv::countNonZero(mask_intersect_nonedge)) {
-        ins_ids2_suspicious.insert(ins_id2);
-      }
+    // Check if mask2 is not on the edge of the image
+    if (counts.area2_edge[k2] > counts.area2[k2] - counts.area2_edge[k2]) {
+      ins_ids2_suspicious.insert(ins_id2);
     }
 
-    for (int ins_id1 : instance_ids1) {
+    for (size_t k1 = 0; k1 < n1; k1++) {
       // ins_id1: instance_id in the map
-      if (ins_id1 < 0) {
-        continue;
-      }
+      int ins_id1 = index1.label(k1);
 
-      cv::Mat mask1 = reference == ins_id1;
-
-      {
-        // Check if mask1 is not on the edge of the image
-        cv::Mat mask_intersect_edge, mask_intersect_nonedge;
-        cv::bitwise_and(mask_edge, mask1, mask_intersect_edge);
-        cv::bitwise_and(mask_nonedge, mask1, mask_intersect_nonedge);
-        if (cv::countNonZero(mask_intersect_edge) > cv::countNonZero(mask_intersect_nonedge)) {
-          ins_ids1_suspicious.insert(ins_id1);
-        }
+      // Check if mask1 is not on the edge of the image
+      if (counts.area1_edge[k1] > counts.area1[k1] - counts.area1_edge[k1]) {
+        ins_ids1_suspicious.insert(ins_id1);
       }
 
       // IOU between mask1 (from map) and mask2 (from detection)
-      cv::Mat mask_intersection, mask_union;
-      cv::bitwise_and(mask1, mask2, mask_intersection);
-      cv::bitwise_or(mask1, mask2, mask_union);
+      int count_intersection = counts.intersection[k1 * n2 + k2];
+      int count_union = counts.area1[k1] + counts.area2[k2] - count_intersection;
       float iou =
-        static_cast<float>(cv::countNonZero(mask_intersection)) /
-        static_cast<float>(cv::countNonZero(mask_union));
+        static_cast<float>(count_intersection) /
+        static_cast<float>(count_union);
       float coverage =
-        static_cast<float>(cv::countNonZero(mask_intersection)) /
-        static_cast<float>(cv::countNonZero(mask1));
+        static_cast<float>(count_intersection) /
+        static_cast<float>(counts.area1[k1]);
       auto it2 = ins_id2to1.find(ins_id2);
       if (iou > std::get<1>(it2->second)) {
         it2->second = std::make_tuple(ins_id1, iou, coverage);
@@ -192,92 +421,75 @@ void track_instance_id(
     instance_id_to_class_id->insert(std::make_pair(it->first, it->second));
   }
 
-  for (size_t j = 0; j < target->rows; j++) {
-    for (size_t i = 0; i < target->cols; i++) {
-      int ins_id2 = target->at<int>(j, i);
+  // Relabel target through a table over the detections: ins_id1, or -2 if suspicious.
+  // Labels < 0 become -2 on the image edge. This pass is not fused with the
+  // merge below: the components and boundaries of target are suppressed in
+  // between, and they depend on the relabeled ids, as detections relabeled to
+  // the same instance join into one component.
+  std::vector<int> ins_id2_to_label(n2);
+  for (size_t k2 = 0; k2 < n2; k2++) {
+    int ins_id2 = index2.label(k2);
+    if (ins_ids2_suspicious.find(ins_id2) != ins_ids2_suspicious.end()) {
+      ins_id2_to_label[k2] = -2;
+    } else {
+      ins_id2_to_label[k2] = std::get<0>(ins_id2to1.find(ins_id2)->second);
+    }
+  }
+  #pragma omp parallel for
+  for (int j = 0; j < target->rows; j++) {
+    int* row = target->ptr<int>(j);
+    const uint8_t* row_edge = mask_edge.ptr<uint8_t>(j);
+    for (int i = 0; i < target->cols; i++) {
+      int ins_id2 = row[i];
       if (ins_id2 < 0) {
-        if (mask_edge.at<uint8_t>(j, i) != 0) {
-          target->at<int>(j, i) = -2;
+        if (row_edge[i] != 0) {
+          row[i] = -2;
         }
         continue;
       }
-      if (ins_ids2_suspicious.find(ins_id2) != ins_ids2_suspicious.end()) {
-        target->at<int>(j, i) = -2;
-        continue;
-      }
-      auto it2 = ins_id2to1.find(ins_id2);
-      assert(it2 != ins_id2to1.end());
-      int ins_id1 = std::get<0>(it2->second);
-      if (ins_id1 != ins_id2) {
-        target->at<int>(j, i) = ins_id1;
-      }
+      int k2 = index2(ins_id2);
+      assert(k2 >= 0);
+      row[i] = ins_id2_to_label[k2];
     }
   }
 
   // Manipulate target
-  std::set<int> instance_ids_active = morefusion_ros::utils::unique<int>(*target);
-  for (int ins_id : instance_ids_active) {
-    if (ins_id < 0) {
-      continue;
-    }
-    cv::Mat mask = (*target) == ins_id;
-    std::vector<std::vector<cv::Point> > contours;
-    std::vector<cv::Vec4i> hierarchy;
-    cv::findContours(
-      mask, contours, hierarchy, CV_RETR_TREE, CV_CHAIN_APPROX_SIMPLE, cv::Point(0, 0));
-    for (size_t j = 0; j < contours.size(); j++) {
-      if (cv::contourArea(contours[j]) < (20 * 20)) {
-        cv::drawContours(*target, contours, j, /*color=*/-2, /*thickness=*/cv::FILLED);
-      } else {
-        cv::drawContours(*target, contours, j, /*color=*/-2, /*thickness=*/10);
+  morefusion_ros::utils::label_components(*target, &components);
+  morefusion_ros::utils::suppress_label_boundaries(target, components, std::set<int>(), workspace);
+
+  // Manipulate reference: remove suspicious instances and boundary
+  morefusion_ros::utils::label_components(reference, &components);
+  morefusion_ros::utils::suppress_label_boundaries(
+    &reference, components, ins_ids1_suspicious, workspace);
+
+  // Merge target and reference for pose estimation: an instance in both comes
+  // from target, one only in reference from reference, and the larger
+  // instance_id wins where they overlap.
+  std::vector<int> instance_ids_target;
+  std::vector<int> instance_ids_reference;
+  std::vector<int> instance_areas_merged;
+  morefusion_ros::utils::unique_counts(*target, &instance_ids_target, &instance_areas_merged);
+  morefusion_ros::utils::unique_counts(
+    reference, &instance_ids_reference, &instance_areas_merged);
+  LabelIndex index_target(instance_ids_target);
+  LabelIndex index_reference(instance_ids_reference);
+  #pragma omp parallel for
+  for (int j = 0; j < reference.rows; j++) {
+    const int* row_target = target->ptr<int>(j);
+    int* row_reference = reference.ptr<int>(j);
+    for (int i = 0; i < reference.cols; i++) {
+      int ins_id_target = row_target[i];
+      int ins_id_reference = row_reference[i];
+      int ins_id = -2;
+      if ((ins_id_target >= 0) && (index_reference(ins_id_target) >= 0)) {
+        ins_id = ins_id_target;
       }
-    }
-  }
-
-  // Manipulate reference
-  for (int ins_id : morefusion_ros::utils::unique<int>(reference)) {
-     if (ins_id < 0) {
-       continue;
-     }
-
-    cv::Mat mask = reference == ins_id;
-
-    if (ins_ids1_suspicious.find(ins_id) != ins_ids1_suspicious.end()) {
-      reference.setTo(-2, mask);
-      continue;
-    }
-
-    // Remove boundary
-    std::vector<std::vector<cv::Point> > contours;
-    std::vector<cv::Vec4i> hierarchy;
-    cv::findContours(
-      mask, contours, hierarchy, CV_RETR_TREE, CV_CHAIN_APPROX_SIMPLE, cv::Point(0, 0));
-    for (size_t j = 0; j < contours.size(); j++) {
-      if (cv::contourArea(contours[j]) < (20 * 20)) {
-        cv::drawContours(reference, contours, j, /*color=*/-2, /*thickness=*/cv::FILLED);
-      } else {
-        cv::drawContours(reference, contours, j, /*color=*/-2, /*thickness=*/10);
+      if ((ins_id_reference >= 0) && (index_target(ins_id_reference) < 0)) {
+        ins_id = std::max(ins_id, ins_id_reference);
       }
+      row_reference[i] = ins_id;
     }
   }
-
-  // Merge target and reference for pose estimation
-  instance_ids1 = morefusion_ros::utils::unique<int>(*target);
-  cv::Mat merged(reference.size(), CV_32SC1, -2);
-  for (int ins_id2 : morefusion_ros::utils::unique<int>(reference)) {
-    if (ins_id2 < 0) {
-      continue;
-    }
-
-    cv::Mat mask;
-    if (instance_ids1.find(ins_id2) != instance_ids1.end()) {
-      mask = *target == ins_id2;
-    } else {
-      mask = reference == ins_id2;
-    }
-    merged.setTo(ins_id2, mask);
-  }
-  merged.copyTo(reference);
 }
 
 }  // namespace utils
@@ -0,0 +1,199 @@
+// Copyright (c) 2019 Kentaro Wada
+
+#ifndef ROS_ROS_OBJSLAMPP_YCB_VIDEO_INCLUDE_ROS_OBJSLAMPP_YCB_VIDEO_UTILS_OCTOMAP_H_
+#define ROS_ROS_OBJSLAMPP_YCB_VIDEO_INCLUDE_ROS_OBJSLAMPP_YCB_VIDEO_UTILS_OCTOMAP_H_
+
+#include <algorithm>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <Eigen/Core>
+#include <octomap/octomap.h>
+#include <octomap/OcTreeKey.h>
+
+namespace morefusion_ros {
+namespace utils {
+
+// Morton code of a key, whose 3 bits from the top are the child index at each depth.
+inline uint64_t key_to_morton(const octomap::OcTreeKey& key) {
+  uint64_t code = 0;
+  for (int bit = 15; bit >= 0; bit--) {
+    code = (code << 3) |
+           (((key[2] >> bit) & 1) << 2) | (((key[1] >> bit) & 1) << 1) | ((key[0] >> bit) & 1);
+  }
+  return code;
+}
+
+// Same as octree.search(point) for each point (column), but the points are
+// converted to keys first and visited in Morton order, so that each search
+// restarts from the deepest node shared with the previous one.
+inline void search_points(
+    const octomap::OcTree& octree,
+    const Eigen::Matrix3Xf& points,
+    std::vector<const octomap::OcTreeNode*>* nodes) {
+  typedef std::pair<uint64_t, size_t> MortonIndex;
+  std::vector<MortonIndex> order;
+  order.reserve(points.cols());
+  nodes->assign(points.cols(), NULL);
+  for (size_t index = 0; index < static_cast<size_t>(points.cols()); index++) {
+    octomap::OcTreeKey key;
+    octomap::point3d point(points(0, index), points(1, index), points(2, index));
+    if (octree.coordToKeyChecked(point, key)) {
+      order.push_back(std::make_pair(key_to_morton(key), index));
+    }
+  }
+  const octomap::OcTreeNode* root = octree.getRoot();
+  if (root == NULL || order.empty()) {
+    return;
+  }
+  std::sort(order.begin(), order.end());
+
+  const int tree_depth = octree.getTreeDepth();
+  std::vector<const octomap::OcTreeNode*> path(tree_depth + 1);
+  path[0] = root;
+  int depth_reached = 0;  // path[0..depth_reached] is valid for the previous code
+  const octomap::OcTreeNode* node = NULL;
+  uint64_t code_prev = 0;
+  for (size_t n = 0; n < order.size(); n++) {
+    uint64_t code = order[n].first;
+    int depth = 0;
+    if (n > 0) {
+      // number of leading child indices shared with the previous code
+      int depth_shared = tree_depth;
+      uint64_t diff = code ^ code_prev;
+      if (diff != 0) {
+        int bit_highest = 63;
+        while (((diff >> bit_highest) & 1) == 0) {
+          bit_highest--;
+        }
+        depth_shared = tree_depth - 1 - bit_highest / 3;
+      }
+      if (depth_reached < tree_depth && depth_shared > depth_reached) {
+        // the previous search stopped at a node shared by this code
+        (*nodes)[order[n].second] = node;
+        code_prev = code;
+        continue;
+      }
+      depth = std::min(depth_shared, depth_reached);
+    }
+    node = NULL;
+    for (; depth < tree_depth; depth++) {
+      unsigned pos = (code >> (3 * (tree_depth - 1 - depth))) & 7;
+      if (octree.nodeChildExists(path[depth], pos)) {
+        path[depth + 1] = octree.getNodeChild(path[depth], pos);
+      } else {
+        if (!octree.nodeHasChildren(path[depth])) {
+          node = path[depth];
+        }
+        break;
+      }
+    }
+    depth_reached = depth;
+    if (depth == tree_depth) {
+      node = path[tree_depth];
+    }
+    (*nodes)[order[n].second] = node;
+    code_prev = code;
+  }
+}
+
+// Occupancy of all the instance octrees, hashed by voxel key. Octrees with the
+// same resolution share keys, so finding every instance at a coordinate takes
+// one lookup per distinct resolution instead of one search per octree.
+// The index does not refer to the octrees after update(), so it can be copied
+// into a map snapshot.
+class InstanceVoxelIndex {
+ public:
+  struct Entry {
+    int instance_id;
+    double occupancy;
+  };
+
+  void clear() {
+    groups_.clear();
+  }
+
+  // Record the occupancy of the instance at the key of its octree,
+  // e.g., the value of the node returned by updateNode().
+  void update(
+      int instance_id,
+      const octomap::OcTree& octree,
+      const octomap::OcTreeKey& key,
+      double occupancy) {
+    std::vector<Entry>& entries = getGroup(octree).cells[key];
+    std::vector<Entry>::iterator it = std::lower_bound(
+      entries.begin(), entries.end(), instance_id,
+      [](const Entry& entry, int id) { return entry.instance_id < id; });
+    if (it != entries.end() && it->instance_id == instance_id) {
+      it->occupancy = occupancy;
+    } else {
+      entries.insert(it, Entry{instance_id, occupancy});
+    }
+  }
+
+  // Get the instances that have a node at the coordinate, sorted by instance id
+  // as in an iteration over std::map<int, OcTree*>.
+  void search(const octomap::point3d& point, std::vector<Entry>* entries) const {
+    entries->clear();
+    for (const Group& group : groups_) {
+      octomap::OcTreeKey key;
+      if (!group.keys->coordToKeyChecked(point, key)) {
+        continue;
+      }
+      auto it = group.cells.find(key);
+      if (it != group.cells.end()) {
+        entries->insert(entries->end(), it->second.begin(), it->second.end());
+      }
+    }
+    if (groups_.size() > 1) {
+      std::sort(
+        entries->begin(), entries->end(),
+        [](const Entry& a, const Entry& b) { return a.instance_id < b.instance_id; });
+    }
+  }
+
+  void search(double x, double y, double z, std::vector<Entry>* entries) const {
+    search(octomap::point3d(x, y, z), entries);
+  }
+
+  // If an instance occupies the coordinate, e.g., a voxel of the background
+  // that publishAll hides. entries is a buffer for the search.
+  bool isOccupied(double x, double y, double z, std::vector<Entry>* entries) const {
+    search(x, y, z, entries);
+    for (const Entry& entry : *entries) {
+      if (entry.occupancy > 0.5) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+ private:
+  struct Group {
+    double resolution;
+    // empty octree with the resolution, to compute keys
+    std::shared_ptr<const octomap::OcTree> keys;
+    std::unordered_map<octomap::OcTreeKey, std::vector<Entry>, octomap::OcTreeKey::KeyHash> cells;
+  };
+
+  Group& getGroup(const octomap::OcTree& octree) {
+    for (Group& group : groups_) {
+      if (group.resolution == octree.getResolution()) {
+        return group;
+      }
+    }
+    groups_.push_back(Group());
+    groups_.back().resolution = octree.getResolution();
+    groups_.back().keys = std::make_shared<octomap::OcTree>(octree.getResolution());
+    return groups_.back();
+  }
+
+  std::vector<Group> groups_;
+};
+
+}  // namespace utils
+}  // namespace morefusion_ros
+
+#endif  // ROS_ROS_OBJSLAMPP_YCB_VIDEO_INCLUDE_ROS_OBJSLAMPP_YCB_VIDEO_UTILS_OCTOMAP_H_
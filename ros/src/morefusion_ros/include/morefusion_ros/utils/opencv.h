@@ -3,11 +3,16 @@
 #ifndef ROS_ROS_OBJSLAMPP_YCB_VIDEO_INCLUDE_ROS_OBJSLAMPP_YCB_VIDEO_UTILS_OPENCV_H_
 #define ROS_ROS_OBJSLAMPP_YCB_VIDEO_INCLUDE_ROS_OBJSLAMPP_YCB_VIDEO_UTILS_OPENCV_H_
 
+#include <algorithm>
+#include <limits>
 #include <set>
+#include <utility>
 #include <vector>
 
 #include <opencv2/opencv.hpp>
 
+#include "morefusion_ros/utils/openmp.h"
+
 namespace morefusion_ros {
 namespace utils {
 
@@ -25,6 +30,261 @@ std::set<T> unique(const cv::Mat& input) {
   return out;
 }
 
+// Sorted labels of a CV_32SC1 image and their pixel counts, in row-parallel
+// passes. Pixels are counted in a histogram over [min, max] when the range is
+// small, and as sorted runs of each thread's rows otherwise.
+inline void unique_counts(
+    const cv::Mat& input,
+    std::vector<int>* labels,
+    std::vector<int>* counts) {
+  labels->clear();
+  counts->clear();
+  if (input.empty()) {
+    return;
+  }
+
+  int num_threads = morefusion_ros::utils::omp_max_threads();
+  std::vector<int> mins(num_threads, std::numeric_limits<int>::max());
+  std::vector<int> maxs(num_threads, std::numeric_limits<int>::min());
+  #pragma omp parallel
+  {
+    int thread_id = morefusion_ros::utils::omp_thread_num();
+    int value_min = std::numeric_limits<int>::max();
+    int value_max = std::numeric_limits<int>::min();
+    #pragma omp for
+    for (int j = 0; j < input.rows; j++) {
+      const int* row = input.ptr<int>(j);
+      for (int i = 0; i < input.cols; i++) {
+        value_min = std::min(value_min, row[i]);
+        value_max = std::max(value_max, row[i]);
+      }
+    }
+    mins[thread_id] = value_min;
+    maxs[thread_id] = value_max;
+  }
+  int value_min = *std::min_element(mins.begin(), mins.end());
+  int value_max = *std::max_element(maxs.begin(), maxs.end());
+  int64_t range = static_cast<int64_t>(value_max) - value_min + 1;
+
+  if (range <= (1 << 16)) {
+    std::vector<std::vector<int> > histograms(num_threads);
+    #pragma omp parallel
+    {
+      std::vector<int>& histogram = histograms[morefusion_ros::utils::omp_thread_num()];
+      histogram.assign(range, 0);
+      #pragma omp for
+      for (int j = 0; j < input.rows; j++) {
+        const int* row = input.ptr<int>(j);
+        for (int i = 0; i < input.cols; i++) {
+          histogram[row[i] - value_min]++;
+        }
+      }
+    }
+    for (int64_t offset = 0; offset < range; offset++) {
+      int count = 0;
+      for (const std::vector<int>& histogram : histograms) {
+        if (!histogram.empty()) {
+          count += histogram[offset];
+        }
+      }
+      if (count > 0) {
+        labels->push_back(value_min + offset);
+        counts->push_back(count);
+      }
+    }
+    return;
+  }
+
+  typedef std::pair<int, int> LabelCount;
+  std::vector<std::vector<LabelCount> > runs_local(num_threads);
+  #pragma omp parallel
+  {
+    std::vector<LabelCount>& runs = runs_local[morefusion_ros::utils::omp_thread_num()];
+    std::vector<int> values;
+    #pragma omp for
+    for (int j = 0; j < input.rows; j++) {
+      const int* row = input.ptr<int>(j);
+      values.insert(values.end(), row, row + input.cols);
+    }
+    std::sort(values.begin(), values.end());
+    for (size_t k = 0; k < values.size(); k++) {
+      if (runs.empty() || runs.back().first != values[k]) {
+        runs.push_back(std::make_pair(values[k], 0));
+      }
+      runs.back().second++;
+    }
+  }
+  std::vector<LabelCount> runs;
+  for (const std::vector<LabelCount>& runs_thread : runs_local) {
+    runs.insert(runs.end(), runs_thread.begin(), runs_thread.end());
+  }
+  std::sort(runs.begin(), runs.end());
+  for (const LabelCount& run : runs) {
+    if (labels->empty() || labels->back() != run.first) {
+      labels->push_back(run.first);
+      counts->push_back(0);
+    }
+    counts->back() += run.second;
+  }
+}
+
+// unique() of int labels (CV_32SC1) through unique_counts()
+template<>
+inline std::set<int> unique<int>(const cv::Mat& input) {
+  std::vector<int> labels;
+  std::vector<int> counts;
+  unique_counts(input, &labels, &counts);
+  return std::set<int>(labels.begin(), labels.end());
+}
+
+// Dense index (0, 1, ...) of a sorted set of labels, -1 for any other label.
+// Lookups go through a table over [min, max], or a binary search if the range
+// is much larger than the number of labels.
+class LabelIndex {
+ public:
+  explicit LabelIndex(const std::vector<int>& labels) : labels_(labels), min_(0) {
+    if (labels_.empty()) {
+      return;
+    }
+    min_ = labels_.front();
+    int64_t range = static_cast<int64_t>(labels_.back()) - min_ + 1;
+    if (range <= std::max<int64_t>(1 << 16, 4 * labels_.size())) {
+      table_.assign(range, -1);
+      for (size_t k = 0; k < labels_.size(); k++) {
+        table_[labels_[k] - min_] = k;
+      }
+    }
+  }
+
+  int operator()(int label) const {
+    if (!table_.empty()) {
+      int64_t offset = static_cast<int64_t>(label) - min_;
+      if (offset < 0 || offset >= static_cast<int64_t>(table_.size())) {
+        return -1;
+      }
+      return table_[offset];
+    }
+    std::vector<int>::const_iterator it = std::lower_bound(labels_.begin(), labels_.end(), label);
+    if (it == labels_.end() || *it != label) {
+      return -1;
+    }
+    return it - labels_.begin();
+  }
+
+  size_t size() const { return labels_.size(); }
+  int label(size_t k) const { return labels_[k]; }
+
+ private:
+  std::vector<int> labels_;
+  int min_;
+  std::vector<int> table_;
+};
+
+// 8-connected components of equal labels >= 0 in a CV_32SC1 label image.
+struct LabelComponents {
+  cv::Mat components;  // CV_32SC1, index of the component, -1 for labels < 0
+  std::vector<int> labels;
+  std::vector<int> areas;
+  std::vector<cv::Rect> bboxes;
+  std::vector<int> parent;  // union-find forest of the provisional components
+};
+
+inline int find_component_root(std::vector<int>* parent, int c) {
+  while ((*parent)[c] != c) {
+    (*parent)[c] = (*parent)[(*parent)[c]];
+    c = (*parent)[c];
+  }
+  return c;
+}
+
+inline int join_components(std::vector<int>* parent, int c1, int c2) {
+  if (c1 < 0) {
+    return find_component_root(parent, c2);
+  }
+  c1 = find_component_root(parent, c1);
+  c2 = find_component_root(parent, c2);
+  if (c1 < c2) {
+    (*parent)[c2] = c1;
+    return c1;
+  }
+  (*parent)[c1] = c2;
+  return c2;
+}
+
+// Label the components of all labels at once, with their areas and bounding boxes.
+inline void label_components(const cv::Mat& label_ins, LabelComponents* out) {
+  cv::Mat& components = out->components;
+  std::vector<int>& parent = out->parent;
+  components.create(label_ins.size(), CV_32SC1);
+  parent.clear();
+
+  // Provisional components merged with the left and upper neighbors
+  for (int j = 0; j < label_ins.rows; j++) {
+    const int* row = label_ins.ptr<int>(j);
+    const int* row_up = (j > 0) ? label_ins.ptr<int>(j - 1) : NULL;
+    int* comp = components.ptr<int>(j);
+    const int* comp_up = (j > 0) ? components.ptr<int>(j - 1) : NULL;
+    for (int i = 0; i < label_ins.cols; i++) {
+      int label = row[i];
+      if (label < 0) {
+        comp[i] = -1;
+        continue;
+      }
+      int c = -1;
+      if ((i > 0) && (row[i - 1] == label)) {
+        c = join_components(&parent, c, comp[i - 1]);
+      }
+      if (row_up != NULL) {
+        for (int di = -1; di <= 1; di++) {
+          int i_up = i + di;
+          if ((i_up >= 0) && (i_up < label_ins.cols) && (row_up[i_up] == label)) {
+            c = join_components(&parent, c, comp_up[i_up]);
+          }
+        }
+      }
+      if (c < 0) {
+        c = parent.size();
+        parent.push_back(c);
+      }
+      comp[i] = c;
+    }
+  }
+
+  // Dense component indices and their stats
+  std::vector<int> index(parent.size(), -1);
+  std::vector<cv::Point> corners1;
+  std::vector<cv::Point> corners2;
+  out->labels.clear();
+  out->areas.clear();
+  for (int j = 0; j < label_ins.rows; j++) {
+    const int* row = label_ins.ptr<int>(j);
+    int* comp = components.ptr<int>(j);
+    for (int i = 0; i < label_ins.cols; i++) {
+      if (comp[i] < 0) {
+        continue;
+      }
+      int root = find_component_root(&parent, comp[i]);
+      int k = index[root];
+      if (k < 0) {
+        k = index[root] = out->labels.size();
+        out->labels.push_back(row[i]);
+        out->areas.push_back(0);
+        corners1.push_back(cv::Point(i, j));
+        corners2.push_back(cv::Point(i, j));
+      }
+      comp[i] = k;
+      out->areas[k]++;
+      corners1[k].x = std::min(corners1[k].x, i);
+      corners2[k].x = std::max(corners2[k].x, i);
+      corners2[k].y = j;
+    }
+  }
+  out->bboxes.resize(out->labels.size());
+  for (size_t k = 0; k < out->labels.size(); k++) {
+    out->bboxes[k] = cv::Rect(corners1[k], corners2[k] + cv::Point(1, 1));
+  }
+}
+
 }  // namespace utils
 }  // namespace morefusion_ros
 
@@ -0,0 +1,39 @@
+// Copyright (c) 2019 Kentaro Wada
+
+#ifndef ROS_ROS_OBJSLAMPP_YCB_VIDEO_INCLUDE_ROS_OBJSLAMPP_YCB_VIDEO_UTILS_OPENMP_H_
+#define ROS_ROS_OBJSLAMPP_YCB_VIDEO_INCLUDE_ROS_OBJSLAMPP_YCB_VIDEO_UTILS_OPENMP_H_
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+namespace morefusion_ros {
+namespace utils {
+
+// OpenMP is optional in CMakeLists.txt, so fall back to a single thread.
+inline int omp_max_threads() {
+#ifdef _OPENMP
+  return omp_get_max_threads();
+#else
+  return 1;
+#endif
+}
+
+inline void omp_set_max_threads(int num_threads) {
+#ifdef _OPENMP
+  omp_set_num_threads(num_threads);
+#endif
+}
+
+inline int omp_thread_num() {
+#ifdef _OPENMP
+  return omp_get_thread_num();
+#else
+  return 0;
+#endif
+}
+
+}  // namespace utils
+}  // namespace morefusion_ros
+
+#endif  // ROS_ROS_OBJSLAMPP_YCB_VIDEO_INCLUDE_ROS_OBJSLAMPP_YCB_VIDEO_UTILS_OPENMP_H_
@@ -0,0 +1,92 @@
+// Copyright (c) 2019 Kentaro Wada
+
+#ifndef ROS_ROS_OBJSLAMPP_YCB_VIDEO_INCLUDE_ROS_OBJSLAMPP_YCB_VIDEO_UTILS_QUEUE_H_
+#define ROS_ROS_OBJSLAMPP_YCB_VIDEO_INCLUDE_ROS_OBJSLAMPP_YCB_VIDEO_UTILS_QUEUE_H_
+
+#include <algorithm>
+#include <deque>
+
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+
+namespace morefusion_ros {
+namespace utils {
+
+// FIFO handing items from one thread to another, holding at most capacity items.
+// After close(), push() discards items and pop() returns false.
+template <typename T>
+class BoundedQueue {
+ public:
+  explicit BoundedQueue(size_t capacity = 1) : capacity_(capacity), closed_(false) {}
+
+  void setCapacity(size_t capacity) {
+    boost::mutex::scoped_lock lock(mutex_);
+    capacity_ = std::max(capacity, static_cast<size_t>(1));
+  }
+
+  // Push an item, waiting for room if block, otherwise dropping the oldest items.
+  // Returns the number of dropped items.
+  size_t push(const T& item, bool block) {
+    boost::mutex::scoped_lock lock(mutex_);
+    size_t n_dropped = 0;
+    if (block) {
+      while (!closed_ && queue_.size() >= capacity_) {
+        cond_.wait(lock);
+      }
+    } else {
+      while (queue_.size() >= capacity_) {
+        queue_.pop_front();
+        n_dropped++;
+      }
+    }
+    if (!closed_) {
+      queue_.push_back(item);
+      cond_.notify_all();
+    }
+    return n_dropped;
+  }
+
+  // Wait for an item.
+  bool pop(T* item) {
+    boost::mutex::scoped_lock lock(mutex_);
+    while (!closed_ && queue_.empty()) {
+      cond_.wait(lock);
+    }
+    if (closed_) {
+      return false;
+    }
+    *item = queue_.front();
+    queue_.pop_front();
+    cond_.notify_all();
+    return true;
+  }
+
+  void close() {
+    boost::mutex::scoped_lock lock(mutex_);
+    closed_ = true;
+    queue_.clear();
+    cond_.notify_all();
+  }
+
+  size_t size() const {
+    boost::mutex::scoped_lock lock(mutex_);
+    return queue_.size();
+  }
+
+  size_t capacity() const {
+    boost::mutex::scoped_lock lock(mutex_);
+    return capacity_;
+  }
+
+ private:
+  size_t capacity_;
+  bool closed_;
+  std::deque<T> queue_;
+  mutable boost::mutex mutex_;
+  boost::condition_variable cond_;
+};
+
+}  // namespace utils
+}  // namespace morefusion_ros
+
+#endif  // ROS_ROS_OBJSLAMPP_YCB_VIDEO_INCLUDE_ROS_OBJSLAMPP_YCB_VIDEO_UTILS_QUEUE_H_
@@ -0,0 +1,152 @@
+// Copyright (c) 2019 Kentaro Wada
+
+#ifndef ROS_ROS_OBJSLAMPP_YCB_VIDEO_INCLUDE_ROS_OBJSLAMPP_YCB_VIDEO_UTILS_STATS_H_
+#define ROS_ROS_OBJSLAMPP_YCB_VIDEO_INCLUDE_ROS_OBJSLAMPP_YCB_VIDEO_UTILS_STATS_H_
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <boost/thread/mutex.hpp>
+
+namespace morefusion_ros {
+namespace utils {
+
+// Latencies in a log-linear histogram (as HdrHistogram): exact below 32 us,
+// then 32 buckets per power of two (3% precision) up to ~36 min.
+class LatencyHistogram {
+ public:
+  LatencyHistogram() : counts_(kNumBuckets, 0), count_(0), max_(0) {}
+
+  void record(double seconds) {
+    uint64_t value = static_cast<uint64_t>(std::max(seconds, 0.0) * 1e6);
+    if (value > kMaxValue) {
+      value = kMaxValue;
+    }
+    counts_[bucket(value)]++;
+    count_++;
+    max_ = std::max(max_, value);
+  }
+
+  // Upper bound of the bucket of the q-quantile (0 <= q <= 1), in seconds.
+  double percentile(double q) const {
+    if (count_ == 0) {
+      return 0;
+    }
+    uint64_t rank = std::max(static_cast<uint64_t>(std::ceil(q * count_)), uint64_t(1));
+    uint64_t cumsum = 0;
+    for (size_t index = 0; index < counts_.size(); index++) {
+      cumsum += counts_[index];
+      if (cumsum >= rank) {
+        return std::min(bucketMax(index), max_) * 1e-6;
+      }
+    }
+    return max_ * 1e-6;
+  }
+
+  uint64_t count() const { return count_; }
+  double max() const { return max_ * 1e-6; }
+
+ private:
+  static const int kSubBuckets = 32;  // 2 ^ kSubBits
+  static const int kSubBits = 5;
+  static const int kMaxBits = 31;
+  static const int kNumBuckets = kSubBuckets * (kMaxBits - kSubBits + 1);
+  static const uint64_t kMaxValue = (uint64_t(1) << kMaxBits) - 1;
+
+  static size_t bucket(uint64_t value) {
+    if (value < kSubBuckets) {
+      return value;
+    }
+    int exponent = kSubBits;
+    while ((value >> (exponent + 1)) != 0) {
+      exponent++;
+    }
+    int shift = exponent - kSubBits;
+    return kSubBuckets * (shift + 1) + ((value >> shift) - kSubBuckets);
+  }
+
+  static uint64_t bucketMax(size_t index) {
+    if (index < kSubBuckets) {
+      return index;
+    }
+    int shift = index / kSubBuckets - 1;
+    uint64_t sub = index % kSubBuckets + kSubBuckets;
+    return ((sub + 1) << shift) - 1;
+  }
+
+  std::vector<uint64_t> counts_;
+  uint64_t count_;
+  uint64_t max_;
+};
+
+// Stage latencies and per-frame values of a pipeline, written by the stages
+// and taken in windows by the reporter.
+class PipelineStats {
+ public:
+  void record(const std::string& stage, double seconds) {
+    boost::mutex::scoped_lock lock(mutex_);
+    latencies_[stage].record(seconds);
+  }
+
+  // latest value of a per-frame counter
+  void set(const std::string& name, double value) {
+    boost::mutex::scoped_lock lock(mutex_);
+    values_[name] = value;
+  }
+
+  // latest value of a per-frame counter, 0 if it was never set
+  double value(const std::string& name) {
+    boost::mutex::scoped_lock lock(mutex_);
+    std::map<std::string, double>::const_iterator it = values_.find(name);
+    return (it == values_.end()) ? 0 : it->second;
+  }
+
+  // Take the latencies recorded since the last call, and the latest values.
+  void takeWindow(
+      std::map<std::string, LatencyHistogram>* latencies,
+      std::map<std::string, double>* values) {
+    boost::mutex::scoped_lock lock(mutex_);
+    latencies->clear();
+    latencies->swap(latencies_);
+    *values = values_;
+  }
+
+ private:
+  boost::mutex mutex_;
+  std::map<std::string, LatencyHistogram> latencies_;
+  std::map<std::string, double> values_;
+};
+
+// Record the lifetime of the scope as a stage latency. Does nothing, not even
+// reading the clock, if stats is NULL.
+class ScopedTimer {
+ public:
+  ScopedTimer(PipelineStats* stats, const char* stage) : stats_(stats), stage_(stage) {
+    if (stats_ != NULL) {
+      start_ = std::chrono::steady_clock::now();
+    }
+  }
+
+  ~ScopedTimer() {
+    if (stats_ != NULL) {
+      std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start_;
+      stats_->record(stage_, elapsed.count());
+    }
+  }
+
+ private:
+  PipelineStats* stats_;
+  const char* stage_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+}  // namespace utils
+}  // namespace morefusion_ros
+
+#endif  // ROS_ROS_OBJSLAMPP_YCB_VIDEO_INCLUDE_ROS_OBJSLAMPP_YCB_VIDEO_UTILS_STATS_H_
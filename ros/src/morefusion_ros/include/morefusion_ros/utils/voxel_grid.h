@@ -0,0 +1,87 @@
+// Copyright (c) 2019 Kentaro Wada
+
+#ifndef ROS_ROS_OBJSLAMPP_YCB_VIDEO_INCLUDE_ROS_OBJSLAMPP_YCB_VIDEO_UTILS_VOXEL_GRID_H_
+#define ROS_ROS_OBJSLAMPP_YCB_VIDEO_INCLUDE_ROS_OBJSLAMPP_YCB_VIDEO_UTILS_VOXEL_GRID_H_
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include <morefusion_ros/CompactVoxelGrid.h>
+#include <morefusion_ros/VoxelGrid.h>
+
+namespace morefusion_ros {
+namespace utils {
+
+// VoxelGrid -> CompactVoxelGrid (occupancy bitmask + uint8 values).
+// If an index appears more than once (e.g., noentry from several octrees),
+// the maximum value is kept.
+inline void pack_voxel_grid(
+    const morefusion_ros::VoxelGrid& grid,
+    morefusion_ros::CompactVoxelGrid* compact) {
+  compact->origin = grid.origin;
+  compact->pitch = grid.pitch;
+  compact->dims = grid.dims;
+  compact->instance_id = grid.instance_id;
+  compact->class_id = grid.class_id;
+
+  size_t size = grid.dims.x * grid.dims.y * grid.dims.z;
+  std::vector<float> dense(size, -1);
+  for (size_t i = 0; i < grid.indices.size(); i++) {
+    float& value = dense[grid.indices[i]];
+    value = std::max(value, grid.values[i]);
+  }
+
+  compact->occupancy.assign((size + 7) / 8, 0);
+  compact->values.clear();
+  compact->values.reserve(grid.indices.size());
+  for (size_t index = 0; index < size; index++) {
+    if (dense[index] < 0) {
+      continue;
+    }
+    compact->occupancy[index / 8] |= 1 << (index % 8);
+    float value = std::min(std::max(dense[index], 0.0f), 1.0f);
+    compact->values.push_back(static_cast<uint8_t>(std::round(value * 255)));
+  }
+}
+
+// CompactVoxelGrid -> VoxelGrid, false if the sizes of occupancy and values
+// don't match dims (then the grid is left empty)
+inline bool unpack_voxel_grid(
+    const morefusion_ros::CompactVoxelGrid& compact,
+    morefusion_ros::VoxelGrid* grid) {
+  grid->origin = compact.origin;
+  grid->pitch = compact.pitch;
+  grid->dims = compact.dims;
+  grid->instance_id = compact.instance_id;
+  grid->class_id = compact.class_id;
+
+  grid->indices.clear();
+  grid->values.clear();
+  size_t size = static_cast<size_t>(compact.dims.x) * compact.dims.y * compact.dims.z;
+  if (compact.occupancy.size() != (size + 7) / 8) {
+    return false;
+  }
+  grid->indices.reserve(compact.values.size());
+  grid->values.reserve(compact.values.size());
+  for (size_t index = 0; index < size; index++) {
+    if (compact.occupancy[index / 8] & (1 << (index % 8))) {
+      if (grid->values.size() >= compact.values.size()) {
+        break;
+      }
+      grid->indices.push_back(index);
+      grid->values.push_back(compact.values[grid->values.size()] / 255.0f);
+    }
+  }
+  if (grid->values.size() != compact.values.size()) {
+    grid->indices.clear();
+    grid->values.clear();
+    return false;
+  }
+  return true;
+}
+
+}  // namespace utils
+}  // namespace morefusion_ros
+
+#endif  // ROS_ROS_OBJSLAMPP_YCB_VIDEO_INCLUDE_ROS_OBJSLAMPP_YCB_VIDEO_UTILS_VOXEL_GRID_H_
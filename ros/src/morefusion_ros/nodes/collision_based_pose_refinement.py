@@ -9,6 +9,7 @@ import numpy as np
 import morefusion
 
 import message_filters
+from morefusion_ros.msg import CompactVoxelGridArray
 from morefusion_ros.msg import ObjectPoseArray
 from morefusion_ros.msg import VoxelGridArray
 import rospy
@@ -63,12 +64,17 @@ class CollisionBasedPoseRefinement(topic_tools.LazyTransport):
         sub_pose = message_filters.Subscriber(
             "~input/poses", ObjectPoseArray, queue_size=1
         )
+        msg_type = (
+            CompactVoxelGridArray
+            if rospy.get_param("~compact_grids", False)
+            else VoxelGridArray
+        )
         sub_grid = message_filters.Subscriber(
-            "~input/grids", VoxelGridArray, queue_size=1, buff_size=2 ** 24,
+            "~input/grids", msg_type, queue_size=1, buff_size=2 ** 24,
         )
         sub_grid_noentry = message_filters.Subscriber(
             "~input/grids_noentry",
-            VoxelGridArray,
+            msg_type,
             queue_size=1,
             buff_size=2 ** 24,
         )
@@ -84,18 +90,7 @@ class CollisionBasedPoseRefinement(topic_tools.LazyTransport):
 
     @staticmethod
     def _grid_msg_to_matrix(grid):
-        pitch = grid.pitch
-        origin = np.array(
-            [grid.origin.x, grid.origin.y, grid.origin.z], dtype=np.float32,
-        )
-        indices = np.array(grid.indices)
-        k = indices % grid.dims.z
-        j = indices // grid.dims.z % grid.dims.y
-        i = indices // grid.dims.z // grid.dims.y
-        dims = (grid.dims.x, grid.dims.y, grid.dims.z)
-        matrix = np.zeros(dims, dtype=np.float32)
-        matrix[i, j, k] = grid.values
-        return matrix, pitch, origin
+        return morefusion.ros.from_ros_voxel_grid(grid)
 
     def _get_sdf(self, class_id):
         if class_id not in self._sdf:
@@ -14,6 +14,7 @@ import morefusion.contrib.singleview_3d as contrib
 
 import cv_bridge
 import message_filters
+from morefusion_ros.msg import CompactVoxelGridArray
 from morefusion_ros.msg import ObjectClassArray
 from morefusion_ros.msg import ObjectPose
 from morefusion_ros.msg import ObjectPoseArray
@@ -34,6 +35,7 @@ class SingleViewPoseEstimation3D(topic_tools.LazyTransport):
             "~confidence_threshold", 0.9
         )
         self._with_occupancy = rospy.get_param("~with_occupancy")
+        self._compact_grids = rospy.get_param("~compact_grids", False)
         if True:
             pretrained_model = gdown.cached_download(
                 url="https://drive.google.com/uc?id=128okGgKDJ53PlxLXw7t8a3P9iw-5mcSn",  # NOQA
@@ -98,7 +100,11 @@ class SingleViewPoseEstimation3D(topic_tools.LazyTransport):
         ]
         if self._with_occupancy:
             sub_noentry = message_filters.Subscriber(
-                "~input/grids_noentry", VoxelGridArray, queue_size=1,
+                "~input/grids_noentry",
+                CompactVoxelGridArray
+                if self._compact_grids
+                else VoxelGridArray,
+                queue_size=1,
             )
             self._subscribers.append(sub_noentry)
         sync = message_filters.TimeSynchronizer(
@@ -130,20 +136,13 @@ class SingleViewPoseEstimation3D(topic_tools.LazyTransport):
         if noentry_msg:
             for grid in noentry_msg.grids:
                 instance_id = grid.instance_id
-                dims = (grid.dims.x, grid.dims.y, grid.dims.z)
-                indices = np.array(grid.indices)
-                k = indices % grid.dims.z
-                j = indices // grid.dims.z % grid.dims.y
-                i = indices // grid.dims.z // grid.dims.y
-                grid_nontarget_empty = np.zeros(dims, dtype=bool)
-                grid_nontarget_empty[i, j, k] = True
-                origin = np.array(
-                    [grid.origin.x, grid.origin.y, grid.origin.z],
-                    dtype=np.float32,
+                matrix, pitch, origin = morefusion.ros.from_ros_voxel_grid(
+                    grid
                 )
+                grid_nontarget_empty = matrix > 0
                 grids_noentry[instance_id] = dict(
                     origin=origin,
-                    pitch=grid.pitch,
+                    pitch=pitch,
                     matrix=grid_nontarget_empty,
                 )
 
@@ -0,0 +1,351 @@
+// Copyright (c) 2019 Kentaro Wada
+
+#include "morefusion_ros/FrameLog.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstring>
+
+namespace morefusion_ros {
+
+namespace {
+
+const char kMagic[8] = {'M', 'F', 'F', 'R', 'A', 'M', 'E', 'S'};
+const uint32_t kVersion = 2;
+// the version 1 is the same without resets
+const uint32_t kVersionWithoutResets = 1;
+
+struct FileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t header_size;
+  double resolution;
+  double max_range;
+  double probability_hit;
+  double probability_miss;
+  double probability_min;
+  double probability_max;
+  double grid_cache_max_translation;
+  double grid_cache_max_rotation;
+  uint8_t compress_map;
+  uint8_t reserved[7];
+  char render_mode[16];
+};
+
+// followed by the depth, labels (int32), points (float x, y, z) and classes,
+// each padded to 8 bytes, unless it is a reset
+struct RecordHeader {
+  uint64_t size;  // of the record, including this header
+  int64_t stamp;
+  int32_t width;
+  int32_t height;
+  float fx;
+  float fy;
+  float cx;
+  float cy;
+  float depth_unit;
+  int32_t depth_type;  // CV_16UC1, CV_32FC1, or -1 without depth
+  uint32_t num_points;  // width * height, or 0 to back-project the depth
+  uint32_t num_classes;
+  uint8_t ground_as_noentry;
+  uint8_t free_as_noentry;
+  uint8_t is_reset;  // with width, height and num_* of 0, and depth_type of -1
+  uint8_t reserved[5];
+  float sensor_to_world[16];  // row-major
+};
+
+static_assert(sizeof(FileHeader) % 8 == 0, "FileHeader must be 8-byte aligned");
+static_assert(sizeof(RecordHeader) % 8 == 0, "RecordHeader must be 8-byte aligned");
+static_assert(sizeof(FrameLogClass) == 12, "FrameLogClass must not be padded");
+
+size_t padded(size_t size) {
+  return (size + 7) / 8 * 8;
+}
+
+bool isValidDepthType(int32_t depth_type) {
+  return (depth_type == -1) || (depth_type == CV_16UC1) || (depth_type == CV_32FC1);
+}
+
+size_t depthSize(const RecordHeader& record) {
+  if (record.depth_type == -1) {
+    return 0;
+  }
+  return static_cast<size_t>(record.width) * record.height *
+         CV_ELEM_SIZE(record.depth_type);
+}
+
+size_t recordSize(const RecordHeader& record) {
+  size_t num_pixels = static_cast<size_t>(record.width) * record.height;
+  return sizeof(RecordHeader) +
+         padded(depthSize(record)) +
+         padded(num_pixels * sizeof(int32_t)) +
+         padded(static_cast<size_t>(record.num_points) * 3 * sizeof(float)) +
+         padded(static_cast<size_t>(record.num_classes) * sizeof(FrameLogClass));
+}
+
+}  // namespace
+
+bool FrameLogWriter::open(const std::string& path, const MultiInstanceMapping::Params& params) {
+  if (params.render_mode.size() >= sizeof(FileHeader::render_mode)) {
+    return false;
+  }
+  ofs_.open(path.c_str(), std::ios::binary | std::ios::trunc);
+  if (!ofs_) {
+    return false;
+  }
+  FileHeader header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  header.header_size = sizeof(FileHeader);
+  header.resolution = params.resolution;
+  header.max_range = params.max_range;
+  header.probability_hit = params.probability_hit;
+  header.probability_miss = params.probability_miss;
+  header.probability_min = params.probability_min;
+  header.probability_max = params.probability_max;
+  header.grid_cache_max_translation = params.grid_cache_max_translation;
+  header.grid_cache_max_rotation = params.grid_cache_max_rotation;
+  header.compress_map = params.compress_map;
+  std::strncpy(header.render_mode, params.render_mode.c_str(), sizeof(header.render_mode) - 1);
+  ofs_.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  ofs_.flush();
+  return ofs_.good();
+}
+
+bool FrameLogWriter::write(
+    int64_t stamp,
+    const MultiInstanceMapping::SensorFrame& sensor,
+    const cv::Mat& depth,
+    const std::vector<FrameLogClass>& classes,
+    bool ground_as_noentry,
+    bool free_as_noentry) {
+  if (!ofs_.is_open()) {
+    return false;
+  }
+  if ((sensor.label_ins.type() != CV_32SC1) ||
+      (sensor.label_ins.cols != sensor.width) || (sensor.label_ins.rows != sensor.height)) {
+    return false;
+  }
+  if (!depth.empty() &&
+      (((depth.type() != CV_16UC1) && (depth.type() != CV_32FC1)) ||
+       (depth.cols != sensor.width) || (depth.rows != sensor.height))) {
+    return false;
+  }
+  size_t num_points = sensor.pc.points.size();
+  if ((num_points != 0) && (num_points != static_cast<size_t>(sensor.width) * sensor.height)) {
+    return false;
+  }
+
+  RecordHeader record;
+  std::memset(&record, 0, sizeof(record));
+  record.stamp = stamp;
+  record.width = sensor.width;
+  record.height = sensor.height;
+  record.fx = sensor.fx;
+  record.fy = sensor.fy;
+  record.cx = sensor.cx;
+  record.cy = sensor.cy;
+  record.depth_unit = sensor.depth_unit;
+  record.depth_type = depth.empty() ? -1 : depth.type();
+  record.num_points = num_points;
+  record.num_classes = classes.size();
+  record.ground_as_noentry = ground_as_noentry;
+  record.free_as_noentry = free_as_noentry;
+  for (int j = 0; j < 4; j++) {
+    for (int i = 0; i < 4; i++) {
+      record.sensor_to_world[j * 4 + i] = sensor.sensorToWorld(j, i);
+    }
+  }
+  record.size = recordSize(record);
+  ofs_.write(reinterpret_cast<const char*>(&record), sizeof(record));
+
+  if (!depth.empty()) {
+    writeImage(depth);
+  }
+  writeImage(sensor.label_ins);
+
+  points_.resize(num_points * 3);
+  for (size_t i = 0; i < num_points; i++) {
+    const MultiInstanceMapping::PCLPoint& point = sensor.pc.points[i];
+    points_[i * 3] = point.x;
+    points_[i * 3 + 1] = point.y;
+    points_[i * 3 + 2] = point.z;
+  }
+  ofs_.write(reinterpret_cast<const char*>(points_.data()), points_.size() * sizeof(float));
+  writePadding(points_.size() * sizeof(float));
+
+  ofs_.write(reinterpret_cast<const char*>(classes.data()),
+             classes.size() * sizeof(FrameLogClass));
+  writePadding(classes.size() * sizeof(FrameLogClass));
+
+  ofs_.flush();
+  return ofs_.good();
+}
+
+bool FrameLogWriter::writeReset(int64_t stamp) {
+  if (!ofs_.is_open()) {
+    return false;
+  }
+  RecordHeader record;
+  std::memset(&record, 0, sizeof(record));
+  record.stamp = stamp;
+  record.depth_type = -1;
+  record.is_reset = true;
+  record.size = recordSize(record);
+  ofs_.write(reinterpret_cast<const char*>(&record), sizeof(record));
+  ofs_.flush();
+  return ofs_.good();
+}
+
+void FrameLogWriter::writeImage(const cv::Mat& image) {
+  // row by row, as images of messages may have padded rows
+  size_t row_size = image.cols * image.elemSize();
+  for (int j = 0; j < image.rows; j++) {
+    ofs_.write(reinterpret_cast<const char*>(image.ptr(j)), row_size);
+  }
+  writePadding(row_size * image.rows);
+}
+
+void FrameLogWriter::writePadding(size_t size) {
+  const char zeros[8] = {0};
+  ofs_.write(zeros, padded(size) - size);
+}
+
+bool FrameLogReader::open(const std::string& path) {
+  close();
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  if ((fstat(fd, &st) != 0) || (static_cast<size_t>(st.st_size) < sizeof(FileHeader))) {
+    ::close(fd);
+    return false;
+  }
+  void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  // the mapping stays valid after closing the file
+  ::close(fd);
+  if (data == MAP_FAILED) {
+    return false;
+  }
+  data_ = static_cast<const uint8_t*>(data);
+  size_ = st.st_size;
+
+  const FileHeader* header = reinterpret_cast<const FileHeader*>(data_);
+  if ((std::memcmp(header->magic, kMagic, sizeof(kMagic)) != 0) ||
+      ((header->version != kVersion) && (header->version != kVersionWithoutResets)) ||
+      (header->header_size != sizeof(FileHeader))) {
+    close();
+    return false;
+  }
+  params_.resolution = header->resolution;
+  params_.max_range = header->max_range;
+  params_.probability_hit = header->probability_hit;
+  params_.probability_miss = header->probability_miss;
+  params_.probability_min = header->probability_min;
+  params_.probability_max = header->probability_max;
+  params_.grid_cache_max_translation = header->grid_cache_max_translation;
+  params_.grid_cache_max_rotation = header->grid_cache_max_rotation;
+  params_.compress_map = header->compress_map;
+  params_.render_mode = std::string(
+    header->render_mode, strnlen(header->render_mode, sizeof(header->render_mode)));
+
+  size_t offset = sizeof(FileHeader);
+  while (offset + sizeof(RecordHeader) <= size_) {
+    const RecordHeader* record = reinterpret_cast<const RecordHeader*>(data_ + offset);
+    if (!isValidDepthType(record->depth_type)) {
+      close();
+      return false;
+    }
+    bool is_valid_size = record->is_reset ?
+      ((record->width == 0) && (record->height == 0)) :
+      ((record->width > 0) && (record->height > 0));
+    if (!is_valid_size ||
+        (record->size != recordSize(*record)) || (offset + record->size > size_)) {
+      break;
+    }
+    offsets_.push_back(offset);
+    offset += record->size;
+  }
+  is_truncated_ = offset != size_;
+  return true;
+}
+
+void FrameLogReader::close() {
+  if (data_ != NULL) {
+    munmap(const_cast<uint8_t*>(data_), size_);
+  }
+  data_ = NULL;
+  size_ = 0;
+  is_truncated_ = false;
+  offsets_.clear();
+}
+
+void FrameLogReader::read(size_t index, RecordedFrame* frame) const {
+  const uint8_t* data = data_ + offsets_[index];
+  const RecordHeader* record = reinterpret_cast<const RecordHeader*>(data);
+  data += sizeof(RecordHeader);
+
+  frame->stamp = record->stamp;
+  frame->is_reset = record->is_reset;
+  if (frame->is_reset) {
+    return;
+  }
+  for (int j = 0; j < 4; j++) {
+    for (int i = 0; i < 4; i++) {
+      frame->sensorToWorld(j, i) = record->sensor_to_world[j * 4 + i];
+    }
+  }
+  frame->ground_as_noentry = record->ground_as_noentry;
+  frame->free_as_noentry = record->free_as_noentry;
+
+  MultiInstanceMapping::SensorFrame& sensor = frame->sensor;
+  sensor.width = record->width;
+  sensor.height = record->height;
+  sensor.fx = record->fx;
+  sensor.fy = record->fy;
+  sensor.cx = record->cx;
+  sensor.cy = record->cy;
+  sensor.depth_unit = record->depth_unit;
+
+  // the mapping is read-only, and so are the images on it
+  if (record->depth_type == -1) {
+    frame->depth = cv::Mat();
+  } else {
+    frame->depth = cv::Mat(
+      record->height, record->width, record->depth_type, const_cast<uint8_t*>(data));
+  }
+  data += padded(depthSize(*record));
+  sensor.label_ins = cv::Mat(
+    record->height, record->width, CV_32SC1, const_cast<uint8_t*>(data));
+  data += padded(static_cast<size_t>(record->width) * record->height * sizeof(int32_t));
+
+  const float* points = reinterpret_cast<const float*>(data);
+  sensor.pc.points.resize(record->num_points);
+  for (size_t i = 0; i < record->num_points; i++) {
+    MultiInstanceMapping::PCLPoint& point = sensor.pc.points[i];
+    point.x = points[i * 3];
+    point.y = points[i * 3 + 1];
+    point.z = points[i * 3 + 2];
+  }
+  if (record->num_points > 0) {
+    sensor.pc.width = record->width;
+    sensor.pc.height = record->height;
+    sensor.pc.is_dense = false;
+    sensor.depth = cv::Mat();
+  } else {
+    sensor.pc.width = 0;
+    sensor.pc.height = 0;
+    sensor.depth = frame->depth;
+  }
+  data += padded(static_cast<size_t>(record->num_points) * 3 * sizeof(float));
+
+  const FrameLogClass* classes = reinterpret_cast<const FrameLogClass*>(data);
+  frame->classes.assign(classes, classes + record->num_classes);
+}
+
+}  // namespace morefusion_ros
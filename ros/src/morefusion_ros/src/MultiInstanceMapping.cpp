@@ -0,0 +1,841 @@
+// Copyright (c) 2019 Kentaro Wada
+
+#include "morefusion_ros/MultiInstanceMapping.h"
+
+#include <pcl/common/centroid.h>
+#include <pcl/common/common.h>
+
+#include <algorithm>
+#include <iostream>
+#include <limits>
+#include <utility>
+
+#include <Eigen/Geometry>
+
+#include "morefusion_ros/utils/data.h"
+#include "morefusion_ros/utils/openmp.h"
+#include "morefusion_ros/utils/stl.h"
+
+namespace morefusion_ros {
+
+MultiInstanceMapping::MultiInstanceMapping(const Params& params)
+    : params_(params),
+      stats_(NULL),
+      instance_counter_(0),
+      noentry_changed_min_(0, 0, 0),
+      noentry_changed_max_(-1, -1, -1) {
+  if (params_.render_mode != "raycast" && params_.render_mode != "rasterize") {
+    std::cerr << "Unsupported render_mode: " << params_.render_mode
+              << ", falling back to raycast" << std::endl;
+    params_.render_mode = "raycast";
+  }
+}
+
+MultiInstanceMapping::~MultiInstanceMapping() {
+  reset();
+}
+
+void MultiInstanceMapping::reset() {
+  for (std::map<int, OcTreeT*>::iterator it = octrees_.begin(); it != octrees_.end(); it++) {
+    delete it->second;
+  }
+  octrees_.clear();
+  instance_index_.clear();
+  class_ids_.clear();
+  centers_.clear();
+  grids_cache_.clear();
+  instance_ids_updated_.clear();
+  noentry_changed_min_ = octomap::point3d(0, 0, 0);
+  noentry_changed_max_ = octomap::point3d(-1, -1, -1);
+  instance_counter_ = 0;
+}
+
+void MultiInstanceMapping::setNoEntry(bool ground_as_noentry, bool free_as_noentry) {
+  params_.ground_as_noentry = ground_as_noentry;
+  params_.free_as_noentry = free_as_noentry;
+  grids_cache_.clear();
+}
+
+void MultiInstanceMapping::render(const SensorFrame& frame, cv::Mat& label_ins_rend) {
+  // every pixel is written by the renderer
+  label_ins_rend.create(frame.height, frame.width, CV_32SC1);
+  if (params_.render_mode == "rasterize") {
+    renderRasterize(frame, label_ins_rend);
+  } else {
+    renderRaycast(frame, label_ins_rend);
+  }
+}
+
+void MultiInstanceMapping::renderRaycast(const SensorFrame& frame, cv::Mat& label_ins_rend) {
+  const octomap::point3d& sensorOrigin = frame.sensorOrigin;
+  Eigen::Matrix4f worldToSensor = frame.sensorToWorld.inverse();
+  float fx = frame.fx;
+  float fy = frame.fy;
+  float cx = frame.cx;
+  float cy = frame.cy;
+  std::vector<int> instance_ids = morefusion_ros::utils::keys(octrees_);
+  // Each instance writes ray depths into its own buffer covering its ROI,
+  // so that the raycasting threads never touch shared state. The buffers are
+  // kept across frames, so they are only reallocated when an ROI grows.
+  std::vector<cv::Rect> rois(instance_ids.size());
+  std::vector<cv::Mat> depths(instance_ids.size());
+  if (render_depths_instance_.size() < instance_ids.size()) {
+    render_depths_instance_.resize(instance_ids.size());
+  }
+  size_t render_rays = 0;
+  #pragma omp parallel for schedule(dynamic) reduction(+:render_rays)
+  for(int instance_id_index = 0; instance_id_index < instance_ids.size(); instance_id_index++){
+    int instance_id = instance_ids[instance_id_index];
+  ///for each(int instance_id in instance_ids) {
+  ///fonte: https://www.w3schools.com/cpp/cpp_for_loop.asp e https://stackoverflow.com/questions/20531335/compilation-error-with-for-each-loop-in-c-vs2010
+  ///for (int instance_id : instance_ids) {
+    if (instance_id == -1) {
+      // skip background objects
+      continue;
+    }
+    OcTreeT* octree = octrees_.find(instance_id)->second;
+
+    // Only cast rays for pixels inside the projected BBX of the instance,
+    // padded by one voxel as the BBX bounds the points and not the voxels.
+    octomap::point3d bbx_min = octree->getBBXMin();
+    octomap::point3d bbx_max = octree->getBBXMax();
+    float padding = octree->getResolution();
+    cv::Rect roi;
+    if (!morefusion_ros::utils::project_bbox_to_image(
+          Eigen::Vector3f(bbx_min.x(), bbx_min.y(), bbx_min.z()) -
+            Eigen::Vector3f::Constant(padding),
+          Eigen::Vector3f(bbx_max.x(), bbx_max.y(), bbx_max.z()) +
+            Eigen::Vector3f::Constant(padding),
+          worldToSensor, fx, fy, cx, cy, frame.width, frame.height, &roi)) {
+      // out of the view frustum
+      continue;
+    }
+    rois[instance_id_index] = roi;
+    cv::Mat& depth_instance = depths[instance_id_index];
+    std::vector<float>& buffer = render_depths_instance_[instance_id_index];
+    buffer.assign(roi.area(), NAN);
+    depth_instance = cv::Mat(roi.size(), CV_32FC1, buffer.data());
+
+    // rays are cast for every other row and column
+    int height_begin = roi.y + roi.y % 2;
+    int width_begin = roi.x + roi.x % 2;
+    for (int height_index = height_begin; height_index < roi.y + roi.height; height_index += 2) {
+      for (int width_index = width_begin; width_index < roi.x + roi.width; width_index += 2) {
+        size_t index = height_index * frame.width + width_index;
+
+        bool check_in_bbox;
+        octomap::point3d point;
+        if (frame.getPoint(height_index, width_index, &point)) {
+          check_in_bbox = true;
+        } else {
+          // point at max depth (z = 1) along the pixel ray
+          Eigen::Vector3f ray = frame.getRay(index) * frame.camera_rays->ranges()(index);
+
+          check_in_bbox = false;
+          point = sensorOrigin + octomap::point3d(ray(0), ray(1), ray(2));
+        }
+
+        octomap::point3d direction = point - sensorOrigin;
+
+        if (check_in_bbox && !octree->inBBX(point)) {
+          continue;
+        }
+
+        octomap::point3d end;
+        render_rays++;
+        bool hit = octree->castRay(/*origin=*/sensorOrigin, /*direction=*/direction, /*end=*/end, /*ignoreUnknownCells=*/true, /*maxRange=*/(point - sensorOrigin).norm() * 1.1);
+        if (!hit) {
+          continue;
+        }
+
+        octomap::point3d intersection;
+#if 0
+        octree->getRayIntersection(/*origin=*/sensorOrigin, /*direction=*/direction, /*center=*/end, /*intersection=*/intersection);
+#else
+        intersection = end;
+#endif
+
+        depth_instance.at<float>(height_index - roi.y, width_index - roi.x) =
+          (intersection - sensorOrigin).norm();
+      }
+    }
+  }
+
+  if (stats_ != NULL) {
+    stats_->set("render_rays", render_rays);
+  }
+
+  // Merge into the nearest instance per pixel. Visiting instances in id order
+  // keeps the first-nearest winner on ties, so the result does not depend on
+  // the number of threads. Rows of 2x2 label blocks never overlap.
+  cv::Mat& depth = render_depth_;
+  depth.create(frame.height, frame.width, CV_32FC1);
+  depth.setTo(NAN);
+  label_ins_rend.setTo(-2);
+  #pragma omp parallel for
+  for (int height_index = 0; height_index < frame.height; height_index += 2) {
+    for (size_t instance_id_index = 0; instance_id_index < instance_ids.size();
+         instance_id_index++) {
+      const cv::Mat& depth_instance = depths[instance_id_index];
+      if (depth_instance.empty()) {
+        continue;
+      }
+      const cv::Rect& roi = rois[instance_id_index];
+      if (height_index < roi.y || height_index >= roi.y + roi.height) {
+        continue;
+      }
+      int instance_id = instance_ids[instance_id_index];
+      const float* depth_instance_row = depth_instance.ptr<float>(height_index - roi.y);
+      float* depth_row = depth.ptr<float>(height_index);
+      for (int width_index = roi.x + roi.x % 2; width_index < roi.x + roi.width;
+           width_index += 2) {
+        float d_new = depth_instance_row[width_index - roi.x];
+        if (d_new != d_new) {
+          continue;
+        }
+        float d_old = depth_row[width_index];
+        if ((d_old != d_old) || (d_new < d_old)) {
+          depth_row[width_index] = d_new;
+          for (int dj = -1; dj != 1; dj++) {
+            int j = height_index + dj;
+            for (int di = -1; di != 1; di++) {
+              int i = width_index + di;
+              if (j >= 0 && i >= 0 && j < label_ins_rend.rows && i < label_ins_rend.cols) {
+                label_ins_rend.at<int32_t>(j, i) = instance_id;
+              }
+            }
+          }
+        }
+      }
+    }
+  }
+}
+
+void MultiInstanceMapping::renderRasterize(const SensorFrame& frame, cv::Mat& label_ins_rend) {
+  const octomap::point3d& sensorOrigin = frame.sensorOrigin;
+  Eigen::Matrix4f worldToSensor = frame.sensorToWorld.inverse();
+  float fx = frame.fx;
+  float fy = frame.fy;
+  float cx = frame.cx;
+  float cy = frame.cy;
+  int width = frame.width;
+  int height = frame.height;
+
+  cv::Mat& depth = render_depth_;
+  depth.create(height, width, CV_32FC1);
+  depth.setTo(NAN);
+  label_ins_rend.setTo(-2);
+  for (std::map<int, OcTreeT*>::iterator it_octree = octrees_.begin();
+       it_octree != octrees_.end(); it_octree++) {
+    int instance_id = it_octree->first;
+    if (instance_id == -1) {
+      // skip background objects
+      continue;
+    }
+    OcTreeT* octree = it_octree->second;
+
+    for (OcTreeT::leaf_iterator it = octree->begin_leafs(), end = octree->end_leafs();
+         it != end; it++) {
+      if (!octree->isNodeOccupied(*it)) {
+        continue;
+      }
+
+      octomap::point3d center = it.getCoordinate();
+      Eigen::Vector4f center_sensor =
+        worldToSensor * Eigen::Vector4f(center.x(), center.y(), center.z(), 1);
+      float z = center_sensor(2);
+      if (z <= 0) {
+        continue;
+      }
+
+      // pixel footprint of the voxel
+      float u = fx * center_sensor(0) / z + cx;
+      float v = fy * center_sensor(1) / z + cy;
+      float radius_u = 0.5 * it.getSize() * fx / z;
+      float radius_v = 0.5 * it.getSize() * fy / z;
+      int i_min = std::max(static_cast<int>(std::floor(u - radius_u)), 0);
+      int i_max = std::min(static_cast<int>(std::ceil(u + radius_u)), width - 1);
+      int j_min = std::max(static_cast<int>(std::floor(v - radius_v)), 0);
+      int j_max = std::min(static_cast<int>(std::ceil(v + radius_v)), height - 1);
+      if (i_min > i_max || j_min > j_max) {
+        continue;
+      }
+
+      float d_new = (center - sensorOrigin).norm();
+      for (int j = j_min; j <= j_max; j++) {
+        for (int i = i_min; i <= i_max; i++) {
+          // same visibility rules as the rays in render()
+          octomap::point3d point;
+          float d_max;
+          if (frame.getPoint(j, i, &point)) {
+            if (!octree->inBBX(point)) {
+              continue;
+            }
+            d_max = (point - sensorOrigin).norm() * 1.1;
+          } else {
+            d_max = frame.camera_rays->ranges()(j * width + i) * 1.1;  // max depth: 1
+          }
+          if (d_new > d_max) {
+            continue;
+          }
+
+          float& d_old = depth.at<float>(j, i);
+          if ((d_old != d_old) || (d_new < d_old)) {
+            d_old = d_new;
+            label_ins_rend.at<int32_t>(j, i) = instance_id;
+          }
+        }
+      }
+    }
+  }
+}
+
+bool MultiInstanceMapping::integrate(
+    const SensorFrame& frame,
+    cv::Mat& label_ins,
+    std::map<int, unsigned>* instance_id_to_class_id,
+    cv::Mat& label_ins_rend,
+    bool render) {
+  if (render) {
+    morefusion_ros::utils::ScopedTimer timer_render(stats_, "render");
+    this->render(frame, label_ins_rend);
+  }
+  {
+    morefusion_ros::utils::ScopedTimer timer_track(stats_, "track_instance_id");
+    trackInstanceIds(label_ins_rend, &label_ins, instance_id_to_class_id);
+  }
+  {
+    morefusion_ros::utils::ScopedTimer timer_insert(stats_, "insert_scan");
+    if (!insertScan(frame, label_ins, *instance_id_to_class_id)) {
+      return false;
+    }
+  }
+  {
+    morefusion_ros::utils::ScopedTimer timer_grids(stats_, "update_grids");
+    updateGrids(frame.sensorToWorld);
+  }
+  return true;
+}
+
+void MultiInstanceMapping::trackInstanceIds(
+    cv::Mat& label_ins_rend,
+    cv::Mat* label_ins,
+    std::map<int, unsigned>* instance_id_to_class_id) {
+  morefusion_ros::utils::track_instance_id(
+    /*reference=*/label_ins_rend,
+    /*target=*/label_ins,
+    /*instance_id_to_class_id=*/instance_id_to_class_id,
+    /*instance_counter=*/&instance_counter_,
+    /*workspace=*/&track_workspace_);
+  if (stats_ != NULL) {
+    stats_->set("track_pairs", track_workspace_.num_pairs);
+  }
+  for (std::map<int, unsigned>::iterator it = class_ids_.begin();
+       it != class_ids_.end(); it++) {
+    if (instance_id_to_class_id->find(it->first) == instance_id_to_class_id->end()) {
+      instance_id_to_class_id->insert(std::make_pair(it->first, it->second));
+    }
+  }
+}
+
+bool MultiInstanceMapping::insertScan(
+    const SensorFrame& frame,
+    const cv::Mat& label_ins,
+    const std::map<int, unsigned>& instance_id_to_class_id) {
+  const octomap::point3d& sensorOrigin = frame.sensorOrigin;
+
+  std::set<int> instance_ids = morefusion_ros::utils::unique<int>(label_ins);
+  // the background octree carves the free space of every ray, even if no pixel
+  // is labeled as background
+  instance_ids.insert(-1);
+  octomap::KeySet free_cells_bg;
+  std::map<int, octomap::KeySet> occupied_cells;
+  std::set<int> new_instance_ids;
+  for (int instance_id : instance_ids) {
+    if (instance_id == -2) {
+      // -1: background, -2: uncertain (e.g., boundary)
+      continue;
+    }
+    unsigned class_id = 0;
+    double pitch = params_.resolution;
+    if (instance_id >= 0) {
+      if (instance_id_to_class_id.find(instance_id) == instance_id_to_class_id.end()) {
+        std::cerr << "Can't find instance_id [" << instance_id << "] in instance_id_to_class_id"
+                  << std::endl;
+        return false;
+      } else {
+        class_id = instance_id_to_class_id.find(instance_id)->second;
+      }
+      pitch = morefusion_ros::utils::class_id_to_voxel_pitch(class_id);
+    }
+    if (octrees_.find(instance_id) == octrees_.end()) {
+      OcTreeT* octree = new OcTreeT(pitch);
+      octree->setProbHit(params_.probability_hit);
+      octree->setProbMiss(params_.probability_miss);
+      octree->setClampingThresMin(params_.probability_min);
+      octree->setClampingThresMax(params_.probability_max);
+      octrees_.insert(std::make_pair(instance_id, octree));
+      class_ids_.insert(std::make_pair(instance_id, class_id));
+      new_instance_ids.insert(instance_id);
+    }
+    occupied_cells.insert(std::make_pair(instance_id, octomap::KeySet()));
+  }
+
+  // all other points: free on ray, occupied on endpoint:
+  // Each thread accumulates keys and points into its own buffers, which are
+  // merged after the loop so that no thread waits on a critical section.
+  int num_threads = morefusion_ros::utils::omp_max_threads();
+  std::vector<octomap::KeySet> free_cells_bg_local(num_threads);
+  std::vector<std::map<int, octomap::KeySet> > occupied_cells_local(num_threads, occupied_cells);
+  std::vector<std::map<int, PCLPointCloud> > instance_id_to_points_local(num_threads);
+  std::vector<size_t> rays_cast_local(num_threads, 0);
+  OcTreeT* octree_bg = octrees_.find(-1)->second;
+  #pragma omp parallel
+  {
+    int thread_id = morefusion_ros::utils::omp_thread_num();
+    size_t rays_cast_thread = 0;
+    octomap::KeySet& free_cells_bg_thread = free_cells_bg_local[thread_id];
+    std::map<int, octomap::KeySet>& occupied_cells_thread = occupied_cells_local[thread_id];
+    std::map<int, PCLPointCloud>& instance_id_to_points_thread =
+      instance_id_to_points_local[thread_id];
+    octomap::KeyRay key_ray;
+
+    #pragma omp for
+    for (size_t index = 0 ; index < static_cast<size_t>(frame.width * frame.height); index++) {
+      size_t width_index = index % frame.width;
+      size_t height_index = index / frame.width;
+      if (width_index % 2 != 0 || height_index % 2 != 0) {
+        continue;
+      }
+      octomap::point3d point;
+      if (!frame.getPoint(height_index, width_index, &point)) {
+        continue;
+      }
+      rays_cast_thread++;
+
+      int instance_id = label_ins.at<int32_t>(height_index, width_index);
+
+      if (instance_id != -2) {
+        instance_id_to_points_thread[instance_id].push_back(
+          PCLPoint(point.x(), point.y(), point.z()));
+      }
+
+      // maxrange check
+      if ((params_.max_range < 0.0) || ((point - sensorOrigin).norm() <= params_.max_range)) {
+        // free cells
+        if (octree_bg->computeRayKeys(sensorOrigin, point, key_ray)) {
+          free_cells_bg_thread.insert(key_ray.begin(), key_ray.end());
+        }
+        // occupied endpoint
+        octomap::OcTreeKey key;
+        if (instance_id != -2) {
+          if (octrees_.find(instance_id)->second->coordToKeyChecked(point, key)) {
+            occupied_cells_thread.find(instance_id)->second.insert(key);
+          }
+        }
+        if (instance_id != -1) {
+          if (octree_bg->coordToKeyChecked(point, key)) {
+            free_cells_bg_thread.insert(key);
+          }
+        }
+      } else {  // ray longer than maxrange:;
+        Eigen::Vector3f ray = frame.getRay(index) * params_.max_range;
+        octomap::point3d new_end = sensorOrigin + octomap::point3d(ray(0), ray(1), ray(2));
+        if (octree_bg->computeRayKeys(sensorOrigin, new_end, key_ray)) {
+          free_cells_bg_thread.insert(key_ray.begin(), key_ray.end());
+        }
+      }
+    }
+    rays_cast_local[thread_id] = rays_cast_thread;
+  }
+
+  // Merge the thread-local buffers pairwise (tree reduction into index 0)
+  for (int stride = 1; stride < num_threads; stride *= 2) {
+    #pragma omp parallel for
+    for (int i = 0; i < num_threads - stride; i += 2 * stride) {
+      octomap::KeySet& free_dst = free_cells_bg_local[i];
+      octomap::KeySet& free_src = free_cells_bg_local[i + stride];
+      if (free_dst.size() < free_src.size()) {
+        free_dst.swap(free_src);
+      }
+      free_dst.insert(free_src.begin(), free_src.end());
+      octomap::KeySet().swap(free_src);
+
+      for (auto& kv : occupied_cells_local[i]) {
+        octomap::KeySet& occupied_src = occupied_cells_local[i + stride].find(kv.first)->second;
+        if (kv.second.size() < occupied_src.size()) {
+          kv.second.swap(occupied_src);
+        }
+        kv.second.insert(occupied_src.begin(), occupied_src.end());
+        octomap::KeySet().swap(occupied_src);
+      }
+
+      for (auto& kv : instance_id_to_points_local[i + stride]) {
+        instance_id_to_points_local[i][kv.first] += kv.second;
+      }
+      instance_id_to_points_local[i + stride].clear();
+    }
+  }
+  free_cells_bg.swap(free_cells_bg_local[0]);
+  occupied_cells.swap(occupied_cells_local[0]);
+  std::map<int, PCLPointCloud>& instance_id_to_points = instance_id_to_points_local[0];
+
+  // Keep track of the updated octrees and noentry region for the grid cache
+  instance_ids_updated_.clear();
+  noentry_changed_min_ = octomap::point3d(
+    std::numeric_limits<float>::max(),
+    std::numeric_limits<float>::max(),
+    std::numeric_limits<float>::max());
+  noentry_changed_max_ = -noentry_changed_min_;
+  auto expandNoEntryChanged = [this](OcTreeT* octree, const octomap::OcTreeKey& key) {
+    octomap::point3d p = octree->keyToCoord(key);
+    double half_size = octree->getResolution() / 2.0;
+    for (unsigned i = 0; i < 3; i++) {
+      noentry_changed_min_(i) =
+        std::min(noentry_changed_min_(i), static_cast<float>(p(i) - half_size));
+      noentry_changed_max_(i) =
+        std::max(noentry_changed_max_(i), static_cast<float>(p(i) + half_size));
+    }
+  };
+
+  size_t keys_updated = 0;
+  const octomap::KeySet& occupied_cells_bg = occupied_cells.find(-1)->second;
+  float clamping_min_log = octree_bg->getClampingThresMinLog();
+  for (octomap::KeySet::iterator it = free_cells_bg.begin(); it != free_cells_bg.end(); it++) {
+    if (occupied_cells_bg.find(*it) == occupied_cells_bg.end()) {
+      keys_updated++;
+      // Most free keys are already clamped, which updateNode would skip after
+      // the same search, so they are skipped here without marking a change.
+      const octomap::OcTreeNode* leaf = octree_bg->search(*it);
+      if ((leaf != NULL) && (leaf->getLogOdds() <= clamping_min_log)) {
+        continue;
+      }
+      double occupancy_before = (leaf != NULL) ? leaf->getOccupancy() : 0.5;
+      octomap::OcTreeNode* node = octree_bg->updateNode(*it, false);
+      instance_ids_updated_.insert(-1);
+      if (isNoEntryChanged(occupancy_before, node->getOccupancy(), /*is_background=*/true)) {
+        expandNoEntryChanged(octree_bg, *it);
+      }
+    }
+  }
+
+  for (std::map<int, octomap::KeySet>::iterator i = occupied_cells.begin();
+       i != occupied_cells.end(); i++) {
+    int instance_id = i->first;
+    const octomap::KeySet& key_set_occupied = i->second;
+    OcTreeT* octree = octrees_.find(instance_id)->second;
+    for (octomap::KeySet::const_iterator j = key_set_occupied.begin();
+         j != key_set_occupied.end(); j++) {
+      const octomap::OcTreeNode* leaf = octree->search(*j);
+      double occupancy_before = (leaf != NULL) ? leaf->getOccupancy() : 0.5;
+      octomap::OcTreeNode* node = octree->updateNode(*j, true);
+      if (instance_id != -1) {
+        instance_index_.update(instance_id, *octree, *j, node->getOccupancy());
+      }
+      if (isNoEntryChanged(occupancy_before, node->getOccupancy(), instance_id == -1)) {
+        expandNoEntryChanged(octree, *j);
+      }
+    }
+    if (!key_set_occupied.empty()) {
+      instance_ids_updated_.insert(instance_id);
+    }
+    keys_updated += key_set_occupied.size();
+  }
+  if (stats_ != NULL) {
+    size_t rays_cast = 0;
+    for (size_t n : rays_cast_local) {
+      rays_cast += n;
+    }
+    stats_->set("rays_cast", rays_cast);
+    stats_->set("keys_updated", keys_updated);
+    stats_->set("instances", octrees_.size() - 1);  // excluding background
+  }
+
+  for (std::map<int, PCLPointCloud>::iterator it = instance_id_to_points.begin();
+       it != instance_id_to_points.end(); it++) {
+    int instance_id = it->first;
+    const PCLPointCloud& points = it->second;
+    OcTreeT* octree = octrees_.find(instance_id)->second;
+
+    PCLPoint min_pt, max_pt;
+    pcl::getMinMax3D(points, min_pt, max_pt);
+
+    float min_x, min_y, min_z;
+    float max_x, max_y, max_z;
+    if (new_instance_ids.find(instance_id) == new_instance_ids.end()) {
+      // not new instance
+      octomap::point3d min_bbx = octree->getBBXMin();
+      octomap::point3d max_bbx = octree->getBBXMax();
+      min_x = std::min(min_bbx.x(), min_pt.x);
+      min_y = std::min(min_bbx.y(), min_pt.y);
+      min_z = std::min(min_bbx.z(), min_pt.z);
+      max_x = std::max(max_bbx.x(), max_pt.x);
+      max_y = std::max(max_bbx.y(), max_pt.y);
+      max_z = std::max(max_bbx.z(), max_pt.z);
+    } else {
+      min_x = min_pt.x;
+      min_y = min_pt.y;
+      min_z = min_pt.z;
+      max_x = max_pt.x;
+      max_y = max_pt.y;
+      max_z = max_pt.z;
+    }
+
+    octomap::point3d bbx_min(min_x, min_y, min_z);
+    octomap::point3d bbx_max(max_x, max_y, max_z);
+    octree->setBBXMin(bbx_min);
+    octree->setBBXMax(bbx_max);
+
+#if 0
+    centers_.insert(std::make_pair(instance_id, octree->getBBXCenter()));
+#else
+    Eigen::Matrix<float, 4, 1> centroid;
+    pcl::compute3DCentroid<PCLPoint, float>(
+      /*cloud=*/it->second, /*centroid=*/centroid);
+    octomap::point3d center(centroid(0, 0), centroid(1, 0), centroid(2, 0));
+    centers_.insert(std::make_pair(instance_id, center));
+#endif
+  }
+
+  if (params_.compress_map) {
+    for (std::map<int, OcTreeT*>::iterator it = octrees_.begin(); it != octrees_.end(); it++) {
+      it->second->prune();
+    }
+  }
+  return true;
+}
+
+void MultiInstanceMapping::updateGrids(const Eigen::Matrix4f& sensorToWorld) {
+  size_t grid_voxels_searched = 0;
+  for (std::map<int, OcTreeT*>::iterator it_octree = octrees_.begin();
+       it_octree != octrees_.end(); it_octree++) {
+    int instance_id = it_octree->first;
+    if (instance_id == -1) {
+      continue;
+    }
+    std::map<int, GridCache>::iterator it_cache = grids_cache_.find(instance_id);
+    if ((it_cache == grids_cache_.end()) ||
+        isGridCacheStale(instance_id, it_cache->second, sensorToWorld)) {
+      GridCache& cache = grids_cache_[instance_id];
+      cache.sensorToWorld = sensorToWorld;
+      extractGrids(instance_id, sensorToWorld, &cache.grid, &cache.grid_noentry);
+      grid_voxels_searched += cache.grid.dims[0] * cache.grid.dims[1] * cache.grid.dims[2];
+    }
+  }
+  if (stats_ != NULL) {
+    stats_->set("grid_voxels_searched", grid_voxels_searched);
+  }
+}
+
+void MultiInstanceMapping::getGridsInWorldFrame(std::vector<Grid>* grids) const {
+  grids->clear();
+  for (std::map<int, OcTreeT*>::const_iterator it_octree = octrees_.begin();
+       it_octree != octrees_.end(); it_octree++) {
+    int instance_id = it_octree->first;
+    const OcTreeT* octree = it_octree->second;
+
+    if (instance_id == -1) {
+      continue;
+    }
+    unsigned class_id = class_ids_.find(instance_id)->second;
+    double pitch = morefusion_ros::utils::class_id_to_voxel_pitch(class_id);
+
+    // world frame
+    octomap::point3d center = centers_.find(instance_id)->second;
+
+    grids->push_back(Grid());
+    Grid& grid = grids->back();
+    grid.pitch = pitch;
+    grid.dims[0] = 32;
+    grid.dims[1] = 32;
+    grid.dims[2] = 32;
+    for (int i = 0; i < 3; i++) {
+      grid.origin(i) = center(i) - (grid.dims[i] / 2.0 - 0.5) * grid.pitch;
+    }
+    grid.instance_id = instance_id;
+    grid.class_id = class_id;
+
+    // in world
+    Eigen::Matrix3Xf points;
+    morefusion_ros::utils::sample_lattice(
+      grid.origin,
+      Eigen::Vector3f(grid.pitch, 0, 0),
+      Eigen::Vector3f(0, grid.pitch, 0),
+      Eigen::Vector3f(0, 0, grid.pitch),
+      grid.dims[0], grid.dims[1], grid.dims[2], &points);
+    std::vector<const octomap::OcTreeNode*> nodes;
+    morefusion_ros::utils::search_points(*octree, points, &nodes);
+
+    for (size_t index = 0; index < nodes.size(); index++) {
+      const octomap::OcTreeNode* node = nodes[index];
+      if ((node != NULL) && (node->getOccupancy() > 0.5)) {
+        grid.indices.push_back(index);
+        grid.values.push_back(node->getOccupancy());
+      }
+    }
+  }
+}
+
+bool MultiInstanceMapping::isGridCacheStale(
+    int instance_id,
+    const GridCache& cache,
+    const Eigen::Matrix4f& sensorToWorld) const {
+  if (instance_ids_updated_.find(instance_id) != instance_ids_updated_.end()) {
+    return true;
+  }
+
+  // the noentry grid also depends on the other octrees around the object
+  octomap::point3d center = centers_.find(instance_id)->second;
+  double radius = std::sqrt(3.0) * cache.grid.dims[0] / 2.0 * cache.grid.pitch;
+  if ((center.x() + radius >= noentry_changed_min_.x()) &&
+      (center.y() + radius >= noentry_changed_min_.y()) &&
+      (center.z() + radius >= noentry_changed_min_.z()) &&
+      (center.x() - radius <= noentry_changed_max_.x()) &&
+      (center.y() - radius <= noentry_changed_max_.y()) &&
+      (center.z() - radius <= noentry_changed_max_.z())) {
+    return true;
+  }
+
+  // the grids are in the sensor frame
+  Eigen::Matrix4f sensorToWorldCached = cache.sensorToWorld;
+  if (sensorToWorldCached == sensorToWorld) {
+    return false;
+  }
+  double translation = (sensorToWorld.topRightCorner<3, 1>() -
+                        sensorToWorldCached.topRightCorner<3, 1>()).norm();
+  double rotation = Eigen::AngleAxisf(
+    Eigen::Matrix3f(sensorToWorldCached.topLeftCorner<3, 3>().transpose() *
+                    sensorToWorld.topLeftCorner<3, 3>())).angle();
+  return (translation > params_.grid_cache_max_translation) || (rotation > params_.grid_cache_max_rotation);
+}
+
+bool MultiInstanceMapping::isNoEntryChanged(
+    double occupancy_before, double occupancy_after, bool is_background) const {
+  if (occupancy_before == occupancy_after) {
+    return false;
+  }
+  // occupied voxels of the background and the other instances
+  if ((occupancy_before >= params_.probability_max) !=
+      (occupancy_after >= params_.probability_max)) {
+    return true;
+  }
+  // free voxels of the background, whose values follow the occupancy
+  return is_background && params_.free_as_noentry &&
+         ((occupancy_before < 0.5) || (occupancy_after < 0.5));
+}
+
+void MultiInstanceMapping::extractGrids(
+    int instance_id,
+    const Eigen::Matrix4f& sensorToWorld,
+    Grid* grid_out,
+    Grid* grid_noentry_out) {
+  OcTreeT* octree = octrees_.find(instance_id)->second;
+  OcTreeT* octree_bg = octrees_.find(-1)->second;
+  unsigned class_id = class_ids_.find(instance_id)->second;
+  double pitch = morefusion_ros::utils::class_id_to_voxel_pitch(class_id);
+
+  octomap::point3d center = centers_.find(instance_id)->second;
+
+  Eigen::Vector4f center_sensor =
+    sensorToWorld.inverse() * Eigen::Vector4f(center.x(), center.y(), center.z(), 1);
+
+  Grid& grid = *grid_out;
+  grid = Grid();
+  grid.pitch = pitch;
+  grid.dims[0] = 32;
+  grid.dims[1] = 32;
+  grid.dims[2] = 32;
+  for (int i = 0; i < 3; i++) {
+    grid.origin(i) = center_sensor(i) - (grid.dims[i] / 2.0 - 0.5) * grid.pitch;
+  }
+  grid.instance_id = instance_id;
+  grid.class_id = class_id;
+
+  Grid& grid_noentry = *grid_noentry_out;
+  grid_noentry = Grid();
+  grid_noentry.pitch = grid.pitch;
+  std::copy(grid.dims, grid.dims + 3, grid_noentry.dims);
+  grid_noentry.origin = grid.origin;
+  grid_noentry.instance_id = grid.instance_id;
+  grid_noentry.class_id = grid.class_id;
+
+  // lattice in the sensor frame, sampled in world
+  Eigen::Vector4f origin_world = sensorToWorld *
+    Eigen::Vector4f(grid.origin(0), grid.origin(1), grid.origin(2), 1);
+  Eigen::Matrix3f rotation = sensorToWorld.topLeftCorner<3, 3>();
+  Eigen::Matrix3Xf points;
+  morefusion_ros::utils::sample_lattice(
+    origin_world.head<3>(),
+    rotation.col(0) * grid.pitch,
+    rotation.col(1) * grid.pitch,
+    rotation.col(2) * grid.pitch,
+    grid.dims[0], grid.dims[1], grid.dims[2], &points);
+  std::vector<const octomap::OcTreeNode*> nodes;
+  std::vector<const octomap::OcTreeNode*> nodes_bg;
+  morefusion_ros::utils::search_points(*octree, points, &nodes);
+  morefusion_ros::utils::search_points(*octree_bg, points, &nodes_bg);
+
+  std::vector<morefusion_ros::utils::InstanceVoxelIndex::Entry> entries_other;
+  for (size_t index = 0; index < nodes.size(); index++) {
+    float x = points(0, index);
+    float y = points(1, index);
+    float z = points(2, index);
+    if (params_.ground_as_noentry && (z < 0)) {
+      grid_noentry.indices.push_back(index);
+      grid_noentry.values.push_back(params_.probability_max);
+      continue;
+    }
+
+    const octomap::OcTreeNode* node = nodes[index];
+    if ((node != NULL) && (node->getOccupancy() > 0.5)) {
+      grid.indices.push_back(index);
+      grid.values.push_back(node->getOccupancy());
+    } else {
+      // background, then the other instances in one lookup
+      node = nodes_bg[index];
+      if (node != NULL) {
+        double occupancy = node->getOccupancy();
+        if (params_.free_as_noentry && (occupancy < 0.5)) {
+          grid_noentry.indices.push_back(index);
+          grid_noentry.values.push_back(1 - occupancy);
+        } else if (occupancy >= params_.probability_max) {
+          grid_noentry.indices.push_back(index);
+          grid_noentry.values.push_back(occupancy);
+        }
+      }
+      instance_index_.search(x, y, z, &entries_other);
+      for (const morefusion_ros::utils::InstanceVoxelIndex::Entry& entry : entries_other) {
+        if (entry.instance_id == instance_id) {
+          continue;
+        }
+        if (entry.occupancy >= params_.probability_max) {
+          grid_noentry.indices.push_back(index);
+          grid_noentry.values.push_back(entry.occupancy);
+        }
+      }
+    }
+  }
+}
+
+bool MultiInstanceMapping::isSpeckleNode(
+    const OcTreeT& octree_bg, const octomap::OcTreeKey& nKey) {
+  octomap::OcTreeKey key;
+  bool neighborFound = false;
+  for (key[2] = nKey[2] - 1; !neighborFound && key[2] <= nKey[2] + 1; ++key[2]) {
+    for (key[1] = nKey[1] - 1; !neighborFound && key[1] <= nKey[1] + 1; ++key[1]) {
+      for (key[0] = nKey[0] - 1; !neighborFound && key[0] <= nKey[0] + 1; ++key[0]) {
+        if (key != nKey) {
+          octomap::OcTreeNode* node = octree_bg.search(key);
+          if (node && octree_bg.isNodeOccupied(node)) {
+            // we have a neighbor => break!
+            neighborFound = true;
+          }
+        }
+      }
+    }
+  }
+
+  return neighborFound;
+}
+
+}  // namespace morefusion_ros
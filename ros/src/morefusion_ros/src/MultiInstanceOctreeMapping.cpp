@@ -0,0 +1,139 @@
+// Copyright (c) 2019 Kentaro Wada
+
+#include "morefusion_ros/MultiInstanceOctreeMapping.h"
+
+#include <algorithm>
+#include <cmath>
+#include <utility>
+
+namespace morefusion_ros {
+
+MultiInstanceOctreeMapping::~MultiInstanceOctreeMapping() {
+  for (std::map<int, OcTreeT*>::iterator it = octrees_.begin(); it != octrees_.end(); it++) {
+    delete it->second;
+  }
+}
+
+bool MultiInstanceOctreeMapping::initialize(int instance_id, double pitch) {
+  if (hasInstance(instance_id)) {
+    return false;
+  }
+  octrees_.insert(std::make_pair(instance_id, new OcTreeT(pitch)));
+  instance_ids_.push_back(instance_id);
+  return true;
+}
+
+bool MultiInstanceOctreeMapping::integrate(
+    int instance_id,
+    const octomap::Pointcloud& points,
+    const octomap::point3d& origin) {
+  std::map<int, OcTreeT*>::iterator it = octrees_.find(instance_id);
+  if (it == octrees_.end()) {
+    return false;
+  }
+  it->second->insertPointCloud(points, origin);
+  return true;
+}
+
+bool MultiInstanceOctreeMapping::update(
+    int instance_id,
+    const std::vector<octomap::point3d>& occupied) {
+  std::map<int, OcTreeT*>::iterator it = octrees_.find(instance_id);
+  if (it == octrees_.end()) {
+    return false;
+  }
+  for (const octomap::point3d& point : occupied) {
+    it->second->updateNode(point, true, /*lazy_eval=*/true);
+  }
+  it->second->updateInnerOccupancy();
+  return true;
+}
+
+bool MultiInstanceOctreeMapping::getTargetGrids(
+    int target_id,
+    const int dims[3],
+    double pitch,
+    const double origin[3],
+    float* grid_target,
+    float* grid_nontarget,
+    float* grid_empty) const {
+  if (!hasInstance(target_id)) {
+    return false;
+  }
+  std::vector<const OcTreeT*> octrees;
+  for (int instance_id : instance_ids_) {
+    octrees.push_back(octrees_.find(instance_id)->second);
+  }
+  const OcTreeT* octree_target = octrees_.find(target_id)->second;
+
+  // Voxels are independent, so they are searched in parallel
+  int size = dims[0] * dims[1] * dims[2];
+  #pragma omp parallel for
+  for (int index = 0; index < size; index++) {
+    int i = index / (dims[1] * dims[2]);
+    int j = (index / dims[2]) % dims[1];
+    int k = index % dims[2];
+    octomap::point3d center(origin[0] + i * pitch, origin[1] + j * pitch, origin[2] + k * pitch);
+    float target = 0;
+    float nontarget = 0;
+    float empty = 0;
+    for (const OcTreeT* octree : octrees) {
+      octomap::OcTreeNode* node = octree->search(center);
+      if (node == NULL) {
+        continue;
+      }
+      double occupancy = node->getOccupancy();
+      if (occupancy >= 0.5) {
+        if (octree == octree_target) {
+          target = occupancy;
+        } else {
+          nontarget = occupancy;
+        }
+      } else {
+        empty = 1 - occupancy;
+      }
+    }
+    grid_target[index] = target;
+    grid_nontarget[index] = nontarget;
+    grid_empty[index] = empty;
+  }
+  return true;
+}
+
+bool MultiInstanceOctreeMapping::getTargetPoints(
+    int target_id,
+    std::vector<double>* occupied,
+    std::vector<double>* empty) const {
+  std::map<int, OcTreeT*>::const_iterator it_octree = octrees_.find(target_id);
+  if (it_octree == octrees_.end()) {
+    return false;
+  }
+  const OcTreeT* octree = it_octree->second;
+  double resolution = octree->getResolution();
+  occupied->clear();
+  empty->clear();
+  for (OcTreeT::leaf_iterator it = octree->begin_leafs(), end = octree->end_leafs();
+       it != end; ++it) {
+    std::vector<double>* points = octree->isNodeOccupied(*it) ? occupied : empty;
+    double size = it.getSize();
+    int dimension = std::max(static_cast<int>(std::round(size / resolution)), 1);
+    // center of the voxel at the minimum corner of the leaf
+    octomap::point3d center = it.getCoordinate();
+    double offset = size / 2 - resolution / 2;
+    double x0 = center.x() - offset;
+    double y0 = center.y() - offset;
+    double z0 = center.z() - offset;
+    for (int i = 0; i < dimension; i++) {
+      for (int j = 0; j < dimension; j++) {
+        for (int k = 0; k < dimension; k++) {
+          points->push_back(x0 + i * resolution);
+          points->push_back(y0 + j * resolution);
+          points->push_back(z0 + k * resolution);
+        }
+      }
+    }
+  }
+  return true;
+}
+
+}  // namespace morefusion_ros
@@ -2,90 +2,234 @@
 
 #include "morefusion_ros/OctomapServer.h"
 
+#include <cinttypes>
+
 using octomap_msgs::Octomap;
 
 namespace morefusion_ros {
 
-OctomapServer::OctomapServer() {
-  nh_ = ros::NodeHandle();
-  pnh_ = ros::NodeHandle("~");
+OctomapServer::OctomapServer() : OctomapServer(ros::NodeHandle(), ros::NodeHandle("~")) {}
+
+OctomapServer::OctomapServer(const ros::NodeHandle& nh, const ros::NodeHandle& pnh) {
+  nh_ = nh;
+  pnh_ = pnh;
 
-  instance_counter_ = 0;
   tree_depth_ = 16;
   tree_depth_max_ = 16;
   reset_stamp_ = ros::Time::now();
+  reset_requested_ = false;
+  config_requested_ = false;
+  snapshot_requested_ = false;
+  snapshot_.reset(new MapSnapshot);
 
   // parameters for mapping
-  pnh_.param("resolution", resolution_, 0.05);
-  pnh_.param("sensor_model/max_range", max_range_, -1.0);
-  pnh_.param("sensor_model/hit", probability_hit_, 0.7);
-  pnh_.param("sensor_model/miss", probability_miss_, 0.4);
-  pnh_.param("sensor_model/min", probability_min_, 0.12);
-  pnh_.param("sensor_model/max", probability_max_, 0.97);
-  pnh_.param("compress_map", do_compress_map_, false);
+  MultiInstanceMapping::Params params;
+  pnh_.param("resolution", params.resolution, 0.05);
+  pnh_.param("sensor_model/max_range", params.max_range, -1.0);
+  pnh_.param("sensor_model/hit", params.probability_hit, 0.7);
+  pnh_.param("sensor_model/miss", params.probability_miss, 0.4);
+  pnh_.param("sensor_model/min", params.probability_min, 0.12);
+  pnh_.param("sensor_model/max", params.probability_max, 0.97);
+  pnh_.param("compress_map", params.compress_map, false);
   pnh_.param("use_render_service", use_render_service_, false);
+  pnh_.param("use_points", use_points_, true);
+  pnh_.param("render_mode", params.render_mode, std::string("raycast"));
+  if (params.render_mode != "raycast" && params.render_mode != "rasterize") {
+    ROS_ERROR("Unsupported ~render_mode: %s, falling back to raycast",
+              params.render_mode.c_str());
+    params.render_mode = "raycast";
+  }
 
   // paramters for publishing
   pnh_.param("frame_id", frame_id_world_, std::string("map"));
   pnh_.param("sensor_frame_id", frame_id_sensor_, std::string("camera_color_optical_frame"));
   pnh_.param("filter_speckles", do_filter_speckles_, false);
+  pnh_.param("grid_cache/max_translation", params.grid_cache_max_translation, 0.0);
+  pnh_.param("grid_cache/max_rotation", params.grid_cache_max_rotation, 0.0);
+
+  // parameters for the pipeline
+  int queue_size;
+  pnh_.param("queue/policy", queue_policy_, std::string("latest"));
+  pnh_.param("queue/size", queue_size, 1);
+  pnh_.param("queue/every_nth", queue_every_nth_, 1);
+  if (queue_policy_ != "latest" && queue_policy_ != "every_nth" && queue_policy_ != "block") {
+    ROS_ERROR("Unsupported ~queue/policy: %s, falling back to latest", queue_policy_.c_str());
+    queue_policy_ = "latest";
+  }
+  queue_every_nth_ = std::max(queue_every_nth_, 1);
+  frame_queue_.setCapacity(std::max(queue_size, 1));
+  // one frame converted ahead of integration, and one snapshot waiting for
+  // the one being published
+  prepared_queue_.setCapacity(1);
+  snapshot_queue_.setCapacity(1);
+  frames_received_ = 0;
+  frames_dropped_ = 0;
+  frames_dropped_reported_ = 0;
+  bool diagnostics_enabled;
+  double diagnostics_period;
+  pnh_.param("diagnostics/enabled", diagnostics_enabled, false);
+  pnh_.param("diagnostics/period", diagnostics_period, 1.0);
+  if (diagnostics_enabled) {
+    stats_.reset(new morefusion_ros::utils::PipelineStats);
+  }
 
-  tf_listener_ = new tf::TransformListener(ros::Duration(30));
+  mapping_.reset(new MultiInstanceMapping(params));
+  mapping_->setStats(stats_.get());
+
+  // recording of the frames for mapping_replay
+  std::string record_path;
+  pnh_.param("record/path", record_path, std::string(""));
+  if (!record_path.empty()) {
+    recorder_.reset(new FrameLogWriter);
+    // frames captured before the start are dropped as before a reset
+    if (recorder_->open(record_path, params) && recorder_->writeReset(reset_stamp_.toNSec())) {
+      ROS_INFO_BLUE("Recording frames to %s", record_path.c_str());
+    } else {
+      ROS_ERROR("Can't open ~record/path: %s", record_path.c_str());
+      recorder_.reset();
+    }
+  }
+
+  tf_listener_.reset(new tf::TransformListener(ros::Duration(30)));
 
   pub_binary_map_ = pnh_.advertise<Octomap>("output/octomap_binary", 1);
   pub_full_map_ = pnh_.advertise<Octomap>("output/octomap_full", 1);
   pub_grids_ = pnh_.advertise<morefusion_ros::VoxelGridArray>("output/grids", 1);
   pub_grids_noentry_ = pnh_.advertise<morefusion_ros::VoxelGridArray>(
     "output/grids_noentry", 1);
+  pub_grids_compact_ = pnh_.advertise<morefusion_ros::CompactVoxelGridArray>(
+    "output/grids_compact", 1);
+  pub_grids_noentry_compact_ = pnh_.advertise<morefusion_ros::CompactVoxelGridArray>(
+    "output/grids_noentry_compact", 1);
   pub_markers_free_ = pnh_.advertise<visualization_msgs::MarkerArray>("output/markers_free", 1);
   pub_markers_bg_ = pnh_.advertise<visualization_msgs::MarkerArray>("output/markers_bg", 1);
   pub_markers_fg_ = pnh_.advertise<visualization_msgs::MarkerArray>("output/markers_fg", 1);
   pub_label_rendered_ = pnh_.advertise<sensor_msgs::Image>("output/label_rendered", 1);
   pub_label_tracked_ = pnh_.advertise<sensor_msgs::Image>("output/label_tracked", 1);
   pub_class_ = pnh_.advertise<morefusion_ros::ObjectClassArray>("output/class", 1);
+  if (stats_) {
+    pub_diagnostics_ = pnh_.advertise<diagnostic_msgs::DiagnosticArray>("output/diagnostics", 1);
+    diagnostics_stamp_ = ros::WallTime::now();
+    timer_diagnostics_ = pnh_.createWallTimer(
+      ros::WallDuration(diagnostics_period), &OctomapServer::publishDiagnostics, this);
+  }
 
-  sub_camera_ = new message_filters::Subscriber<sensor_msgs::CameraInfo>(
-    pnh_, "input/camera_info", 5);
-  sub_depth_ = new message_filters::Subscriber<sensor_msgs::Image>(
-    pnh_, "input/depth", 5);
-  sub_pcd_ = new message_filters::Subscriber<sensor_msgs::PointCloud2>(
-    pnh_, "input/points", 5);
-  sub_label_ins_ = new message_filters::Subscriber<sensor_msgs::Image>(
-    pnh_, "input/label_ins", 5);
-  sub_class_ = new message_filters::Subscriber<morefusion_ros::ObjectClassArray>(
-    pnh_, "input/class", 5);
-  sync_ = new message_filters::Synchronizer<ExactSyncPolicy>(100);
-  sync_->connectInput(*sub_camera_, *sub_depth_, *sub_pcd_, *sub_label_ins_, *sub_class_);
-  sync_->registerCallback(
-    boost::bind(&OctomapServer::insertCloudCallback, this, _1, _2, _3, _4, _5));
+  sub_camera_.reset(new message_filters::Subscriber<sensor_msgs::CameraInfo>(
+    pnh_, "input/camera_info", 5));
+  sub_depth_.reset(new message_filters::Subscriber<sensor_msgs::Image>(
+    pnh_, "input/depth", 5));
+  sub_label_ins_.reset(new message_filters::Subscriber<sensor_msgs::Image>(
+    pnh_, "input/label_ins", 5));
+  sub_class_.reset(new message_filters::Subscriber<morefusion_ros::ObjectClassArray>(
+    pnh_, "input/class", 5));
+  if (use_points_) {
+    sub_pcd_.reset(new message_filters::Subscriber<sensor_msgs::PointCloud2>(
+      pnh_, "input/points", 5));
+    sync_.reset(new message_filters::Synchronizer<ExactSyncPolicy>(100));
+    sync_->connectInput(*sub_camera_, *sub_depth_, *sub_pcd_, *sub_label_ins_, *sub_class_);
+    sync_->registerCallback(
+      boost::bind(&OctomapServer::insertCloudCallback, this, _1, _2, _3, _4, _5));
+  } else {
+    // points are back-projected from the depth
+    sync_depth_.reset(new message_filters::Synchronizer<ExactSyncDepthPolicy>(100));
+    sync_depth_->connectInput(*sub_camera_, *sub_depth_, *sub_label_ins_, *sub_class_);
+    sync_depth_->registerCallback(
+      boost::bind(&OctomapServer::insertDepthCallback, this, _1, _2, _3, _4));
+  }
 
   client_render_ = pnh_.serviceClient<morefusion_ros::RenderVoxelGridArray>("render");
 
   server_reset_ = pnh_.advertiseService("reset", &OctomapServer::resetCallback, this);
+  server_get_octomap_ = pnh_.advertiseService(
+    "octomap_binary", &OctomapServer::getOctomapCallback, this);
 
   dynamic_reconfigure::Server<morefusion_ros::OctomapServerConfig>::CallbackType f =
     boost::bind(&OctomapServer::configCallback, this, _1, _2);
-  server_reconfig_.setCallback(f);
+  server_reconfig_.reset(
+    new dynamic_reconfigure::Server<morefusion_ros::OctomapServerConfig>(pnh_));
+  server_reconfig_->setCallback(f);
+
+  convert_thread_ = boost::thread(boost::bind(&OctomapServer::convertLoop, this));
+  integrate_thread_ = boost::thread(boost::bind(&OctomapServer::integrateLoop, this));
+  publish_thread_ = boost::thread(boost::bind(&OctomapServer::publishLoop, this));
 
   ROS_INFO_BLUE("Initialized");
 }
 
+OctomapServer::~OctomapServer() {
+  // stop the callbacks feeding the pipeline before stopping its threads
+  sync_.reset();
+  sync_depth_.reset();
+  sub_camera_.reset();
+  sub_depth_.reset();
+  sub_pcd_.reset();
+  sub_label_ins_.reset();
+  sub_class_.reset();
+  server_reconfig_.reset();
+  server_reset_.shutdown();
+  server_get_octomap_.shutdown();
+  timer_diagnostics_.stop();
+
+  frame_queue_.close();
+  prepared_queue_.close();
+  snapshot_queue_.close();
+  convert_thread_.join();
+  integrate_thread_.join();
+  publish_thread_.join();
+  // used by the convert stage
+  tf_listener_.reset();
+}
+
 bool OctomapServer::resetCallback(std_srvs::Empty::Request &req, std_srvs::Empty::Response &res) {
-  boost::mutex::scoped_lock lock(mutex_);
-  octrees_.clear();
-  class_ids_.clear();
-  centers_.clear();
-  instance_counter_ = 0;
+  boost::mutex::scoped_lock lock(requests_mutex_);
+  reset_requested_ = true;
   reset_stamp_ = ros::Time::now();
+  {
+    boost::mutex::scoped_lock lock_recorder(recorder_mutex_);
+    if (recorder_ && !recorder_->writeReset(reset_stamp_.toNSec())) {
+      ROS_ERROR("Can't record the reset at %f, so stopped recording", reset_stamp_.toSec());
+      recorder_.reset();
+    }
+  }
+  // readers see the empty map right away, the octrees are cleared by the next frame
+  boost::shared_ptr<MapSnapshot> map(new MapSnapshot);
+  map->stamp = reset_stamp_;
+  boost::atomic_store(&snapshot_, MapSnapshotConstPtr(map));
   return true;
 }
 
+bool OctomapServer::getOctomapCallback(OctomapSrv::Request &req, OctomapSrv::Response &res) {
+  // respond with the latest snapshot right away, never waiting for a frame, and
+  // have the next frame update it if the map is not subscribed
+  snapshot_requested_ = true;
+  MapSnapshotConstPtr map = boost::atomic_load(&snapshot_);
+  res.map.header.frame_id = frame_id_world_;
+  res.map.header.stamp = map->stamp;
+  std::map<int, boost::shared_ptr<const OcTreeT> >::const_iterator it = map->octrees.find(-1);
+  if (it == map->octrees.end()) {
+    return octomap_msgs::binaryMapToMsg(OcTreeT(mapping_->params().resolution), res.map);
+  }
+  return octomap_msgs::binaryMapToMsg(*it->second, res.map);
+}
+
 void OctomapServer::configCallback(
   const morefusion_ros::OctomapServerConfig& config, const uint32_t level) {
-  boost::mutex::scoped_lock lock(mutex_);
+  boost::mutex::scoped_lock lock(requests_mutex_);
   ROS_INFO_BLUE("configCallback");
-  m_groundAsNoEntry = config.ground_as_noentry;
-  m_freeAsNoEntry = config.free_as_noentry;
+  config_ = config;
+  config_requested_ = true;
+}
+
+void OctomapServer::applyRequests() {
+  boost::mutex::scoped_lock lock(requests_mutex_);
+  if (reset_requested_) {
+    mapping_->reset();
+    reset_requested_ = false;
+  }
+  if (config_requested_) {
+    mapping_->setNoEntry(config_.ground_as_noentry, config_.free_as_noentry);
+    config_requested_ = false;
+  }
 }
 
 void OctomapServer::insertCloudCallback(
@@ -94,428 +238,423 @@ void OctomapServer::insertCloudCallback(
     const sensor_msgs::PointCloud2ConstPtr& cloud,
     const sensor_msgs::ImageConstPtr& ins_msg,
     const morefusion_ros::ObjectClassArrayConstPtr& class_msg) {
-  boost::mutex::scoped_lock lock(mutex_);
-  if (camera_info_msg->header.stamp < reset_stamp_) {
-    return;
+  Frame frame;
+  frame.camera_info = camera_info_msg;
+  frame.depth = depth_msg;
+  frame.cloud = cloud;
+  frame.ins = ins_msg;
+  frame.cls = class_msg;
+  if (stats_) {
+    // from the capture to the synchronized inputs, which includes the transport
+    // and so differs between the node and the nodelet
+    stats_->record("receive", (ros::Time::now() - camera_info_msg->header.stamp).toSec());
   }
-  // Get TF
-  tf::StampedTransform sensorToWorldTf;
-  if (!tf_listener_->waitForTransform(frame_id_world_,
-                                      cloud->header.frame_id,
-                                      cloud->header.stamp,
-                                      ros::Duration(0.1))) {
-    return;
-  }
-  tf_listener_->lookupTransform(
-    frame_id_world_, cloud->header.frame_id, cloud->header.stamp, sensorToWorldTf);
-  Eigen::Matrix4f sensorToWorld;
-  pcl_ros::transformAsMatrix(sensorToWorldTf, sensorToWorld);
-
-  // ROSMsg -> PCL
-  PCLPointCloud pc;
-  pcl::fromROSMsg(*cloud, pc);
-
-  // Transform pointcloud: sensor -> world (map)
-  pcl::transformPointCloud(pc, pc, sensorToWorld);
-
-  // ROSMsg -> OpenCV
-  cv::Mat label_ins = cv_bridge::toCvCopy(ins_msg, ins_msg->encoding)->image;
-
-  // Render
-  cv::Mat label_ins_rend;
-  if (use_render_service_) {
-    morefusion_ros::RenderVoxelGridArray srv;
-    tf::transformStampedTFToMsg(sensorToWorldTf, srv.request.transform);
-    srv.request.camera_info = *camera_info_msg;
-    srv.request.depth = *depth_msg;
-    getGridsInWorldFrame(camera_info_msg->header.stamp, srv.request.grids);
-    client_render_.call(srv);
-    sensor_msgs::Image ins_rendered_msg = srv.response.label_ins;
-    label_ins_rend = cv_bridge::toCvCopy(
-      srv.response.label_ins, srv.response.label_ins.encoding)->image;
+
+  frames_received_++;
+  if ((queue_policy_ == "every_nth") && ((frames_received_ - 1) % queue_every_nth_ != 0)) {
+    frames_dropped_++;
   } else {
-    label_ins_rend = label_ins.clone();
-    render(camera_info_msg, sensorToWorldTf.getOrigin(), pc, label_ins_rend, sensorToWorld);
+    // every_nth keeps the latest of the accepted frames
+    frames_dropped_ += frame_queue_.push(frame, /*block=*/queue_policy_ == "block");
   }
-  // Publish Rendered Instance Label
-  pub_label_rendered_.publish(
-    cv_bridge::CvImage(ins_msg->header, "32SC1", label_ins_rend).toImageMsg());
 
-  // Track Instance IDs
-  std::map<int, unsigned> instance_id_to_class_id;
-  for (size_t i = 0; i < class_msg->classes.size(); i++) {
-    instance_id_to_class_id.insert(
-      std::make_pair(
-        class_msg->classes[i].instance_id,
-        class_msg->classes[i].class_id));
+  if (frames_dropped_ > frames_dropped_reported_) {
+    ROS_WARN_THROTTLE(
+      10, "Ingest queue: dropped %" PRIu64 " of %" PRIu64 " frames, depth %zu/%zu (policy: %s)",
+      frames_dropped_, frames_received_, frame_queue_.size(), frame_queue_.capacity(),
+      queue_policy_.c_str());
+    frames_dropped_reported_ = frames_dropped_;
   }
-  morefusion_ros::utils::track_instance_id(
-    /*reference=*/label_ins_rend,
-    /*target=*/&label_ins,
-    /*instance_id_to_class_id=*/&instance_id_to_class_id,
-    /*instance_counter=*/&instance_counter_);
-  for (std::map<int, unsigned>::iterator it = class_ids_.begin();
-       it != class_ids_.end(); it++) {
-    if (instance_id_to_class_id.find(it->first) == instance_id_to_class_id.end()) {
-      instance_id_to_class_id.insert(std::make_pair(it->first, it->second));
-    }
+  if (stats_) {
+    stats_->set("frames_received", frames_received_);
+    stats_->set("frames_dropped", frames_dropped_);
   }
-  // Publish Tracked Instance Label
-  pub_label_tracked_.publish(
-    cv_bridge::CvImage(ins_msg->header, "32SC1", label_ins).toImageMsg());
+}
 
-  morefusion_ros::ObjectClassArray cls_rend_msg;
-  cls_rend_msg.header = cloud->header;
-  for (std::map<int, unsigned>::iterator it = class_ids_.begin();
-       it != class_ids_.end(); it++) {
-    if (it->first == -1) {
-      continue;
+void OctomapServer::insertDepthCallback(
+    const sensor_msgs::CameraInfoConstPtr& camera_info_msg,
+    const sensor_msgs::ImageConstPtr& depth_msg,
+    const sensor_msgs::ImageConstPtr& ins_msg,
+    const morefusion_ros::ObjectClassArrayConstPtr& class_msg) {
+  insertCloudCallback(
+    camera_info_msg, depth_msg, sensor_msgs::PointCloud2ConstPtr(), ins_msg, class_msg);
+}
+
+void OctomapServer::convertLoop() {
+  Frame frame;
+  while (frame_queue_.pop(&frame)) {
+    PreparedFramePtr prepared = takePreparedFrame();
+    if (prepareFrame(frame, prepared.get())) {
+      recordFrame(*prepared);
+      prepared_queue_.push(prepared, /*block=*/true);
+    } else {
+      releasePreparedFrame(prepared);
     }
-    morefusion_ros::ObjectClass cls;
-    cls.instance_id = it->first;
-    cls.class_id = it->second;
-    cls.confidence = 1;
-    cls_rend_msg.classes.push_back(cls);
   }
-  pub_class_.publish(cls_rend_msg);
+}
 
-  // Update Map
-  insertScan(sensorToWorldTf.getOrigin(), pc, label_ins, instance_id_to_class_id);
+void OctomapServer::integrateLoop() {
+  PreparedFramePtr prepared;
+  while (prepared_queue_.pop(&prepared)) {
+    integrateFrame(prepared.get());
+    releasePreparedFrame(prepared);
+    prepared.reset();
+  }
+}
 
-  // Publish Object Grids
-  std::set<int> instance_ids_active = morefusion_ros::utils::unique<int>(label_ins_rend);
-  publishGrids(cloud->header.stamp, sensorToWorld, instance_ids_active);
+void OctomapServer::publishLoop() {
+  MapSnapshotConstPtr map;
+  while (snapshot_queue_.pop(&map)) {
+    {
+      morefusion_ros::utils::ScopedTimer timer(stats_.get(), "publish_all");
+      publishAll(*map);
+    }
+    map.reset();
+  }
+}
 
-  // Publish Map
-  publishAll(cloud->header.stamp);
+OctomapServer::PreparedFramePtr OctomapServer::takePreparedFrame() {
+  boost::mutex::scoped_lock lock(prepared_pool_mutex_);
+  if (prepared_pool_.empty()) {
+    return PreparedFramePtr(new PreparedFrame);
+  }
+  PreparedFramePtr prepared = prepared_pool_.back();
+  prepared_pool_.pop_back();
+  return prepared;
 }
 
-void OctomapServer::render(
-    const sensor_msgs::CameraInfoConstPtr& camera_info_msg,
-    const tf::Point& sensorOriginTf,
-    const PCLPointCloud& pc,
-    cv::Mat& label_ins_rend,
-    const Eigen::Matrix4f sensorToWorld) {
-  octomap::point3d sensorOrigin = octomap::pointTfToOctomap(sensorOriginTf);
-  std::vector<int> instance_ids = morefusion_ros::utils::keys(octrees_);
-  cv::Mat depth = cv::Mat::zeros(pc.height, pc.width, CV_32FC1);
-  depth.setTo(NAN);
-  label_ins_rend.setTo(-2);
-  #pragma omp parallel for
-  for(int instance_id_index = 0; instance_id_index < instance_ids.size(); instance_id_index++){
-    int instance_id = instance_ids[instance_id_index];
-  ///for each(int instance_id in instance_ids) {
-  ///fonte: https://www.w3schools.com/cpp/cpp_for_loop.asp e https://stackoverflow.com/questions/20531335/compilation-error-with-for-each-loop-in-c-vs2010
-  ///for (int instance_id : instance_ids) {
-    if (instance_id == -1) {
-      // skip background objects
-      continue;
+void OctomapServer::releasePreparedFrame(const PreparedFramePtr& prepared) {
+  // the images borrow the buffers of the messages
+  prepared->msgs = Frame();
+  prepared->depth.release();
+  prepared->label_ins.release();
+  prepared->camera_rays.reset();
+  boost::mutex::scoped_lock lock(prepared_pool_mutex_);
+  // one frame per stage and one queued are in flight at most
+  if (prepared_pool_.size() < 3) {
+    prepared_pool_.push_back(prepared);
+  }
+}
+
+bool OctomapServer::prepareFrame(const Frame& frame, PreparedFrame* prepared) {
+  const sensor_msgs::CameraInfoConstPtr& camera_info_msg = frame.camera_info;
+  const sensor_msgs::ImageConstPtr& depth_msg = frame.depth;
+  const sensor_msgs::PointCloud2ConstPtr& cloud = frame.cloud;
+  const sensor_msgs::ImageConstPtr& ins_msg = frame.ins;
+  prepared->msgs = frame;
+  if (cloud) {
+    prepared->header = cloud->header;
+    prepared->width = cloud->width;
+    prepared->height = cloud->height;
+  } else {
+    if (depth_msg->encoding != sensor_msgs::image_encodings::TYPE_16UC1 &&
+        depth_msg->encoding != sensor_msgs::image_encodings::TYPE_32FC1) {
+      ROS_ERROR("Unsupported depth encoding: %s", depth_msg->encoding.c_str());
+      return false;
     }
-    OcTreeT* octree = octrees_.find(instance_id)->second;
+    prepared->header = depth_msg->header;
+    prepared->width = depth_msg->width;
+    prepared->height = depth_msg->height;
+  }
+  const std_msgs::Header& header = prepared->header;
 
-    for (size_t index = 0 ; index < pc.points.size(); index++) {
-      int width_index = index % pc.width;
-      int height_index = index / pc.width;
-      if (width_index % 2 != 0 || height_index % 2 != 0) {
-        continue;
-      }
+  // Get TF
+  {
+    morefusion_ros::utils::ScopedTimer timer(stats_.get(), "tf");
+    if (!tf_listener_->waitForTransform(frame_id_world_,
+                                        header.frame_id,
+                                        header.stamp,
+                                        ros::Duration(0.1))) {
+      return false;
+    }
+    tf_listener_->lookupTransform(
+      frame_id_world_, header.frame_id, header.stamp, prepared->sensorToWorldTf);
+  }
+  Eigen::Matrix4f sensorToWorld;
+  pcl_ros::transformAsMatrix(prepared->sensorToWorldTf, sensorToWorld);
+
+  morefusion_ros::utils::ScopedTimer timer(stats_.get(), "convert");
+
+  // Pixel rays: recomputed only when the intrinsics change, rotated per pixel
+  float fx = camera_info_msg->K[0];
+  float fy = camera_info_msg->K[4];
+  float cx = camera_info_msg->K[2];
+  float cy = camera_info_msg->K[5];
+  int width = camera_info_msg->width;
+  int height = camera_info_msg->height;
+  if (!camera_rays_ || !camera_rays_->matches(fx, fy, cx, cy, width, height)) {
+    // frames in flight keep the previous rays
+    boost::shared_ptr<morefusion_ros::utils::CameraRays> camera_rays(
+      new morefusion_ros::utils::CameraRays);
+    camera_rays->update(fx, fy, cx, cy, width, height);
+    camera_rays_ = camera_rays;
+  }
+  if (width != prepared->width || height != prepared->height) {
+    ROS_ERROR("Size mismatch between camera_info (%dx%d) and %s (%dx%d)",
+              width, height, cloud ? "points" : "depth", prepared->width, prepared->height);
+    return false;
+  }
+  prepared->fx = fx;
+  prepared->fy = fy;
+  prepared->cx = cx;
+  prepared->cy = cy;
+  prepared->camera_rays = camera_rays_;
+  prepared->setPose(sensorToWorld);
+
+  if (cloud) {
+    // ROSMsg -> PCL
+    pcl::fromROSMsg(*cloud, prepared->pc);
+
+    // Transform pointcloud: sensor -> world (map)
+    pcl::transformPointCloud(prepared->pc, prepared->pc, prepared->sensorToWorld);
+  } else {
+    // Points are back-projected per pixel by PreparedFrame::getPoint. The image
+    // stays valid as prepared->msgs holds the message.
+    prepared->pc.clear();
+    prepared->depth = cv_bridge::toCvShare(depth_msg, depth_msg->encoding)->image;
+  }
 
-      bool check_in_bbox;
-      octomap::point3d point;
-      if (std::isnan(pc.points[index].x) ||
-          std::isnan(pc.points[index].y) ||
-          std::isnan(pc.points[index].z)) {
-        float fx = camera_info_msg->K[0];
-        float fy = camera_info_msg->K[4];
-        float cx = camera_info_msg->K[2];
-        float cy = camera_info_msg->K[5];
-
-        float z = 1;  // max depth
-        float x = z * (width_index - cx) / fx;
-        float y = z * (height_index - cy) / fy;
-        PCLPointCloud pc2;
-        pc2.push_back(PCLPoint(x, y, z));
-        pcl::transformPointCloud(pc2, pc2, sensorToWorld);
-
-        check_in_bbox = false;
-        point = octomap::point3d(pc2[0].x, pc2[0].y, pc2[0].z);
-      } else {
-        check_in_bbox = true;
-        point = octomap::point3d(pc.points[index].x, pc.points[index].y, pc.points[index].z);
-      }
+  // ROSMsg -> OpenCV, borrowing the buffer of the message held by prepared->msgs
+  prepared->label_ins = cv_bridge::toCvShare(ins_msg, ins_msg->encoding)->image;
+  return true;
+}
 
-      octomap::point3d direction = point - sensorOrigin;
+void OctomapServer::recordFrame(const PreparedFrame& prepared) {
+  // the no-entry config that the integrate stage applies before this frame,
+  // unless it changes in between. Read before locking recorder_mutex_, which
+  // resetCallback locks inside requests_mutex_.
+  bool ground_as_noentry;
+  bool free_as_noentry;
+  {
+    boost::mutex::scoped_lock lock(requests_mutex_);
+    ground_as_noentry = config_.ground_as_noentry;
+    free_as_noentry = config_.free_as_noentry;
+  }
 
-      if (check_in_bbox && !octree->inBBX(point)) {
-        continue;
-      }
+  boost::mutex::scoped_lock lock(recorder_mutex_);
+  if (!recorder_) {
+    return;
+  }
+  morefusion_ros::utils::ScopedTimer timer(stats_.get(), "record");
+
+  // the depth is recorded even if the points are integrated
+  cv::Mat depth = prepared.depth;
+  const sensor_msgs::ImageConstPtr& depth_msg = prepared.msgs.depth;
+  if (depth.empty() &&
+      (depth_msg->encoding == sensor_msgs::image_encodings::TYPE_16UC1 ||
+       depth_msg->encoding == sensor_msgs::image_encodings::TYPE_32FC1)) {
+    depth = cv_bridge::toCvShare(depth_msg, depth_msg->encoding)->image;
+  }
 
-      octomap::point3d end;
-      bool hit = octree->castRay(/*origin=*/sensorOrigin, /*direction=*/direction, /*end=*/end, /*ignoreUnknownCells=*/true, /*maxRange=*/(point - sensorOrigin).norm() * 1.1);
-      if (!hit) {
-        continue;
-      }
+  const morefusion_ros::ObjectClassArrayConstPtr& class_msg = prepared.msgs.cls;
+  std::vector<FrameLogClass> classes(class_msg->classes.size());
+  for (size_t i = 0; i < class_msg->classes.size(); i++) {
+    classes[i].instance_id = class_msg->classes[i].instance_id;
+    classes[i].class_id = class_msg->classes[i].class_id;
+    classes[i].confidence = class_msg->classes[i].confidence;
+  }
 
-      octomap::point3d intersection;
-#if 0
-      octree->getRayIntersection(/*origin=*/sensorOrigin, /*direction=*/direction, /*center=*/end, /*intersection=*/intersection);
-#else
-      intersection = end;
-#endif
-
-      #pragma omp critical
-      {
-        float d_old = depth.at<float>(height_index, width_index);
-        float d_new = (intersection - sensorOrigin).norm();
-        if ((d_old != d_old) || (d_new < d_old)) {
-          depth.at<float>(height_index, width_index) = d_new;
-          for (int dj = -1; dj != 1; dj++) {
-            int j = height_index + dj;
-            for (int di = -1; di != 1; di++) {
-              int i = width_index + di;
-              if (j >= 0 && i >= 0 && j < label_ins_rend.rows && i < label_ins_rend.cols) {
-                label_ins_rend.at<int32_t>(j, i) = instance_id;
-              }
-            }
-          }
-        }
-      }
-    }
+  if (!recorder_->write(prepared.header.stamp.toNSec(), prepared, depth, classes,
+                        ground_as_noentry, free_as_noentry)) {
+    ROS_ERROR("Can't record the frame at %f, so stopped recording",
+              prepared.header.stamp.toSec());
+    recorder_.reset();
   }
 }
 
-void OctomapServer::insertScan(
-    const tf::Point& sensorOriginTf,
-    const PCLPointCloud& pc,
-    const cv::Mat& label_ins,
-    const std::map<int, unsigned>& instance_id_to_class_id) {
-  octomap::point3d sensorOrigin = octomap::pointTfToOctomap(sensorOriginTf);
-
-  std::set<int> instance_ids = morefusion_ros::utils::unique<int>(label_ins);
-  octomap::KeySet free_cells_bg;
-  std::map<int, octomap::KeySet> occupied_cells;
-  std::set<int> new_instance_ids;
-  for (int instance_id : instance_ids) {
-    if (instance_id == -2) {
-      // -1: background, -2: uncertain (e.g., boundary)
-      continue;
+void OctomapServer::integrateFrame(PreparedFrame* prepared) {
+  const sensor_msgs::CameraInfoConstPtr& camera_info_msg = prepared->msgs.camera_info;
+  const sensor_msgs::ImageConstPtr& depth_msg = prepared->msgs.depth;
+  const sensor_msgs::ImageConstPtr& ins_msg = prepared->msgs.ins;
+  const morefusion_ros::ObjectClassArrayConstPtr& class_msg = prepared->msgs.cls;
+  const std_msgs::Header& header = prepared->header;
+  const tf::StampedTransform& sensorToWorldTf = prepared->sensorToWorldTf;
+
+  applyRequests();
+  {
+    boost::mutex::scoped_lock lock(requests_mutex_);
+    if (camera_info_msg->header.stamp < reset_stamp_) {
+      return;
     }
-    unsigned class_id = 0;
-    double pitch = resolution_;
-    if (instance_id >= 0) {
-      if (instance_id_to_class_id.find(instance_id) == instance_id_to_class_id.end()) {
-        ROS_FATAL("Can't find instance_id [%d] in instance_id_to_class_id", instance_id);
-        return;
-      } else {
-        class_id = instance_id_to_class_id.find(instance_id)->second;
-      }
-      pitch = morefusion_ros::utils::class_id_to_voxel_pitch(class_id);
-    }
-    if (octrees_.find(instance_id) == octrees_.end()) {
-      OcTreeT* octree = new OcTreeT(pitch);
-      octree->setProbHit(probability_hit_);
-      octree->setProbMiss(probability_miss_);
-      octree->setClampingThresMin(probability_min_);
-      octree->setClampingThresMax(probability_max_);
-      octrees_.insert(std::make_pair(instance_id, octree));
-      class_ids_.insert(std::make_pair(instance_id, class_id));
-      new_instance_ids.insert(instance_id);
-    }
-    occupied_cells.insert(std::make_pair(instance_id, octomap::KeySet()));
-  }
-  assert(octrees_.find(-1) != octrees_.end());
-  assert(occupied_cells.find(-1) != occupied_cells.end());
-
-  // all other points: free on ray, occupied on endpoint:
-  std::map<int, PCLPointCloud> instance_id_to_points;
-  #pragma omp parallel for
-  for (size_t index = 0 ; index < pc.points.size(); index++) {
-    size_t width_index = index % pc.width;
-    size_t height_index = index / pc.width;
-    if (width_index % 2 != 0 || height_index % 2 != 0) {
-      continue;
+  }
+  morefusion_ros::utils::ScopedTimer timer(stats_.get(), "integrate");
+
+  // Labels are tracked in place, so copy them from the message into the workspace
+  cv::Mat& label_ins = label_ins_tracked_;
+  prepared->label_ins.copyTo(label_ins);
+
+  // Render here rather than in MultiInstanceMapping::integrate, as it may be
+  // done by the render service and the labels are published before tracking
+  cv::Mat& label_ins_rend = label_ins_rend_;
+  {
+    morefusion_ros::utils::ScopedTimer timer_render(stats_.get(), "render");
+    if (use_render_service_) {
+      morefusion_ros::RenderVoxelGridArray srv;
+      tf::transformStampedTFToMsg(sensorToWorldTf, srv.request.transform);
+      srv.request.camera_info = *camera_info_msg;
+      srv.request.depth = *depth_msg;
+      getGridsInWorldFrame(camera_info_msg->header.stamp, srv.request.grids);
+      client_render_.call(srv);
+      cv_bridge::toCvShare(
+        srv.response.label_ins, boost::shared_ptr<void const>(),
+        srv.response.label_ins.encoding)->image.copyTo(label_ins_rend);
+    } else {
+      mapping_->render(*prepared, label_ins_rend);
     }
-    if (std::isnan(pc.points[index].x) ||
-        std::isnan(pc.points[index].y) ||
-        std::isnan(pc.points[index].z)) {
+  }
+  // Publish Rendered Instance Label
+  if (pub_label_rendered_.getNumSubscribers() > 0) {
+    pub_label_rendered_.publish(
+      cv_bridge::CvImage(ins_msg->header, "32SC1", label_ins_rend).toImageMsg());
+  }
+
+  // Classes of the map before the frame, for the tracked labels
+  morefusion_ros::ObjectClassArray cls_rend_msg;
+  cls_rend_msg.header = header;
+  const std::map<int, unsigned>& class_ids = mapping_->classIds();
+  for (std::map<int, unsigned>::const_iterator it = class_ids.begin();
+       it != class_ids.end(); it++) {
+    if (it->first == -1) {
       continue;
     }
+    morefusion_ros::ObjectClass cls;
+    cls.instance_id = it->first;
+    cls.class_id = it->second;
+    cls.confidence = 1;
+    cls_rend_msg.classes.push_back(cls);
+  }
 
-    octomap::point3d point(pc.points[index].x, pc.points[index].y, pc.points[index].z);
-    int instance_id = label_ins.at<int32_t>(height_index, width_index);
+  // Track Instance IDs and Update Map
+  std::map<int, unsigned> instance_id_to_class_id;
+  for (size_t i = 0; i < class_msg->classes.size(); i++) {
+    instance_id_to_class_id.insert(
+      std::make_pair(
+        class_msg->classes[i].instance_id,
+        class_msg->classes[i].class_id));
+  }
+  if (!mapping_->integrate(*prepared, label_ins, &instance_id_to_class_id, label_ins_rend,
+                           /*render=*/false)) {
+    ROS_FATAL("Can't find the class of an instance in the frame at %f", header.stamp.toSec());
+  }
 
-    #pragma omp critical
-    if (instance_id != -2) {
-      if (instance_id_to_points.find(instance_id) == instance_id_to_points.end()) {
-        instance_id_to_points.insert(std::make_pair(instance_id, PCLPointCloud()));
-      } else {
-        instance_id_to_points.find(instance_id)->second.push_back(pc.points[index]);
-      }
-    }
+  // Publish Tracked Instance Label
+  if (pub_label_tracked_.getNumSubscribers() > 0) {
+    pub_label_tracked_.publish(
+      cv_bridge::CvImage(ins_msg->header, "32SC1", label_ins).toImageMsg());
+  }
+  pub_class_.publish(cls_rend_msg);
 
-    // maxrange check
-    if ((max_range_ < 0.0) || ((point - sensorOrigin).norm() <= max_range_)) {
-      // free cells
-      octomap::KeyRay key_ray;
-      OcTreeT* octree_bg = octrees_.find(-1)->second;
-      if (octree_bg->computeRayKeys(sensorOrigin, point, key_ray)) {
-        #pragma omp critical
-        free_cells_bg.insert(key_ray.begin(), key_ray.end());
-      }
-      // occupied endpoint
-      octomap::OcTreeKey key;
-      if (instance_id != -2) {
-        if (octrees_.find(instance_id)->second->coordToKeyChecked(point, key)) {
-          #pragma omp critical
-          occupied_cells.find(instance_id)->second.insert(key);
-        }
-      }
-      if (instance_id != -1) {
-        if (octree_bg->coordToKeyChecked(point, key)) {
-          #pragma omp critical
-          free_cells_bg.insert(key);
-        }
-      }
-    } else {  // ray longer than maxrange:;
-      octomap::point3d new_end = sensorOrigin + (point - sensorOrigin).normalized() * max_range_;
-      octomap::KeyRay key_ray;
-      OcTreeT* octree_bg = octrees_.find(-1)->second;
-      if (octree_bg->computeRayKeys(sensorOrigin, new_end, key_ray)) {
-        #pragma omp critical
-        free_cells_bg.insert(key_ray.begin(), key_ray.end());
-      }
-    }
+  // Publish Object Grids
+  {
+    morefusion_ros::utils::ScopedTimer timer_grids(stats_.get(), "publish_grids");
+    publishGrids(header.stamp);
+  }
+  if (stats_) {
+    // from the capture to the grids, the output of the frame
+    stats_->record("end_to_end", (ros::Time::now() - camera_info_msg->header.stamp).toSec());
   }
 
-  OcTreeT* octree_bg = octrees_.find(-1)->second;
-  octomap::KeySet occupied_cells_bg = occupied_cells.find(-1)->second;
-  for (octomap::KeySet::iterator it = free_cells_bg.begin(); it != free_cells_bg.end(); it++) {
-    if (occupied_cells_bg.find(*it) == occupied_cells_bg.end()) {
-      octree_bg->updateNode(*it, false);
-    }
+  // Snapshot the map only for its consumers, as copying the octrees is costly
+  const std::set<int>& instance_ids_updated = mapping_->instanceIdsUpdated();
+  instance_ids_stale_.insert(instance_ids_updated.begin(), instance_ids_updated.end());
+  bool is_map_subscribed = isMapSubscribed();
+  if (is_map_subscribed || snapshot_requested_) {
+    morefusion_ros::utils::ScopedTimer timer_snapshot(stats_.get(), "update_snapshot");
+    updateSnapshot(header.stamp);
   }
 
-  for (std::map<int, octomap::KeySet>::iterator i = occupied_cells.begin();
-       i != occupied_cells.end(); i++) {
-    int instance_id = i->first;
-    octomap::KeySet key_set_occupied = i->second;
-    OcTreeT* octree = octrees_.find(instance_id)->second;
-    for (octomap::KeySet::iterator j = key_set_occupied.begin(); j != key_set_occupied.end(); j++) {
-      octree->updateNode(*j, true);
-    }
+  // Publish Map: markers and octomap are built from the snapshot in the publish
+  // stage, which is skipped while it is still busy with the previous one
+  if (is_map_subscribed && (snapshot_queue_.size() == 0)) {
+    snapshot_queue_.push(boost::atomic_load(&snapshot_), /*block=*/false);
   }
+}
 
-  for (std::map<int, PCLPointCloud>::iterator it = instance_id_to_points.begin();
-       it != instance_id_to_points.end(); it++) {
-    int instance_id = it->first;
-    PCLPointCloud points = it->second;
-    OcTreeT* octree = octrees_.find(instance_id)->second;
-
-    PCLPoint min_pt, max_pt;
-    pcl::getMinMax3D(points, min_pt, max_pt);
-
-    float min_x, min_y, min_z;
-    float max_x, max_y, max_z;
-    if (new_instance_ids.find(instance_id) == new_instance_ids.end()) {
-      // not new instance
-      octomap::point3d min_bbx = octree->getBBXMin();
-      octomap::point3d max_bbx = octree->getBBXMax();
-      min_x = std::min(min_bbx.x(), min_pt.x);
-      min_y = std::min(min_bbx.y(), min_pt.y);
-      min_z = std::min(min_bbx.z(), min_pt.z);
-      max_x = std::max(max_bbx.x(), max_pt.x);
-      max_y = std::max(max_bbx.y(), max_pt.y);
-      max_z = std::max(max_bbx.z(), max_pt.z);
-    } else {
-      min_x = min_pt.x;
-      min_y = min_pt.y;
-      min_z = min_pt.z;
-      max_x = max_pt.x;
-      max_y = max_pt.y;
-      max_z = max_pt.z;
-    }
+bool OctomapServer::isMapSubscribed() const {
+  return (pub_markers_free_.getNumSubscribers() > 0) ||
+         (pub_markers_bg_.getNumSubscribers() > 0) ||
+         (pub_markers_fg_.getNumSubscribers() > 0) ||
+         (pub_binary_map_.getNumSubscribers() > 0) ||
+         (pub_full_map_.getNumSubscribers() > 0);
+}
 
-    octomap::point3d bbx_min(min_x, min_y, min_z);
-    octomap::point3d bbx_max(max_x, max_y, max_z);
-    octree->setBBXMin(bbx_min);
-    octree->setBBXMax(bbx_max);
-
-#if 0
-    centers_.insert(std::make_pair(instance_id, octree->getBBXCenter()));
-#else
-    Eigen::Matrix<float, 4, 1> centroid;
-    pcl::compute3DCentroid<PCLPoint, float>(
-      /*cloud=*/it->second, /*centroid=*/centroid);
-    octomap::point3d center(centroid(0, 0), centroid(1, 0), centroid(2, 0));
-    centers_.insert(std::make_pair(instance_id, center));
-#endif
-  }
-
-  if (do_compress_map_) {
-    for (std::map<int, OcTreeT*>::iterator it = octrees_.begin(); it != octrees_.end(); it++) {
-      it->second->prune();
+void OctomapServer::updateSnapshot(const ros::Time& rostime) {
+  // before copying, so that a request during the copy is not lost
+  snapshot_requested_ = false;
+  MapSnapshotConstPtr map_prev = boost::atomic_load(&snapshot_);
+  boost::shared_ptr<MapSnapshot> map(new MapSnapshot);
+  map->stamp = rostime;
+  const std::map<int, OcTreeT*>& octrees = mapping_->octrees();
+  bool is_fg_updated = false;
+  for (std::map<int, OcTreeT*>::const_iterator it = octrees.begin();
+       it != octrees.end(); it++) {
+    const int instance_id = it->first;
+    if (instance_ids_stale_.find(instance_id) == instance_ids_stale_.end()) {
+      std::map<int, boost::shared_ptr<const OcTreeT> >::const_iterator it_prev =
+        map_prev->octrees.find(instance_id);
+      if (it_prev != map_prev->octrees.end()) {
+        map->octrees.insert(*it_prev);
+        continue;
+      }
     }
+    map->octrees.insert(std::make_pair(instance_id, boost::make_shared<OcTreeT>(*it->second)));
+    is_fg_updated = is_fg_updated || (instance_id != -1);
+  }
+  if (is_fg_updated || !map_prev->instance_index) {
+    map->instance_index =
+      boost::make_shared<morefusion_ros::utils::InstanceVoxelIndex>(mapping_->instanceIndex());
+  } else {
+    map->instance_index = map_prev->instance_index;
+  }
+  instance_ids_stale_.clear();
+
+  boost::mutex::scoped_lock lock(requests_mutex_);
+  if (!reset_requested_) {
+    boost::atomic_store(&snapshot_, MapSnapshotConstPtr(map));
   }
 }
 
+void OctomapServer::gridToMsg(
+    const MultiInstanceMapping::Grid& grid,
+    morefusion_ros::VoxelGrid* grid_msg) {
+  grid_msg->origin.x = grid.origin(0);
+  grid_msg->origin.y = grid.origin(1);
+  grid_msg->origin.z = grid.origin(2);
+  grid_msg->pitch = grid.pitch;
+  grid_msg->dims.x = grid.dims[0];
+  grid_msg->dims.y = grid.dims[1];
+  grid_msg->dims.z = grid.dims[2];
+  grid_msg->instance_id = grid.instance_id;
+  grid_msg->class_id = grid.class_id;
+  grid_msg->indices = grid.indices;
+  grid_msg->values = grid.values;
+}
+
 void OctomapServer::getGridsInWorldFrame(
     const ros::Time& rostime,
     morefusion_ros::VoxelGridArray& grids) {
   grids.header.frame_id = frame_id_world_;
   grids.header.stamp = rostime;
-  for (std::map<int, OcTreeT*>::iterator it_octree = octrees_.begin();
-       it_octree != octrees_.end(); it_octree++) {
-    int instance_id = it_octree->first;
-    OcTreeT* octree = it_octree->second;
-
-    if (instance_id == -1) {
-      continue;
-    }
-    unsigned class_id = class_ids_.find(instance_id)->second;
-    double pitch = morefusion_ros::utils::class_id_to_voxel_pitch(class_id);
-
-    // world frame
-    octomap::point3d center = centers_.find(instance_id)->second;
-
-    morefusion_ros::VoxelGrid grid;
-    grid.pitch = pitch;
-    grid.dims.x = 32;
-    grid.dims.y = 32;
-    grid.dims.z = 32;
-    grid.origin.x = center.x() - (grid.dims.x / 2.0 - 0.5) * grid.pitch;
-    grid.origin.y = center.y() - (grid.dims.y / 2.0 - 0.5) * grid.pitch;
-    grid.origin.z = center.z() - (grid.dims.z / 2.0 - 0.5) * grid.pitch;
-    grid.instance_id = instance_id;
-    grid.class_id = class_id;
-
-    for (size_t i = 0; i < grid.dims.x; i++) {
-      for (size_t j = 0; j < grid.dims.y; j++) {
-        for (size_t k = 0; k < grid.dims.z; k++) {
-          double x, y, z;
-          // in world
-          x = grid.origin.x + grid.pitch * i;
-          y = grid.origin.y + grid.pitch * j;
-          z = grid.origin.z + grid.pitch * k;
-
-          size_t index = i * grid.dims.y * grid.dims.z + j * grid.dims.z + k;
-
-          octomap::OcTreeNode* node = octree->search(x, y, z, /*depth=*/0);
-          if ((node != NULL) && (node->getOccupancy() > 0.5)) {
-            grid.indices.push_back(index);
-            grid.values.push_back(node->getOccupancy());
-          }
-        }
-      }
-    }
-    grids.grids.push_back(grid);
+  std::vector<MultiInstanceMapping::Grid> grids_world;
+  mapping_->getGridsInWorldFrame(&grids_world);
+  grids.grids.resize(grids_world.size());
+  for (size_t i = 0; i < grids_world.size(); i++) {
+    gridToMsg(grids_world[i], &grids.grids[i]);
   }
 }
 
-void OctomapServer::publishGrids(
-    const ros::Time& rostime,
-    const Eigen::Matrix4f& sensorToWorld,
-    const std::set<int>& instance_ids_active) {
-  if (octrees_.size() == 0) {
+void OctomapServer::publishGrids(const ros::Time& rostime) {
+  if (mapping_->octrees().size() == 0) {
+    return;
+  }
+
+  // dense (VoxelGrid) and compact (CompactVoxelGrid) grids are published on
+  // demand, so subscribers opt in to either format by choosing the topic.
+  bool publishDense = pub_grids_.getNumSubscribers() > 0 ||
+                      pub_grids_noentry_.getNumSubscribers() > 0;
+  bool publishCompact = pub_grids_compact_.getNumSubscribers() > 0 ||
+                        pub_grids_noentry_compact_.getNumSubscribers() > 0;
+  if (!publishDense && !publishCompact) {
     return;
   }
 
@@ -524,107 +663,49 @@ void OctomapServer::publishGrids(
   grids.header.stamp = rostime;
   morefusion_ros::VoxelGridArray grids_noentry;
   grids_noentry.header = grids.header;
-  for (std::map<int, OcTreeT*>::iterator it_octree = octrees_.begin();
-       it_octree != octrees_.end(); it_octree++) {
-    int instance_id = it_octree->first;
-    if (instance_id == -1) {
-      continue;
-    }
-    //if (instance_ids_active.find(instance_id) == instance_ids_active.end()) {
-    //  // inactive
-    //  continue;
-    //}
-
-    OcTreeT* octree = it_octree->second;
-    unsigned class_id = class_ids_.find(instance_id)->second;
-    double pitch = morefusion_ros::utils::class_id_to_voxel_pitch(class_id);
-
-    octomap::point3d center = centers_.find(instance_id)->second;
-
-    PCLPointCloud center_sensor;
-    center_sensor.push_back(PCLPoint(center.x(), center.y(), center.z()));
-    pcl::transformPointCloud(center_sensor, center_sensor, sensorToWorld.inverse());
-
+  morefusion_ros::CompactVoxelGridArray grids_compact;
+  grids_compact.header = grids.header;
+  morefusion_ros::CompactVoxelGridArray grids_noentry_compact;
+  grids_noentry_compact.header = grids.header;
+  size_t voxels_emitted = 0;
+  const std::map<int, MultiInstanceMapping::GridCache>& grids_cache = mapping_->gridsCache();
+  for (std::map<int, MultiInstanceMapping::GridCache>::const_iterator it_cache =
+         grids_cache.begin(); it_cache != grids_cache.end(); it_cache++) {
     morefusion_ros::VoxelGrid grid;
-    grid.pitch = pitch;
-    grid.dims.x = 32;
-    grid.dims.y = 32;
-    grid.dims.z = 32;
-    grid.origin.x = center_sensor.points[0].x - (grid.dims.x / 2.0 - 0.5) * grid.pitch;
-    grid.origin.y = center_sensor.points[0].y - (grid.dims.y / 2.0 - 0.5) * grid.pitch;
-    grid.origin.z = center_sensor.points[0].z - (grid.dims.z / 2.0 - 0.5) * grid.pitch;
-    grid.instance_id = instance_id;
-    grid.class_id = class_id;
-
     morefusion_ros::VoxelGrid grid_noentry;
-    grid_noentry.pitch = grid.pitch;
-    grid_noentry.dims = grid.dims;
-    grid_noentry.origin = grid.origin;
-    grid_noentry.instance_id = grid.instance_id;
-    grid_noentry.class_id = grid.class_id;
-    for (size_t i = 0; i < grid.dims.x; i++) {
-      for (size_t j = 0; j < grid.dims.y; j++) {
-        for (size_t k = 0; k < grid.dims.z; k++) {
-          double x, y, z;
-          // in sensor
-          x = grid.origin.x + grid.pitch * i;
-          y = grid.origin.y + grid.pitch * j;
-          z = grid.origin.z + grid.pitch * k;
-
-          // in world
-          PCLPointCloud p_world;
-          p_world.push_back(PCLPoint(x, y, z));  // sensor
-          pcl::transformPointCloud(p_world, p_world, sensorToWorld);
-          x = p_world.points[0].x;
-          y = p_world.points[0].y;
-          z = p_world.points[0].z;
-
-          size_t index = i * grid.dims.y * grid.dims.z + j * grid.dims.z + k;
-          if (m_groundAsNoEntry && (z < 0)) {
-            grid_noentry.indices.push_back(index);
-            grid_noentry.values.push_back(probability_max_);
-            continue;
-          }
-
-          octomap::OcTreeNode* node = octree->search(x, y, z, /*depth=*/0);
-          if ((node != NULL) && (node->getOccupancy() > 0.5)) {
-            grid.indices.push_back(index);
-            grid.values.push_back(node->getOccupancy());
-          } else {
-            for (std::map<int, OcTreeT*>::iterator it_octree_other = octrees_.begin();
-                 it_octree_other != octrees_.end(); it_octree_other++) {
-              if (it_octree_other->first == instance_id) {
-                continue;
-              }
-              OcTreeT* octree_other = it_octree_other->second;
-              node = octree_other->search(x, y, z, /*depth=*/0);
-              if (node != NULL) {
-                double occupancy = node->getOccupancy();
-                if ((it_octree_other->first == -1) &&
-                    m_freeAsNoEntry && (occupancy < 0.5)) {
-                  grid_noentry.indices.push_back(index);
-                  grid_noentry.values.push_back(1 - occupancy);
-                } else if (occupancy >= probability_max_) {
-                  grid_noentry.indices.push_back(index);
-                  grid_noentry.values.push_back(occupancy);
-                }
-              }
-            }
-          }
-        }
-      }
+    gridToMsg(it_cache->second.grid, &grid);
+    gridToMsg(it_cache->second.grid_noentry, &grid_noentry);
+    voxels_emitted += grid.values.size() + grid_noentry.values.size();
+    if (publishCompact) {
+      grids_compact.grids.push_back(morefusion_ros::CompactVoxelGrid());
+      morefusion_ros::utils::pack_voxel_grid(grid, &grids_compact.grids.back());
+      grids_noentry_compact.grids.push_back(morefusion_ros::CompactVoxelGrid());
+      morefusion_ros::utils::pack_voxel_grid(grid_noentry, &grids_noentry_compact.grids.back());
+    }
+    if (publishDense) {
+      grids.grids.push_back(std::move(grid));
+      grids_noentry.grids.push_back(std::move(grid_noentry));
     }
-    grids.grids.push_back(grid);
-    grids_noentry.grids.push_back(grid_noentry);
   }
-  pub_grids_.publish(grids);
-  pub_grids_noentry_.publish(grids_noentry);
+  if (publishDense) {
+    pub_grids_.publish(grids);
+    pub_grids_noentry_.publish(grids_noentry);
+  }
+  if (publishCompact) {
+    pub_grids_compact_.publish(grids_compact);
+    pub_grids_noentry_compact_.publish(grids_noentry_compact);
+  }
+  if (stats_) {
+    stats_->set("grid_voxels_emitted", voxels_emitted);
+  }
 }
 
-void OctomapServer::publishAll(const ros::Time& rostime) {
-  if (octrees_.size() == 0) {
+void OctomapServer::publishAll(const MapSnapshot& map) {
+  if (map.octrees.size() == 0) {
     return;
   }
+  const ros::Time& rostime = map.stamp;
+  const OcTreeT& octree_bg = *map.octrees.find(-1)->second;
 
   bool publishFreeMarkerArray = pub_markers_free_.getNumSubscribers() > 0;
   bool publishMarkerArray = pub_markers_bg_.getNumSubscribers() > 0 ||
@@ -642,15 +723,16 @@ void OctomapServer::publishAll(const ros::Time& rostime) {
 
   // now, traverse all leafs in the tree:
   std::map<int, visualization_msgs::MarkerArray> occupiedNodesVisAll;
-  for (std::map<int, OcTreeT*>::iterator it_octree = octrees_.begin();
-       it_octree != octrees_.end(); it_octree++) {
+  std::vector<morefusion_ros::utils::InstanceVoxelIndex::Entry> entries_fg;
+  for (std::map<int, boost::shared_ptr<const OcTreeT> >::const_iterator it_octree =
+         map.octrees.begin(); it_octree != map.octrees.end(); it_octree++) {
     // init markers:
     visualization_msgs::MarkerArray occupiedNodesVis;
     // each array stores all cubes of a different size, one for each depth level:
     occupiedNodesVis.markers.resize(tree_depth_ + 1);
 
     const int instance_id = it_octree->first;
-    OcTreeT* octree = it_octree->second;
+    const OcTreeT* octree = it_octree->second.get();
     for (OcTreeT::iterator it = octree->begin(tree_depth_max_);
          it != octree->end(); it++) {
       if (octree->isNodeOccupied(*it)) {
@@ -661,7 +743,7 @@ void OctomapServer::publishAll(const ros::Time& rostime) {
         // Ignore speckles in the map:
         if (do_filter_speckles_ &&
             (it.getDepth() == tree_depth_ + 1) &&
-            isSpeckleNode(it.getKey())) {
+            MultiInstanceMapping::isSpeckleNode(octree_bg, it.getKey())) {
           continue;
         }  // else: current octree node is no speckle, send it out
 
@@ -669,21 +751,8 @@ void OctomapServer::publishAll(const ros::Time& rostime) {
         double y = it.getY();
         double z = it.getZ();
 
-        if (instance_id == -1) {
-          bool is_occupied_by_fg = false;
-          for (const auto& kv : octrees_) {
-            if (kv.first == -1) {
-              continue;
-            }
-            octomap::OcTreeNode* node = kv.second->search(x, y, z, /*depth=*/0);
-            if ((node != NULL) && (node->getOccupancy() > 0.5)) {
-              is_occupied_by_fg = true;
-              break;
-            }
-          }
-          if (is_occupied_by_fg) {
-            continue;
-          }
+        if ((instance_id == -1) && map.instance_index->isOccupied(x, y, z, &entries_fg)) {
+          continue;
         }
 
         geometry_msgs::Point cubeCenter;
@@ -751,9 +820,8 @@ void OctomapServer::publishAll(const ros::Time& rostime) {
 
   // finish FreeMarkerArray:
   if (publishFreeMarkerArray) {
-    OcTreeT* octree_bg = octrees_.find(-1)->second;
     for (unsigned i= 0; i < freeNodesVis.markers.size(); ++i) {
-      double size = octree_bg->getNodeSize(i);
+      double size = octree_bg.getNodeSize(i);
 
       freeNodesVis.markers[i].header.frame_id = frame_id_world_;
       freeNodesVis.markers[i].header.stamp = rostime;
@@ -780,67 +848,95 @@ void OctomapServer::publishAll(const ros::Time& rostime) {
   }
 
   if (publishBinaryMap) {
-    publishBinaryOctoMap(rostime);
+    publishBinaryOctoMap(map);
   }
 
   if (publishFullMap) {
-    publishFullOctoMap(rostime);
+    publishFullOctoMap(map);
   }
 }
 
 
-void OctomapServer::publishBinaryOctoMap(const ros::Time& rostime) const {
-  Octomap map;
-  map.header.frame_id = frame_id_world_;
-  map.header.stamp = rostime;
-
-  OcTreeT* octree_bg = octrees_.find(-1)->second;
-  if (octomap_msgs::binaryMapToMsg(*octree_bg, map)) {
-    pub_binary_map_.publish(map);
-  } else {
-    ROS_ERROR("Error serializing OctoMap");
+void OctomapServer::publishDiagnostics(const ros::WallTimerEvent& event) {
+  std::map<std::string, morefusion_ros::utils::LatencyHistogram> latencies;
+  std::map<std::string, double> values;
+  stats_->takeWindow(&latencies, &values);
+  ros::WallTime stamp = ros::WallTime::now();
+  double window = (stamp - diagnostics_stamp_).toSec();
+  diagnostics_stamp_ = stamp;
+
+  diagnostic_msgs::DiagnosticStatus status;
+  status.level = diagnostic_msgs::DiagnosticStatus::OK;
+  status.name = pnh_.getNamespace() + ": pipeline";
+  status.hardware_id = frame_id_sensor_;
+  uint64_t frames_integrated = 0;
+  if (latencies.find("integrate") != latencies.end()) {
+    frames_integrated = latencies.find("integrate")->second.count();
+  }
+  char message[64];
+  snprintf(message, sizeof(message), "%" PRIu64 " frames integrated (%.1f fps)",
+           frames_integrated, window > 0 ? frames_integrated / window : 0.0);
+  status.message = message;
+
+  for (std::map<std::string, morefusion_ros::utils::LatencyHistogram>::const_iterator it =
+         latencies.begin(); it != latencies.end(); it++) {
+    const std::string& stage = it->first;
+    const morefusion_ros::utils::LatencyHistogram& histogram = it->second;
+    const double percentiles[] = {0.50, 0.95, 0.99};
+    const char* percentile_names[] = {"p50", "p95", "p99"};
+    for (size_t i = 0; i < 3; i++) {
+      diagnostic_msgs::KeyValue kv;
+      kv.key = stage + "/" + percentile_names[i] + "_ms";
+      kv.value = boost::lexical_cast<std::string>(histogram.percentile(percentiles[i]) * 1e3);
+      status.values.push_back(kv);
+    }
+    diagnostic_msgs::KeyValue kv;
+    kv.key = stage + "/count";
+    kv.value = boost::lexical_cast<std::string>(histogram.count());
+    status.values.push_back(kv);
+    // throughput of the stage over the window, e.g. integrate/rate_hz for the pipeline
+    kv.key = stage + "/rate_hz";
+    kv.value = boost::lexical_cast<std::string>(window > 0 ? histogram.count() / window : 0.0);
+    status.values.push_back(kv);
+  }
+  for (std::map<std::string, double>::const_iterator it = values.begin();
+       it != values.end(); it++) {
+    diagnostic_msgs::KeyValue kv;
+    kv.key = it->first;
+    kv.value = boost::lexical_cast<std::string>(it->second);
+    status.values.push_back(kv);
   }
+
+  diagnostic_msgs::DiagnosticArray msg;
+  msg.header.stamp = ros::Time::now();
+  msg.status.push_back(status);
+  pub_diagnostics_.publish(msg);
 }
 
-void OctomapServer::publishFullOctoMap(const ros::Time& rostime) const {
-  Octomap map;
-  map.header.frame_id = frame_id_world_;
-  map.header.stamp = rostime;
+void OctomapServer::publishBinaryOctoMap(const MapSnapshot& map) const {
+  Octomap map_msg;
+  map_msg.header.frame_id = frame_id_world_;
+  map_msg.header.stamp = map.stamp;
 
-  OcTreeT* octree_bg = octrees_.find(-1)->second;
-  if (octomap_msgs::fullMapToMsg(*octree_bg, map)) {
-    pub_full_map_.publish(map);
+  const OcTreeT& octree_bg = *map.octrees.find(-1)->second;
+  if (octomap_msgs::binaryMapToMsg(octree_bg, map_msg)) {
+    pub_binary_map_.publish(map_msg);
   } else {
     ROS_ERROR("Error serializing OctoMap");
   }
 }
 
-bool OctomapServer::isSpeckleNode(const octomap::OcTreeKey& nKey) const {
-  octomap::OcTreeKey key;
-  bool neighborFound = false;
-  OcTreeT* octree_bg = octrees_.find(-1)->second;
-  for (key[2] = nKey[2] - 1; !neighborFound && key[2] <= nKey[2] + 1; ++key[2]) {
-    for (key[1] = nKey[1] - 1; !neighborFound && key[1] <= nKey[1] + 1; ++key[1]) {
-      for (key[0] = nKey[0] - 1; !neighborFound && key[0] <= nKey[0] + 1; ++key[0]) {
-        if (key != nKey) {
-          octomap::OcTreeNode* node = octree_bg->search(key);
-          if (node && octree_bg->isNodeOccupied(node)) {
-            // we have a neighbor => break!
-            neighborFound = true;
-          }
-        }
-      }
-    }
-  }
+void OctomapServer::publishFullOctoMap(const MapSnapshot& map) const {
+  Octomap map_msg;
+  map_msg.header.frame_id = frame_id_world_;
+  map_msg.header.stamp = map.stamp;
 
-  return neighborFound;
+  const OcTreeT& octree_bg = *map.octrees.find(-1)->second;
+  if (octomap_msgs::fullMapToMsg(octree_bg, map_msg)) {
+    pub_full_map_.publish(map_msg);
+  } else {
+    ROS_ERROR("Error serializing OctoMap");
+  }
 }
 
 }  // namespace morefusion_ros
-
-int main(int argc, char** argv) {
-  ros::init(argc, argv, "octomap_server");
-  morefusion_ros::OctomapServer server;
-  ros::spin();
-  return 0;
-}
@@ -0,0 +1,26 @@
+// Copyright (c) 2019 Kentaro Wada
+
+#include <nodelet/nodelet.h>
+#include <pluginlib/class_list_macros.h>
+
+#include <boost/shared_ptr.hpp>
+
+#include "morefusion_ros/OctomapServer.h"
+
+namespace morefusion_ros {
+
+// OctomapServer in a nodelet manager, e.g., with the camera driver, so that
+// the images and points are passed as shared pointers instead of serialized.
+class OctomapServerNodelet : public nodelet::Nodelet {
+ public:
+  virtual void onInit() {
+    server_.reset(new OctomapServer(getNodeHandle(), getPrivateNodeHandle()));
+  }
+
+ private:
+  boost::shared_ptr<OctomapServer> server_;
+};
+
+}  // namespace morefusion_ros
+
+PLUGINLIB_EXPORT_CLASS(morefusion_ros::OctomapServerNodelet, nodelet::Nodelet)
@@ -0,0 +1,201 @@
+// Copyright (c) 2019 Kentaro Wada
+//
+// Replay a log recorded by OctomapServer (~record/path) through the
+// integration path of OctomapServer with MultiInstanceMapping, without a ROS
+// master or TF, as fast as possible or at a fixed rate, and report the frame
+// rate and the latencies of each stage, e.g.:
+//
+//   rosrun morefusion_ros mapping_replay frames.log
+//   rosrun morefusion_ros mapping_replay frames.log --rate 30
+//
+// The mapping parameters are those of the recording, unless overridden. The
+// recorded resets clear the map, and the frames captured before the last reset
+// are dropped, as in OctomapServer::integrateFrame.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/make_shared.hpp>
+#include <opencv2/opencv.hpp>
+
+#include "morefusion_ros/FrameLog.h"
+#include "morefusion_ros/MultiInstanceMapping.h"
+#include "morefusion_ros/utils/camera.h"
+#include "morefusion_ros/utils/stats.h"
+
+namespace {
+
+void printUsage(const char* program) {
+  std::cerr << "Usage: " << program << " LOG [--rate HZ] [--max-frames N] [--repeat N]"
+            << " [--render-mode raycast|rasterize] [--resolution METERS]" << std::endl;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    printUsage(argv[0]);
+    return 1;
+  }
+  std::string log_file = argv[1];
+  morefusion_ros::FrameLogReader log;
+  if (!log.open(log_file)) {
+    std::cerr << "Can't open the frames log: " << log_file << std::endl;
+    return 1;
+  }
+  if (log.isTruncated()) {
+    std::cerr << "Ignoring the truncated record at the end of: " << log_file << std::endl;
+  }
+
+  double rate = 0;  // as fast as possible
+  int max_frames = -1;
+  int repeat = 1;
+  morefusion_ros::MultiInstanceMapping::Params params = log.params();
+  for (int i = 2; i < argc; i++) {
+    std::string arg = argv[i];
+    if (i + 1 >= argc) {
+      printUsage(argv[0]);
+      return 1;
+    }
+    if (arg == "--rate") {
+      rate = std::atof(argv[++i]);
+    } else if (arg == "--max-frames") {
+      max_frames = std::atoi(argv[++i]);
+    } else if (arg == "--repeat") {
+      repeat = std::atoi(argv[++i]);
+    } else if (arg == "--render-mode") {
+      params.render_mode = argv[++i];
+    } else if (arg == "--resolution") {
+      params.resolution = std::atof(argv[++i]);
+    } else {
+      printUsage(argv[0]);
+      return 1;
+    }
+  }
+
+  // of records, including the resets
+  size_t num_records_log = log.numRecords();
+  if ((max_frames >= 0) && (num_records_log > static_cast<size_t>(max_frames))) {
+    num_records_log = max_frames;
+  }
+  if (num_records_log == 0) {
+    std::cerr << "No frames in: " << log_file << std::endl;
+    return 1;
+  }
+
+  morefusion_ros::utils::PipelineStats stats;
+  morefusion_ros::MultiInstanceMapping mapping(params);
+  mapping.setStats(&stats);
+
+  boost::shared_ptr<morefusion_ros::utils::CameraRays> camera_rays;
+  morefusion_ros::RecordedFrame frame;
+  cv::Mat label_ins;
+  cv::Mat label_ins_rend;
+  bool ground_as_noentry = params.ground_as_noentry;
+  bool free_as_noentry = params.free_as_noentry;
+
+  // Only the mapping is timed, not reading the frames and waiting for the rate
+  double elapsed_mapping = 0;
+  size_t num_frames = 0;
+  size_t num_frames_late = 0;
+  size_t num_frames_dropped = 0;
+  size_t num_frames_failed = 0;  // with an instance without a class
+  std::chrono::steady_clock::time_point start_replay = std::chrono::steady_clock::now();
+  for (int r = 0; r < repeat; r++) {
+    if (r > 0) {
+      mapping.reset();
+    }
+    int64_t reset_stamp = 0;  // logs of the version 1 have no resets
+    for (size_t index = 0; index < num_records_log; index++) {
+      log.read(index, &frame);
+      if (frame.is_reset) {
+        mapping.reset();
+        reset_stamp = frame.stamp;
+        continue;
+      }
+      if (frame.stamp < reset_stamp) {
+        num_frames_dropped++;
+        continue;
+      }
+
+      if (rate > 0) {
+        std::chrono::steady_clock::time_point due = start_replay +
+          std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double>(num_frames / rate));
+        if (std::chrono::steady_clock::now() > due) {
+          num_frames_late++;
+        }
+        std::this_thread::sleep_until(due);
+      }
+
+      morefusion_ros::MultiInstanceMapping::SensorFrame& sensor = frame.sensor;
+      if (!camera_rays ||
+          !camera_rays->matches(sensor.fx, sensor.fy, sensor.cx, sensor.cy,
+                                sensor.width, sensor.height)) {
+        camera_rays = boost::make_shared<morefusion_ros::utils::CameraRays>();
+        camera_rays->update(sensor.fx, sensor.fy, sensor.cx, sensor.cy,
+                            sensor.width, sensor.height);
+      }
+      sensor.camera_rays = camera_rays;
+
+      // same as OctomapServer::integrateFrame, with the rendering of the map
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      {
+        morefusion_ros::utils::ScopedTimer timer(&stats, "integrate");
+        sensor.setPose(frame.sensorToWorld);
+        if ((frame.ground_as_noentry != ground_as_noentry) ||
+            (frame.free_as_noentry != free_as_noentry)) {
+          ground_as_noentry = frame.ground_as_noentry;
+          free_as_noentry = frame.free_as_noentry;
+          mapping.setNoEntry(ground_as_noentry, free_as_noentry);
+        }
+        sensor.label_ins.copyTo(label_ins);
+        std::map<int, unsigned> instance_id_to_class_id;
+        for (const morefusion_ros::FrameLogClass& cls : frame.classes) {
+          instance_id_to_class_id.insert(std::make_pair(cls.instance_id, cls.class_id));
+        }
+        // the frame is still counted and the replay goes on, as in OctomapServer
+        if (!mapping.integrate(sensor, label_ins, &instance_id_to_class_id, label_ins_rend)) {
+          std::cerr << "Can't find the class of an instance in the frame at "
+                    << frame.stamp * 1e-9 << std::endl;
+          num_frames_failed++;
+        }
+      }
+      std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+      elapsed_mapping += elapsed.count();
+      num_frames++;
+    }
+  }
+
+  std::map<std::string, morefusion_ros::utils::LatencyHistogram> latencies;
+  std::map<std::string, double> values;
+  stats.takeWindow(&latencies, &values);
+
+  printf("frames: %zu (dropped: %zu, failed: %zu), render_mode: %s, resolution: %.3f\n",
+         num_frames, num_frames_dropped, num_frames_failed,
+         mapping.params().render_mode.c_str(), params.resolution);
+  printf("fps: %.2f (%.3f s of mapping)\n", num_frames / elapsed_mapping, elapsed_mapping);
+  if (rate > 0) {
+    printf("rate: %.2f Hz, frames late: %zu\n", rate, num_frames_late);
+  }
+  printf("%-20s %10s %10s %10s %10s\n", "stage [ms]", "p50", "p95", "p99", "max");
+  const char* stages[] = {
+    "render", "track_instance_id", "insert_scan", "update_grids", "integrate"};
+  for (const char* stage : stages) {
+    const morefusion_ros::utils::LatencyHistogram& latency = latencies[stage];
+    printf("%-20s %10.2f %10.2f %10.2f %10.2f\n", stage,
+           latency.percentile(0.50) * 1e3, latency.percentile(0.95) * 1e3,
+           latency.percentile(0.99) * 1e3, latency.max() * 1e3);
+  }
+  for (std::map<std::string, double>::const_iterator it = values.begin(); it != values.end();
+       it++) {
+    printf("%s (last frame): %.0f\n", it->first.c_str(), it->second);
+  }
+  return 0;
+}
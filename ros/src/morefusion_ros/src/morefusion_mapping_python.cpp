@@ -0,0 +1,357 @@
+// Copyright (c) 2019 Kentaro Wada
+//
+// Python module morefusion_mapping: bindings of the mapping engines, used by
+// morefusion.contrib.MultiInstanceOctreeMapping if it can be imported.
+// Arrays are passed without copies when they are C-contiguous with the dtype
+// of the engine, and outputs are written into arrays owned by Python.
+// Only the API of pybind11 2.0 (ROS Melodic) is used.
+
+#include <pybind11/pybind11.h>
+#include <pybind11/numpy.h>
+#include <pybind11/stl.h>
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/make_shared.hpp>
+#include <opencv2/opencv.hpp>
+
+#include "morefusion_ros/MultiInstanceMapping.h"
+#include "morefusion_ros/MultiInstanceOctreeMapping.h"
+#include "morefusion_ros/utils/camera.h"
+
+namespace py = pybind11;
+
+namespace {
+
+typedef py::array_t<double, py::array::c_style | py::array::forcecast> ArrayDouble;
+typedef py::array_t<float, py::array::c_style | py::array::forcecast> ArrayFloat;
+typedef py::array_t<int32_t, py::array::c_style | py::array::forcecast> ArrayInt32;
+typedef py::array_t<uint16_t, py::array::c_style | py::array::forcecast> ArrayUInt16;
+typedef py::array_t<bool, py::array::c_style | py::array::forcecast> ArrayBool;
+
+template<typename... Ix>
+std::vector<size_t> toShape(Ix... sizes) {
+  return std::vector<size_t>{static_cast<size_t>(sizes)...};
+}
+
+// numpy array of a copy of the values
+template<typename T>
+py::array_t<T> toArray(const std::vector<T>& values, const std::vector<size_t>& shape) {
+  py::array_t<T> array(shape);
+  std::copy(values.begin(), values.end(), array.mutable_data());
+  return array;
+}
+
+// cv::Mat that shares the buffer of a 2-dimensional array. Inputs are never
+// written through it, so that read-only arrays are also accepted.
+template<typename T>
+cv::Mat toMat(const py::array_t<T, py::array::c_style | py::array::forcecast>& array, int type) {
+  if (array.ndim() != 2) {
+    throw py::value_error("image must be 2-dimensional");
+  }
+  return cv::Mat(array.shape(0), array.shape(1), type, const_cast<T*>(array.data()));
+}
+
+void checkPoints(const py::array& points, int ndim) {
+  if ((points.ndim() != ndim) || (points.shape(ndim - 1) != 3)) {
+    throw py::value_error("points must be of shape (..., 3) with ndim " + std::to_string(ndim));
+  }
+}
+
+void checkSize3(const ArrayDouble& point) {
+  if (point.size() != 3) {
+    throw py::value_error("origin must be of size 3");
+  }
+}
+
+Eigen::Matrix4f toMatrix4f(const ArrayDouble& matrix) {
+  if ((matrix.ndim() != 2) || (matrix.shape(0) != 4) || (matrix.shape(1) != 4)) {
+    throw py::value_error("transform must be of shape (4, 4)");
+  }
+  Eigen::Matrix4f out;
+  for (int j = 0; j < 4; j++) {
+    for (int i = 0; i < 4; i++) {
+      out(j, i) = matrix.at(j, i);
+    }
+  }
+  return out;
+}
+
+class PyMultiInstanceOctreeMapping {
+ public:
+  std::vector<int> instanceIds() const { return mapping_.instanceIds(); }
+
+  void initialize(int instance_id, double pitch) {
+    if (!mapping_.initialize(instance_id, pitch)) {
+      throw py::value_error("instance " + std::to_string(instance_id) + " already exists");
+    }
+  }
+
+  void integrate(int instance_id, ArrayBool mask, ArrayDouble pcd, ArrayDouble origin) {
+    checkInstance(instance_id);
+    checkPoints(pcd, 3);
+    if ((mask.ndim() != 2) || (mask.shape(0) != pcd.shape(0)) || (mask.shape(1) != pcd.shape(1))) {
+      throw py::value_error("mask must be of shape (H, W) of pcd");
+    }
+    checkSize3(origin);
+    octomap::point3d sensor_origin(origin.data()[0], origin.data()[1], origin.data()[2]);
+    const bool* m = mask.data();
+    const double* p = pcd.data();
+    size_t size = mask.size();
+    py::gil_scoped_release release;
+    octomap::Pointcloud points;
+    for (size_t index = 0; index < size; index++) {
+      const double* xyz = p + 3 * index;
+      if (!m[index] || std::isnan(xyz[0]) || std::isnan(xyz[1]) || std::isnan(xyz[2])) {
+        continue;
+      }
+      points.push_back(xyz[0], xyz[1], xyz[2]);
+    }
+    mapping_.integrate(instance_id, points, sensor_origin);
+  }
+
+  void update(int instance_id, ArrayDouble occupied) {
+    checkInstance(instance_id);
+    if (occupied.size() == 0) {
+      return;
+    }
+    checkPoints(occupied, 2);
+    std::vector<octomap::point3d> points;
+    points.reserve(occupied.shape(0));
+    for (size_t i = 0; i < static_cast<size_t>(occupied.shape(0)); i++) {
+      points.push_back(octomap::point3d(occupied.at(i, 0), occupied.at(i, 1), occupied.at(i, 2)));
+    }
+    py::gil_scoped_release release;
+    mapping_.update(instance_id, points);
+  }
+
+  py::tuple getTargetGrids(
+      int target_id,
+      const std::vector<int>& dimensions,
+      double pitch,
+      ArrayDouble origin) {
+    checkInstance(target_id);
+    if (dimensions.size() != 3) {
+      throw py::value_error("dimensions must be of size 3");
+    }
+    checkSize3(origin);
+    int dims[3] = {dimensions[0], dimensions[1], dimensions[2]};
+    double grid_origin[3] = {origin.data()[0], origin.data()[1], origin.data()[2]};
+    ArrayFloat grid_target(toShape(dims[0], dims[1], dims[2]));
+    ArrayFloat grid_nontarget(toShape(dims[0], dims[1], dims[2]));
+    ArrayFloat grid_empty(toShape(dims[0], dims[1], dims[2]));
+    float* target = grid_target.mutable_data();
+    float* nontarget = grid_nontarget.mutable_data();
+    float* empty = grid_empty.mutable_data();
+    {
+      py::gil_scoped_release release;
+      mapping_.getTargetGrids(target_id, dims, pitch, grid_origin, target, nontarget, empty);
+    }
+    return py::make_tuple(grid_target, grid_nontarget, grid_empty);
+  }
+
+  py::tuple getTargetPcds(int target_id) {
+    checkInstance(target_id);
+    std::vector<double> occupied;
+    std::vector<double> empty;
+    {
+      py::gil_scoped_release release;
+      mapping_.getTargetPoints(target_id, &occupied, &empty);
+    }
+    return py::make_tuple(toArray(occupied, toShape(occupied.size() / 3, 3)),
+                          toArray(empty, toShape(empty.size() / 3, 3)));
+  }
+
+ private:
+  void checkInstance(int instance_id) const {
+    if (!mapping_.hasInstance(instance_id)) {
+      throw py::key_error(std::to_string(instance_id));
+    }
+  }
+
+  morefusion_ros::MultiInstanceOctreeMapping mapping_;
+};
+
+class PyMultiInstanceMapping {
+ public:
+  PyMultiInstanceMapping(double resolution, const std::string& render_mode, double max_range)
+    : mapping_(toParams(resolution, render_mode, max_range)),
+      camera_rays_(boost::make_shared<morefusion_ros::utils::CameraRays>()) {}
+
+  // depth: uint16 in depth_unit or float32 in meters, shared with the frame
+  void setFrame(py::array depth, ArrayDouble K, ArrayDouble T_cam2world, float depth_unit) {
+    if ((K.ndim() != 2) || (K.shape(0) != 3) || (K.shape(1) != 3)) {
+      throw py::value_error("K must be of shape (3, 3)");
+    }
+    if (depth.attr("dtype").attr("name").cast<std::string>() == "uint16") {
+      ArrayUInt16 depth_uint16(depth);
+      frame_.depth = toMat(depth_uint16, CV_16UC1);
+      depth_ = depth_uint16;
+    } else {
+      ArrayFloat depth_float(depth);
+      frame_.depth = toMat(depth_float, CV_32FC1);
+      depth_ = depth_float;
+    }
+    frame_.width = frame_.depth.cols;
+    frame_.height = frame_.depth.rows;
+    frame_.fx = K.at(0, 0);
+    frame_.fy = K.at(1, 1);
+    frame_.cx = K.at(0, 2);
+    frame_.cy = K.at(1, 2);
+    frame_.depth_unit = depth_unit;
+    camera_rays_->update(
+      frame_.fx, frame_.fy, frame_.cx, frame_.cy, frame_.width, frame_.height);
+    frame_.camera_rays = camera_rays_;
+    frame_.setPose(toMatrix4f(T_cam2world));
+  }
+
+  ArrayInt32 render() {
+    checkFrame();
+    ArrayInt32 label_ins_rend(toShape(frame_.height, frame_.width));
+    cv::Mat rend = toMat(label_ins_rend, CV_32SC1);
+    py::gil_scoped_release release;
+    mapping_.render(frame_, rend);
+    return label_ins_rend;
+  }
+
+  py::tuple trackInstanceIds(
+      ArrayInt32 label_ins_rend,
+      ArrayInt32 label_ins,
+      std::map<int, unsigned> instance_id_to_class_id) {
+    // both are modified by the tracking, so the inputs are copied
+    cv::Mat rend = toMat(label_ins_rend, CV_32SC1).clone();
+    if (toMat(label_ins, CV_32SC1).size() != rend.size()) {
+      throw py::value_error("label_ins must be of the shape of label_ins_rend");
+    }
+    ArrayInt32 label_ins_tracked(toShape(label_ins.shape(0), label_ins.shape(1)));
+    cv::Mat tracked = toMat(label_ins_tracked, CV_32SC1);
+    toMat(label_ins, CV_32SC1).copyTo(tracked);
+    {
+      py::gil_scoped_release release;
+      mapping_.trackInstanceIds(rend, &tracked, &instance_id_to_class_id);
+    }
+    return py::make_tuple(label_ins_tracked, instance_id_to_class_id);
+  }
+
+  void insertScan(ArrayInt32 label_ins, const std::map<int, unsigned>& instance_id_to_class_id) {
+    checkFrame();
+    cv::Mat label = toMat(label_ins, CV_32SC1);
+    if (label.size() != frame_.depth.size()) {
+      throw py::value_error("label_ins must be of the shape of depth");
+    }
+    bool ok;
+    {
+      py::gil_scoped_release release;
+      ok = mapping_.insertScan(frame_, label, instance_id_to_class_id);
+    }
+    if (!ok) {
+      throw py::key_error("an instance in label_ins has no class in instance_id_to_class_id");
+    }
+  }
+
+  void updateGrids() {
+    checkFrame();
+    py::gil_scoped_release release;
+    mapping_.updateGrids(frame_.sensorToWorld);
+  }
+
+  py::list getGridsInWorldFrame() const {
+    std::vector<morefusion_ros::MultiInstanceMapping::Grid> grids;
+    {
+      py::gil_scoped_release release;
+      mapping_.getGridsInWorldFrame(&grids);
+    }
+    py::list out;
+    for (morefusion_ros::MultiInstanceMapping::Grid& grid : grids) {
+      py::dict d;
+      d["instance_id"] = grid.instance_id;
+      d["class_id"] = grid.class_id;
+      d["origin"] = py::make_tuple(grid.origin(0), grid.origin(1), grid.origin(2));
+      d["pitch"] = grid.pitch;
+      d["dims"] = py::make_tuple(grid.dims[0], grid.dims[1], grid.dims[2]);
+      d["indices"] = toArray(grid.indices, toShape(grid.indices.size()));
+      d["values"] = toArray(grid.values, toShape(grid.values.size()));
+      out.append(d);
+    }
+    return out;
+  }
+
+  void reset() { mapping_.reset(); }
+
+ private:
+  static morefusion_ros::MultiInstanceMapping::Params toParams(
+      double resolution, const std::string& render_mode, double max_range) {
+    morefusion_ros::MultiInstanceMapping::Params params;
+    params.resolution = resolution;
+    params.render_mode = render_mode;
+    params.max_range = max_range;
+    return params;
+  }
+
+  void checkFrame() const {
+    if (frame_.depth.empty()) {
+      throw py::value_error("set_frame() must be called first");
+    }
+  }
+
+  morefusion_ros::MultiInstanceMapping mapping_;
+  morefusion_ros::MultiInstanceMapping::SensorFrame frame_;
+  py::array depth_;  // owner of the buffer of frame_.depth
+  boost::shared_ptr<morefusion_ros::utils::CameraRays> camera_rays_;
+};
+
+void defineModule(py::module& m) {
+  m.attr("__doc__") = "C++ mapping engines of morefusion_ros";
+
+  py::class_<PyMultiInstanceOctreeMapping>(m, "MultiInstanceOctreeMapping")
+    .def(py::init<>())
+    .def_property_readonly("instance_ids", &PyMultiInstanceOctreeMapping::instanceIds)
+    .def("initialize", &PyMultiInstanceOctreeMapping::initialize,
+         py::arg("instance_id"), py::arg("pitch"))
+    .def("integrate", &PyMultiInstanceOctreeMapping::integrate,
+         py::arg("instance_id"), py::arg("mask"), py::arg("pcd"),
+         py::arg("origin") = std::vector<double>{0, 0, 0})
+    .def("update", &PyMultiInstanceOctreeMapping::update,
+         py::arg("instance_id"), py::arg("occupied"))
+    .def("get_target_grids", &PyMultiInstanceOctreeMapping::getTargetGrids,
+         py::arg("target_id"), py::arg("dimensions"), py::arg("pitch"), py::arg("origin"))
+    .def("get_target_pcds", &PyMultiInstanceOctreeMapping::getTargetPcds,
+         py::arg("target_id"));
+
+  py::class_<PyMultiInstanceMapping>(m, "MultiInstanceMapping")
+    .def(py::init<double, const std::string&, double>(),
+         py::arg("resolution") = 0.01, py::arg("render_mode") = "raycast",
+         py::arg("max_range") = -1.0)
+    .def("set_frame", &PyMultiInstanceMapping::setFrame,
+         py::arg("depth"), py::arg("K"), py::arg("T_cam2world"), py::arg("depth_unit") = 0.001)
+    .def("render", &PyMultiInstanceMapping::render)
+    .def("track_instance_ids", &PyMultiInstanceMapping::trackInstanceIds,
+         py::arg("label_ins_rend"), py::arg("label_ins"), py::arg("instance_id_to_class_id"))
+    .def("insert_scan", &PyMultiInstanceMapping::insertScan,
+         py::arg("label_ins"), py::arg("instance_id_to_class_id"))
+    .def("update_grids", &PyMultiInstanceMapping::updateGrids)
+    .def("get_grids_in_world_frame", &PyMultiInstanceMapping::getGridsInWorldFrame)
+    .def("reset", &PyMultiInstanceMapping::reset);
+}
+
+}  // namespace
+
+// PYBIND11_MODULE is from pybind11 2.2, and PYBIND11_PLUGIN is deprecated since then
+#ifdef PYBIND11_MODULE
+PYBIND11_MODULE(morefusion_mapping, m) {
+  defineModule(m);
+}
+#else
+PYBIND11_PLUGIN(morefusion_mapping) {
+  py::module m("morefusion_mapping");
+  defineModule(m);
+  return m.ptr();
+}
+#endif
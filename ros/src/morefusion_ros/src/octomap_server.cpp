@@ -0,0 +1,10 @@
+// Copyright (c) 2019 Kentaro Wada
+
+#include "morefusion_ros/OctomapServer.h"
+
+int main(int argc, char** argv) {
+  ros::init(argc, argv, "octomap_server");
+  morefusion_ros::OctomapServer server;
+  ros::spin();
+  return 0;
+}
@@ -0,0 +1,53 @@
+import numpy as np
+import pytest
+import trimesh
+
+from morefusion.contrib import multi_instance_octree_mapping
+from morefusion.contrib import MultiInstanceOctreeMapping
+from morefusion.geometry import pointcloud_from_depth
+
+
+@pytest.mark.skipif(
+    multi_instance_octree_mapping.morefusion_mapping is None,
+    reason="morefusion_mapping is not built",
+)
+def test_multi_instance_octree_mapping_backends():
+    H, W = 120, 160
+    K = trimesh.scene.Camera(resolution=(W, H), fov=(60, 45)).K
+
+    random_state = np.random.RandomState(0)
+    depth = random_state.uniform(0.4, 0.6, (H, W))
+    depth[random_state.uniform(size=(H, W)) < 0.1] = np.nan
+    pcd = pointcloud_from_depth(
+        depth, fx=K[0, 0], fy=K[1, 1], cx=K[0, 2], cy=K[1, 2]
+    )
+    label = np.zeros((H, W), dtype=np.int32)
+    label[30:90, 40:80] = 1
+    label[20:100, 90:140] = 2
+
+    results = []
+    for backend in ["python", "cpp"]:
+        mapping = MultiInstanceOctreeMapping(backend=backend)
+        mapping.initialize(1, pitch=0.005)
+        mapping.integrate(1, label == 1, pcd)
+        mapping.initialize(2, pitch=0.008)
+        mapping.integrate(2, label == 2, pcd)
+        mapping.initialize(0, pitch=0.01)
+        mapping.integrate(0, label == 0, pcd)
+        mapping.update(1, np.array([[0, 0, 0.5], [0.01, 0, 0.5]]))
+
+        center = np.nanmedian(pcd[label == 1], axis=0)
+        origin = center - (32 / 2 - 0.5) * 0.005
+        grids = mapping.get_target_grids(
+            1, dimensions=(32, 32, 32), pitch=0.005, origin=origin
+        )
+        pcds = mapping.get_target_pcds(2)
+        results.append((mapping.instance_ids, grids, pcds))
+
+    (ids_py, grids_py, pcds_py), (ids_cpp, grids_cpp, pcds_cpp) = results
+    assert ids_py == ids_cpp
+    for grid_py, grid_cpp in zip(grids_py, grids_cpp):
+        assert grid_cpp.dtype == np.float32
+        np.testing.assert_array_equal(grid_py, grid_cpp)
+    for points_py, points_cpp in zip(pcds_py, pcds_cpp):
+        np.testing.assert_allclose(points_py, points_cpp, atol=1e-6)